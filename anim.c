@@ -0,0 +1,231 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Plays animations from the asset partition without holding them in RAM.
+ * Each frame is stored as the rows that changed since the one before:
+ *
+ *   u16 ms		How long the frame stays up (little endian)
+ *   u8 rows		Bit per row that changes, bit 0 the top
+ *   ...		For each of those rows, a byte per 8 pixels across
+ *
+ * starting from a blank display. The records are read out of flash a small
+ * burst at a time. The next frame is decoded into a back buffer as soon as
+ * the current one is up, so when its time comes all that's left is to send
+ * the rows that changed.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+
+#include "anim.h"
+#include "assets.h"
+#include "max7219.h"
+
+/* Bytes read from flash at a time */
+#define ANIM_BURST	32
+/* As wide as the display */
+#define ANIM_MAX_WIDTH	32
+/* A frame this much after its time counts as late */
+#define ANIM_LATE_US	2000
+
+static struct {
+	const struct asset_entry *entry;
+	anim_done_cb done;
+	uint32_t burst[ANIM_BURST / 4];
+	uint32_t burst_pos;	/* Stream offset burst[] was read from */
+	bool burst_valid;
+	uint32_t pos;		/* Next byte of the stream to decode */
+	uint16_t frame;		/* Frames decoded so far */
+	uint16_t ms;		/* How long the decoded frame stays up */
+	uint8_t rows;		/* Rows it changes */
+	uint8_t back[8 * ANIM_MAX_WIDTH / 8];
+	uint32_t due_us;	/* When the decoded frame should go up */
+	bool playing;
+	bool last;		/* Showing the final frame */
+	os_timer_t timer;
+
+	/* How well we kept up */
+	uint16_t shown;
+	uint16_t late;
+	uint32_t late_max_us;
+	uint32_t late_total_us;
+	uint32_t show_max_us;
+	uint32_t decode_max_us;
+} anim;
+
+static bool ICACHE_FLASH_ATTR anim_byte(uint8_t *byte)
+{
+	uint32_t offset = anim.pos - anim.burst_pos;
+	uint32_t len;
+
+	if (!anim.burst_valid || anim.pos < anim.burst_pos ||
+			offset >= ANIM_BURST) {
+		anim.burst_pos = anim.pos & ~3;
+		offset = anim.pos - anim.burst_pos;
+		if (anim.burst_pos >= anim.entry->stride) {
+			return false;
+		}
+		len = anim.entry->stride - anim.burst_pos;
+		if (len > ANIM_BURST) {
+			len = ANIM_BURST;
+		}
+		if (!asset_stream(anim.entry, anim.burst_pos, anim.burst,
+				len)) {
+			return false;
+		}
+		anim.burst_valid = true;
+	}
+
+	*byte = ((uint8_t *) anim.burst)[offset];
+	anim.pos++;
+
+	return true;
+}
+
+/* Apply the next frame's changes to the back buffer */
+static bool ICACHE_FLASH_ATTR anim_decode(void)
+{
+	uint8_t lo, hi, y, block;
+
+	if (anim.frame >= anim.entry->count ||
+			!anim_byte(&lo) || !anim_byte(&hi) ||
+			!anim_byte(&anim.rows)) {
+		return false;
+	}
+	anim.ms = lo | (hi << 8);
+
+	for (y = 0; y < 8; y++) {
+		if (!(anim.rows & (1 << y))) {
+			continue;
+		}
+		for (block = 0; block < anim.entry->width / 8; block++) {
+			if (!anim_byte(&anim.back[y + (block << 3)])) {
+				return false;
+			}
+		}
+	}
+	anim.frame++;
+
+	return true;
+}
+
+static void ICACHE_FLASH_ATTR anim_print_stats(void)
+{
+	char name[ASSET_NAME_LEN + 1];
+
+	os_memcpy(name, anim.entry->name, ASSET_NAME_LEN);
+	name[ASSET_NAME_LEN] = '\0';
+
+	os_printf("Animation %s: %u frames, %u late (max %u us, "
+		"average %u us), show max %u us, decode max %u us.\n",
+		name, anim.shown, anim.late, anim.late_max_us,
+		anim.shown ? anim.late_total_us / anim.shown : 0,
+		anim.show_max_us, anim.decode_max_us);
+}
+
+static void ICACHE_FLASH_ATTR anim_tick(void *arg)
+{
+	uint32_t now, late, took;
+	int32_t wait;
+
+	if (anim.last) {
+		anim_stop();
+		return;
+	}
+
+	now = system_get_time();
+	late = (int32_t) (now - anim.due_us) > 0 ? now - anim.due_us : 0;
+	anim.late_total_us += late;
+	if (late > anim.late_max_us) {
+		anim.late_max_us = late;
+	}
+	if (late > ANIM_LATE_US) {
+		anim.late++;
+	}
+
+	/* The first frame replaces whatever was there before */
+	if (anim.shown++ == 0) {
+		anim.rows = 0xFF;
+	}
+	max7219_load_rows(anim.back, anim.entry->width, anim.rows);
+	max7219_show_rows(anim.rows);
+	took = system_get_time() - now;
+	if (took > anim.show_max_us) {
+		anim.show_max_us = took;
+	}
+
+	anim.due_us += anim.ms * 1000;
+
+	now = system_get_time();
+	if (!anim_decode()) {
+		/* That was the last one; leave it up for its time */
+		anim.last = true;
+	}
+	took = system_get_time() - now;
+	if (took > anim.decode_max_us) {
+		anim.decode_max_us = took;
+	}
+
+	wait = anim.due_us - system_get_time();
+	os_timer_arm(&anim.timer, wait > 0 ? (wait + 500) / 1000 : 0, 0);
+}
+
+/* Play the named animation from the asset partition, if there is one */
+bool ICACHE_FLASH_ATTR anim_play(const char *name, anim_done_cb done)
+{
+	const struct asset_entry *entry = asset_find(name, ASSET_ANIM);
+
+	if (entry == NULL || entry->width > ANIM_MAX_WIDTH) {
+		return false;
+	}
+
+	anim_stop();
+	os_memset(&anim, 0, sizeof(anim));
+	anim.entry = entry;
+	anim.done = done;
+	if (!anim_decode()) {
+		return false;
+	}
+	anim.playing = true;
+
+	max7219_clear();
+	anim.due_us = system_get_time();
+	os_timer_setfn(&anim.timer, anim_tick, NULL);
+	os_timer_arm(&anim.timer, 0, 0);
+
+	return true;
+}
+
+void ICACHE_FLASH_ATTR anim_stop(void)
+{
+	if (!anim.playing) {
+		return;
+	}
+
+	os_timer_disarm(&anim.timer);
+	anim.playing = false;
+	anim_print_stats();
+
+	if (anim.done != NULL) {
+		anim.done();
+	}
+}
+
+bool ICACHE_FLASH_ATTR anim_playing(void)
+{
+	return anim.playing;
+}
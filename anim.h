@@ -0,0 +1,29 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ANIM_H_
+#define _ANIM_H_
+
+#include <c_types.h>
+
+/* Called once the last frame has been up for its time, or on anim_stop() */
+typedef void (*anim_done_cb)(void);
+
+bool ICACHE_FLASH_ATTR anim_play(const char *name, anim_done_cb done);
+void ICACHE_FLASH_ATTR anim_stop(void);
+bool ICACHE_FLASH_ATTR anim_playing(void);
+
+#endif /* _ANIM_H_ */
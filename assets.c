@@ -0,0 +1,205 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Fonts and animations live in their own flash partition, built by
+ * tools/mkassets.py, so they can be changed without a firmware upgrade.
+ * Only the directory is kept in RAM; glyphs and frames are read out of
+ * flash as they're drawn. The blob is checked against its MD5 before we
+ * trust any of it, which also catches one that was only partly written,
+ * and if it's missing or bad the built in fonts get used instead.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+#include <spi_flash.h>
+
+#include "assets.h"
+#include "max7219.h"
+
+static struct {
+	uint16_t version;
+	uint16_t count;
+	struct asset_entry dir[ASSET_MAX];
+} assets;
+
+/* Hash the blob straight out of flash */
+static bool ICACHE_FLASH_ATTR asset_check_md5(const struct asset_header *hdr)
+{
+	struct MD5Context ctx;
+	uint8_t digest[MD5_LEN];
+	uint32_t buf[64];
+	uint32_t pos, len;
+
+	MD5Init(&ctx);
+	for (pos = sizeof(*hdr); pos < hdr->len; pos += len) {
+		len = hdr->len - pos;
+		if (len > sizeof(buf)) {
+			len = sizeof(buf);
+		}
+		if (spi_flash_read(ASSET_BASE + pos, buf, (len + 3) & ~3) !=
+				SPI_FLASH_RESULT_OK) {
+			return false;
+		}
+		MD5Update(&ctx, buf, len);
+	}
+	MD5Final(digest, &ctx);
+
+	return os_memcmp(digest, hdr->md5, MD5_LEN) == 0;
+}
+
+static bool ICACHE_FLASH_ATTR asset_entry_ok(const struct asset_entry *entry,
+		uint32_t len)
+{
+	if (entry->stride & 3 || entry->stride == 0) {
+		return false;
+	}
+	if (entry->type == ASSET_FONT && (entry->stride < 9 ||
+			entry->stride > 16)) {
+		return false;
+	}
+	if (entry->type == ASSET_ANIM && (entry->width & 7 ||
+			entry->width == 0)) {
+		return false;
+	}
+	if (entry->type == ASSET_ANIM) {
+		return entry->offset >= sizeof(struct asset_header) &&
+			entry->offset <= len &&
+			entry->stride <= len - entry->offset;
+	}
+
+	return entry->offset >= sizeof(struct asset_header) &&
+		entry->offset <= len &&
+		entry->count <= (len - entry->offset) / entry->stride;
+}
+
+/* (Re)load the directory; called at boot and after an asset upgrade */
+bool ICACHE_FLASH_ATTR asset_init(void)
+{
+	struct asset_header hdr;
+	int i;
+
+	asset_drop();
+
+	if (spi_flash_read(ASSET_BASE, (uint32_t *) &hdr, sizeof(hdr)) !=
+			SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+	if (hdr.magic != ASSET_MAGIC) {
+		os_printf("No assets; using built in fonts.\n");
+		return false;
+	}
+	if (hdr.count > ASSET_MAX || hdr.len > ASSET_SIZE ||
+			hdr.len < sizeof(hdr) +
+			hdr.count * sizeof(struct asset_entry) ||
+			!asset_check_md5(&hdr)) {
+		os_printf("Assets are corrupt; using built in fonts.\n");
+		return false;
+	}
+
+	if (spi_flash_read(ASSET_BASE + sizeof(hdr), (uint32_t *) assets.dir,
+			hdr.count * sizeof(struct asset_entry)) !=
+			SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+	for (i = 0; i < hdr.count; i++) {
+		if (!asset_entry_ok(&assets.dir[i], hdr.len)) {
+			os_printf("Bad asset entry %d; using built in fonts.\n",
+				i);
+			return false;
+		}
+	}
+
+	assets.version = hdr.version;
+	assets.count = hdr.count;
+	os_printf("Assets version %u, %u entries.\n", assets.version,
+		assets.count);
+
+	return true;
+}
+
+/* Stop using the assets until asset_init() is next called */
+void ICACHE_FLASH_ATTR asset_drop(void)
+{
+	assets.version = 0;
+	assets.count = 0;
+}
+
+/* 0 if there aren't any usable assets */
+uint16_t ICACHE_FLASH_ATTR asset_version(void)
+{
+	return assets.version;
+}
+
+const struct asset_entry ICACHE_FLASH_ATTR *asset_find(const char *name,
+		uint8_t type)
+{
+	int i;
+
+	for (i = 0; i < assets.count; i++) {
+		if (assets.dir[i].type == type &&
+				os_strncmp(assets.dir[i].name, name,
+					ASSET_NAME_LEN) == 0) {
+			return &assets.dir[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Read glyph index into buf, which must hold entry->stride bytes */
+bool ICACHE_FLASH_ATTR asset_read(const struct asset_entry *entry,
+		unsigned int index, uint32_t *buf)
+{
+	if (entry->type != ASSET_FONT || index >= entry->count) {
+		return false;
+	}
+
+	return spi_flash_read(ASSET_BASE + entry->offset +
+		index * entry->stride, buf, entry->stride) ==
+		SPI_FLASH_RESULT_OK;
+}
+
+/*
+ * Read len bytes from pos into buf, for things like animations that aren't
+ * made of fixed size pieces. pos and len must be multiples of 4.
+ */
+bool ICACHE_FLASH_ATTR asset_stream(const struct asset_entry *entry,
+		uint32_t pos, uint32_t *buf, uint32_t len)
+{
+	if (pos > entry->stride || len > entry->stride - pos) {
+		return false;
+	}
+
+	return spi_flash_read(ASSET_BASE + entry->offset + pos, buf, len) ==
+		SPI_FLASH_RESULT_OK;
+}
+
+bool ICACHE_FLASH_ATTR asset_glyph(const struct asset_entry *font,
+		unsigned char c, struct fontchar *glyph)
+{
+	uint32_t buf[4];
+	uint8_t *raw = (uint8_t *) buf;
+
+	if (c < font->first || !asset_read(font, c - font->first, buf)) {
+		return false;
+	}
+
+	glyph->width = raw[0];
+	os_memcpy(glyph->bitmap, &raw[1], sizeof(glyph->bitmap));
+
+	return true;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ASSETS_H_
+#define _ASSETS_H_
+
+#include <c_types.h>
+
+#include "md5.h"
+
+/* Between the end of the first slot and the start of the second */
+#define ASSET_BASE	0x77000
+#define ASSET_SIZE	0x8000
+
+#define ASSET_MAGIC	0x41505345	/* "ESPA" */
+#define ASSET_NAME_LEN	12
+#define ASSET_MAX	16
+
+enum asset_type {
+	ASSET_FONT = 1,
+	ASSET_ANIM = 2,
+};
+
+/* At the start of the partition; everything is little endian */
+struct asset_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;		/* Entries following the header */
+	uint32_t len;		/* Of the whole blob, header included */
+	uint8_t md5[MD5_LEN];	/* Of everything after the header */
+};
+
+/*
+ * A font is count glyphs, starting at character first, each a width byte
+ * then 8 rows of bitmap. An animation is count frames of width pixels; see
+ * anim.c for how they're stored.
+ */
+struct asset_entry {
+	char name[ASSET_NAME_LEN];	/* NUL padded */
+	uint8_t type;
+	uint8_t width;		/* Animation frame width, in pixels */
+	uint16_t count;		/* Glyphs or frames */
+	uint16_t first;		/* Font: first character */
+	uint16_t stride;	/* Bytes per glyph, or for all the frames */
+	uint32_t offset;	/* From ASSET_BASE */
+};
+
+struct fontchar;
+
+bool ICACHE_FLASH_ATTR asset_init(void);
+void ICACHE_FLASH_ATTR asset_drop(void);
+uint16_t ICACHE_FLASH_ATTR asset_version(void);
+const struct asset_entry ICACHE_FLASH_ATTR *asset_find(const char *name,
+	uint8_t type);
+bool ICACHE_FLASH_ATTR asset_read(const struct asset_entry *entry,
+	unsigned int index, uint32_t *buf);
+bool ICACHE_FLASH_ATTR asset_stream(const struct asset_entry *entry,
+	uint32_t pos, uint32_t *buf, uint32_t len);
+bool ICACHE_FLASH_ATTR asset_glyph(const struct asset_entry *font,
+	unsigned char c, struct fontchar *glyph);
+
+#endif /* _ASSETS_H_ */
@@ -41,19 +41,178 @@
 
 #include <user_interface.h>
 #include <espconn.h>
-#include <mem.h>
 #include <osapi.h>
 
 #include "clock.h"
+#include "config.h"
+#include "resolv.h"
+#include "rtcmem.h"
+#include "tz.h"
 
+/* Unless the "ntp.server" config says otherwise */
 #define NTP_SERVER     "uk.pool.ntp.org"
 #define NTP_TIMEOUT_MS 5000
+// NTP 0 is 1st Jan 1900; this gets us to Unix time 0 of 1st Jan 1970
+#define NTP_UNIX_OFFSET 2208988800ULL
 
+/*
+ * The Makefile passes in when we were built; until we know better the time
+ * is assumed to be after that, which is what lets us tell which NTP era
+ * (the 32 bit seconds field wraps in 2036) a timestamp is in.
+ */
+#ifndef BUILD_TIME
+#define BUILD_TIME 1546300800ULL	/* 2019-01-01 */
+#endif
+
+/*
+ * Frequency discipline. We only trust an offset for drift estimation if
+ * it was measured over a long enough interval and is small enough to be
+ * drift rather than us having been wrong to start with.
+ */
+#define FREQ_MIN_INTERVAL_US	(15 * 60 * 1000000ULL)
+#define FREQ_MAX_OFFSET_US	500000
+#define FREQ_MAX_PPB		500000
+
+/*
+ * Leap seconds get smeared over the hour before they happen, so the
+ * display never jumps or goes backwards.
+ */
+#define LEAP_SMEAR_S		3600
+#define LEAP_SMEAR_US		(LEAP_SMEAR_S * 1000000ULL)
+
+/* How often we save our state to RTC memory */
+#define CHECKPOINT_INTERVAL_US	(10 * 1000000ULL)
+
+#ifdef CFG_LOW_POWER
+static uint32_t rtc_last_ticks;
+static uint64_t rtc_us_q12;
+#else
 static uint32_t sys_last_ticks;
-static uint32_t sys_delta;
+static uint32_t sys_wraps;
+#endif
 static os_timer_t ntp_timeout;
 
-static ip_addr_t ntp_server_ip;
+/*
+ * Our idea of the time: UTC (in microseconds) at a reference point on the
+ * system clock, plus how fast the system clock runs relative to real time.
+ */
+static struct {
+	uint64_t ref_sys_us;
+	uint64_t ref_utc_us;
+	int32_t freq;		/* Correction to apply, parts per billion */
+	bool freq_valid;
+	bool set;		/* Have we any idea what the time is? */
+	uint64_t sync_sys_us;	/* System clock at the last sync */
+	uint64_t last_sync;	/* UTC seconds at the last sync */
+	uint32_t sync_delay;	/* Round trip of the last sync, us */
+	uint8_t stratum;	/* Of the server we last synced to */
+	uint32_t root_delay;	/* Its root delay and dispersion, us */
+	uint32_t root_disp;
+	uint32_t ref_id;	/* Its IP address, as it goes on the wire */
+	int8_t leap;		/* Pending leap second: +1 insert, -1 delete */
+	uint64_t leap_at_us;	/* When it happens; midnight UTC */
+	uint64_t checkpoint_sys_us;
+} clk;
+
+/* What we keep in RTC memory over a reset */
+struct clock_checkpoint {
+	uint64_t utc_us;
+	uint64_t sys_us;
+	uint64_t sync_sys_us;
+	uint64_t last_sync;
+	uint64_t leap_at_us;
+	uint32_t rtc_ticks;
+	uint32_t rtc_cali;
+	int32_t freq;
+	uint32_t sync_delay;
+	uint32_t root_delay;
+	uint32_t root_disp;
+	uint32_t ref_id;
+	uint8_t stratum;
+	uint8_t freq_valid;
+	int8_t leap;
+	uint8_t pad;
+};
+
+/*
+ * The one NTP "connection" we use. It's created on the first sync and then
+ * kept, so syncing doesn't touch the heap. ntp_busy is set from the start
+ * of a sync until we get a reply or give up, and is what stops the hourly
+ * timer and a wifi reconnect from trampling on each other.
+ */
+static struct espconn ntp_conn;
+static esp_udp ntp_udp;
+static bool ntp_busy;
+static uint64_t ntp_sent_us;
+static uint8_t ntp_sent_stamp[8];
+
+#ifdef CFG_NTP_BROADCAST
+/*
+ * Passive mode: take our time from NTP broadcasts, or multicasts to
+ * 224.0.1.1, on the LAN, rather than every clock asking a server. We still
+ * make the odd unicast request, both to measure how long a broadcast takes
+ * to reach us and as a fallback if the broadcasts stop.
+ */
+#define NTP_LISTEN
+#define NTP_BCAST_DEF_DELAY_US	4000
+#define NTP_BCAST_MAX_DELAY_US	100000
+#define NTP_BCAST_SYNC_US	(3600 * 1000000ULL)
+#define NTP_BCAST_CALIBRATE	(24 * 3600)
+#define NTP_BCAST_STALE		(2 * 3600)
+
+static struct {
+	uint32_t delay;		/* One way, us */
+	bool calibrate;		/* Measure delay from the next broadcast */
+	bool heard;
+	uint32_t heard_at;	/* Uptime we last heard one */
+	bool calibrated;
+	uint32_t calibrated_at;	/* Uptime of the last unicast sync */
+} bcast = { .delay = NTP_BCAST_DEF_DELAY_US };
+#endif
+
+#ifdef CFG_NTP_SERVER
+/*
+ * Serve our time to other clocks once we're synced ourselves, so on an
+ * isolated network one clock can talk to the outside world for the rest.
+ * Defining CFG_NTP_SERVER_BROADCAST as well sends out broadcasts for
+ * clocks built with CFG_NTP_BROADCAST.
+ */
+#define NTP_LISTEN
+#define NTP_SERVER_MAX_AGE	(24 * 3600)	/* Stop serving after this */
+#define NTP_SERVER_BCAST_MS	(64 * 1000)
+#define NTP_PRECISION		-20		/* ~1us */
+#define NTP_PHI			15		/* Frequency tolerance, ppm */
+
+#ifdef CFG_NTP_SERVER_BROADCAST
+static os_timer_t ntp_bcast_timer;
+#endif
+#endif
+
+#ifdef NTP_LISTEN
+/* Listens on port 123 for things that aren't replies to our requests */
+static struct espconn ntp_listen_conn;
+static esp_udp ntp_listen_udp;
+#endif
+
+#ifdef CFG_NTP_BROADCAST
+/* The interface address we joined the NTP multicast group on */
+static ip_addr_t ntp_group_if;
+#endif
+
+/*
+ * Recent history of our syncs, so we can tell how well we're doing
+ * without having to watch the serial console.
+ */
+static struct {
+	int32_t offset[CLOCK_STATS_SAMPLES];
+	uint32_t delay[CLOCK_STATS_SAMPLES];
+	uint8_t head;		/* Next slot to fill */
+	uint8_t count;
+	uint32_t syncs;
+	uint32_t timeouts;
+	uint32_t dns_fails;
+	uint32_t rejects;
+} stats;
 
 /* See RFC5905 7.3 */
 typedef struct {
@@ -70,50 +229,473 @@ typedef struct {
 	uint8 trans_time[8];
 } ntp_t;
 
-void ICACHE_FLASH_ATTR set_time(uint32_t now)
+#ifdef CFG_LOW_POWER
+/*
+ * For deep sleep builds we run everything off the RTC counter, which keeps
+ * going while we're asleep. Its tick length wanders with temperature, so
+ * we pick up the current calibration every time we're called and keep the
+ * running total in 12 bit fixed point to avoid losing the fractions. Any
+ * error left after that shows up as an offset at the next sync and gets
+ * folded into clk.freq like any other drift.
+ */
+static uint64_t ICACHE_FLASH_ATTR sys_time_us(void)
 {
-	sys_last_ticks = system_get_time();
-	sys_delta = now - (sys_last_ticks / 1000000);
-}
+	uint32_t ticks;
+
+	ticks = system_get_rtc_time();
+	rtc_us_q12 += (uint64_t) (ticks - rtc_last_ticks) *
+		system_rtc_clock_cali_proc();
+	rtc_last_ticks = ticks;
 
-uint32_t ICACHE_FLASH_ATTR get_time(void)
+	return rtc_us_q12 >> 12;
+}
+#else
+/*
+ * system_get_time() is a 32 bit microsecond counter, so wraps every ~71
+ * minutes. Extend it to 64 bits; we're called at least every 10s by the
+ * display update so can't miss a wrap.
+ */
+static uint64_t ICACHE_FLASH_ATTR sys_time_us(void)
 {
 	uint32_t sys_ticks;
 
 	sys_ticks = system_get_time();
 	if (sys_ticks < sys_last_ticks) {
-		sys_delta += (1ULL << 32ULL) / 1000000;
+		sys_wraps++;
 	}
 	sys_last_ticks = sys_ticks;
 
-	return sys_ticks / 1000000 + sys_delta;
+	return ((uint64_t) sys_wraps << 32) | sys_ticks;
 }
+#endif
 
-bool ICACHE_FLASH_ATTR is_leap(uint32_t year)
+/* UTC as if there were no such thing as leap seconds */
+static uint64_t ICACHE_FLASH_ATTR clock_raw_us(uint64_t sys_us)
 {
-	return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+	int64_t elapsed = sys_us - clk.ref_sys_us;
+
+	return clk.ref_utc_us + elapsed + elapsed * clk.freq / 1000000000LL;
 }
 
-bool ICACHE_FLASH_ATTR is_dst(struct tm *time)
+/*
+ * UTC, including any leap second smear. Over the smear window we run
+ * 1/LEAP_SMEAR_S slow (or fast, for a deleted second) so that by midnight
+ * we're a full second out from the raw count, which is the same place we
+ * land once the leap is folded into the reference by clock_leap().
+ */
+static uint64_t ICACHE_FLASH_ATTR clock_utc_us(uint64_t sys_us)
 {
-	int lastsun = time->tm_mday - time->tm_wday;
+	uint64_t utc = clock_raw_us(sys_us);
+	uint64_t start;
+
+	if (clk.leap == 0) {
+		return utc;
+	}
+
+	start = clk.leap_at_us - LEAP_SMEAR_US;
+	if (utc >= clk.leap_at_us) {
+		return utc - clk.leap * 1000000LL;
+	} else if (utc >= start) {
+		return utc - clk.leap * (int64_t) ((utc - start) / LEAP_SMEAR_S);
+	}
+
+	return utc;
+}
 
-	if (time->tm_mon < 2 || time->tm_mon > 9)
+/* Once a leap second has passed, make it part of the reference */
+static void ICACHE_FLASH_ATTR clock_leap(uint64_t sys_us)
+{
+	if (clk.leap != 0 && clock_raw_us(sys_us) >= clk.leap_at_us) {
+		clk.ref_utc_us -= clk.leap * 1000000LL;
+		clk.leap = 0;
+		os_printf("Leap second applied.\n");
+	}
+}
+
+static bool ICACHE_FLASH_ATTR clock_smearing(uint64_t sys_us)
+{
+	return clk.leap != 0 &&
+		clock_raw_us(sys_us) >= clk.leap_at_us - LEAP_SMEAR_US;
+}
+
+/* Move the reference point to now, so elapsed * freq can't overflow */
+static void ICACHE_FLASH_ATTR clock_rebase(uint64_t sys_us)
+{
+	clk.ref_utc_us = clock_raw_us(sys_us);
+	clk.ref_sys_us = sys_us;
+}
+
+static void ICACHE_FLASH_ATTR clock_checkpoint(uint64_t sys_us)
+{
+	struct clock_checkpoint cp;
+
+	os_memset(&cp, 0, sizeof(cp));
+	cp.utc_us = clock_raw_us(sys_us);
+	cp.sys_us = sys_us;
+	cp.sync_sys_us = clk.sync_sys_us;
+	cp.rtc_ticks = system_get_rtc_time();
+	cp.rtc_cali = system_rtc_clock_cali_proc();
+	cp.freq = clk.freq;
+	cp.freq_valid = clk.freq_valid;
+	cp.last_sync = clk.last_sync;
+	cp.sync_delay = clk.sync_delay;
+	cp.stratum = clk.stratum;
+	cp.root_delay = clk.root_delay;
+	cp.root_disp = clk.root_disp;
+	cp.ref_id = clk.ref_id;
+	cp.leap = clk.leap;
+	cp.leap_at_us = clk.leap_at_us;
+
+	rtcmem_save(RTCMEM_CLOCK, &cp, sizeof(cp));
+	clk.checkpoint_sys_us = sys_us;
+}
+
+/*
+ * Pick up where we left off before a reset or deep sleep. The RTC counter
+ * keeps running through anything but a power cycle or external reset, and
+ * system_rtc_clock_cali_proc() tells us how long one of its ticks is
+ * (microseconds, 12 bit fixed point), so we can work out how long we were
+ * gone.
+ */
+static bool ICACHE_FLASH_ATTR clock_restore(void)
+{
+	struct rst_info *rst = system_get_rst_info();
+	struct clock_checkpoint cp;
+#ifndef CFG_LOW_POWER
+	uint32_t cali;
+#endif
+	uint64_t gone;
+
+	if (rst->reason == REASON_DEFAULT_RST ||
+			rst->reason == REASON_EXT_SYS_RST) {
+		/* RTC counter has been reset; the checkpoint is no use */
 		return false;
-	if (time->tm_mon > 2 && time->tm_mon < 9)
-		return true;
+	}
+
+	if (!rtcmem_load(RTCMEM_CLOCK, &cp, sizeof(cp))) {
+		return false;
+	}
 
+#ifdef CFG_LOW_POWER
 	/*
-	 * Starts last Sunday in March, ends last Sunday in October, which must
-	 * be at least the 25th of the month. So must be past that in March, or
-	 * before that in October, to be in DST.
+	 * Our timebase is the RTC counter, so just carry on from where it
+	 * was; the time we were asleep gets the same frequency correction as
+	 * the time we were awake, and so do the reference points.
 	 */
-	if (time->tm_mon == 2)
-		return (lastsun >= 25);
-	if (time->tm_mon == 9)
-		return (lastsun < 25);
+	rtc_us_q12 = cp.sys_us << 12;
+	rtc_last_ticks = cp.rtc_ticks;
+	gone = sys_time_us() - cp.sys_us;
 
-	return false;
+	clk.ref_sys_us = cp.sys_us;
+	clk.ref_utc_us = cp.utc_us;
+	clk.sync_sys_us = cp.sync_sys_us;
+#else
+	cali = (cp.rtc_cali + system_rtc_clock_cali_proc()) / 2;
+	gone = ((uint64_t) (system_get_rtc_time() - cp.rtc_ticks) * cali) >> 12;
+
+	clk.ref_sys_us = sys_time_us();
+	clk.ref_utc_us = cp.utc_us + gone;
+#endif
+	clk.freq = cp.freq;
+	clk.freq_valid = cp.freq_valid;
+	clk.last_sync = cp.last_sync;
+	clk.sync_delay = cp.sync_delay;
+	clk.stratum = cp.stratum;
+	clk.root_delay = cp.root_delay;
+	clk.root_disp = cp.root_disp;
+	clk.ref_id = cp.ref_id;
+	clk.leap = cp.leap;
+	clk.leap_at_us = cp.leap_at_us;
+	clk.set = true;
+
+	os_printf("Restored time from RTC memory, %u ms since checkpoint.\n",
+		(uint32_t) (gone / 1000));
+
+	return true;
+}
+
+static uint64_t ICACHE_FLASH_ATTR leap_month_end(uint64_t utc);
+
+static void ICACHE_FLASH_ATTR stats_add(int64_t offset, uint32_t delay)
+{
+	if (offset > INT32_MAX)
+		offset = INT32_MAX;
+	if (offset < -INT32_MAX)
+		offset = -INT32_MAX;
+
+	stats.offset[stats.head] = offset;
+	stats.delay[stats.head] = delay;
+	stats.head = (stats.head + 1) % CLOCK_STATS_SAMPLES;
+	if (stats.count < CLOCK_STATS_SAMPLES)
+		stats.count++;
+}
+
+/* NTP fields are big endian; we're not */
+static uint32_t ICACHE_FLASH_ATTR ntp_be32(uint32_t val)
+{
+	return (val >> 24) | ((val >> 8) & 0xFF00) |
+		((val << 8) & 0xFF0000) | (val << 24);
+}
+
+/* NTP short format (16.16 seconds) to microseconds, and back */
+static uint32_t ICACHE_FLASH_ATTR ntp_short_to_us(uint32 val)
+{
+	return ((uint64_t) ntp_be32(val) * 1000000) >> 16;
+}
+
+#ifdef CFG_NTP_SERVER
+static uint32 ICACHE_FLASH_ATTR us_to_ntp_short(uint32_t us)
+{
+	return ntp_be32(((uint64_t) us << 16) / 1000000);
+}
+#endif
+
+/*
+ * Called with the UTC time right now, as measured by NTP, how good the
+ * measurement was and the packet it came from. Steps the clock and updates
+ * our frequency estimate.
+ */
+static void ICACHE_FLASH_ATTR clock_sync(uint64_t utc_us, uint32_t delay,
+	const ntp_t *ntp, const uint8 *server)
+{
+	uint64_t sys_us = sys_time_us();
+	int64_t offset, interval;
+	int32_t err;
+	uint8_t li = ntp->options >> 6;
+
+	if (clock_smearing(sys_us)) {
+		/* Our upstream doesn't smear, so would drag us back */
+		os_printf("Ignoring sync during leap second smear.\n");
+		return;
+	}
+
+	offset = utc_us - clock_utc_us(sys_us);
+	interval = sys_us - clk.sync_sys_us;
+
+	/* The first sync just tells us the time; it's no measure of quality */
+	stats.syncs++;
+	if (clk.set)
+		stats_add(offset, delay);
+
+	/* Only measure drift against a sync from this boot */
+	if (clk.sync_sys_us != 0 && interval >= FREQ_MIN_INTERVAL_US &&
+			offset < FREQ_MAX_OFFSET_US &&
+			offset > -FREQ_MAX_OFFSET_US) {
+		err = offset * 1000000000LL / interval;
+		/* Take the first estimate whole; average after that */
+		clk.freq = clk.freq_valid ? clk.freq + err / 2 : clk.freq + err;
+		if (clk.freq > FREQ_MAX_PPB)
+			clk.freq = FREQ_MAX_PPB;
+		if (clk.freq < -FREQ_MAX_PPB)
+			clk.freq = -FREQ_MAX_PPB;
+		clk.freq_valid = true;
+	}
+
+	clk.ref_sys_us = sys_us;
+	clk.ref_utc_us = utc_us;
+	clk.sync_sys_us = sys_us;
+	clk.last_sync = utc_us / 1000000;
+	clk.sync_delay = delay;
+	clk.stratum = ntp->stratum;
+	clk.root_delay = ntp_short_to_us(ntp->root_delay);
+	clk.root_disp = ntp_short_to_us(ntp->root_disp);
+	os_memcpy(&clk.ref_id, server, 4);
+	clk.set = true;
+
+	/*
+	 * The leap indicator warns of a leap second at the end of the
+	 * current month; it gets cleared again if it's withdrawn.
+	 */
+	if (li == 1 || li == 2) {
+		clk.leap = (li == 1) ? 1 : -1;
+		clk.leap_at_us = leap_month_end(utc_us / 1000000) * 1000000ULL;
+	} else {
+		clk.leap = 0;
+	}
+
+	os_printf("Clock offset %d us, delay %u us, frequency %d ppb.\n",
+		(int32_t) offset, delay, clk.freq);
+
+	clock_checkpoint(sys_us);
+}
+
+void ICACHE_FLASH_ATTR set_time(uint64_t now)
+{
+	clk.ref_sys_us = sys_time_us();
+	clk.ref_utc_us = (uint64_t) now * 1000000;
+	clk.set = true;
+}
+
+uint64_t ICACHE_FLASH_ATTR get_time(void)
+{
+	uint64_t sys_us = sys_time_us();
+
+	clock_leap(sys_us);
+	if (sys_us - clk.ref_sys_us >= 86400 * 1000000ULL) {
+		clock_rebase(sys_us);
+	}
+	if (clk.set && sys_us - clk.checkpoint_sys_us >= CHECKPOINT_INTERVAL_US) {
+		clock_checkpoint(sys_us);
+	}
+
+	return clock_utc_us(sys_us) / 1000000;
+}
+
+/*
+ * Save our state ready for a deep sleep; we'll pick it back up in
+ * rtc_init() when we wake.
+ */
+void ICACHE_FLASH_ATTR clock_save(void)
+{
+	clock_checkpoint(sys_time_us());
+}
+
+/*
+ * Fill in our sync statistics; the sample arrays come out oldest first.
+ * Jitter is the mean size of the change in offset from one sync to the
+ * next, which needs no square roots and tells us much the same thing.
+ */
+void ICACHE_FLASH_ATTR clock_get_stats(struct clock_stats *out)
+{
+	uint8_t i, slot;
+	int64_t diff;
+	uint64_t total = 0;
+
+	os_memset(out, 0, sizeof(*out));
+	out->count = stats.count;
+	for (i = 0; i < stats.count; i++) {
+		slot = (stats.head + CLOCK_STATS_SAMPLES - stats.count + i) %
+			CLOCK_STATS_SAMPLES;
+		out->offset[i] = stats.offset[slot];
+		out->delay[i] = stats.delay[slot];
+		if (i > 0) {
+			/* Offsets of opposite signs can differ by over 2^31 */
+			diff = (int64_t) out->offset[i] - out->offset[i - 1];
+			if (diff < 0)
+				diff = -diff;
+			total += diff > INT32_MAX ? INT32_MAX : diff;
+		}
+	}
+	if (stats.count > 1)
+		out->jitter = total / (stats.count - 1);
+
+	out->stratum = clk.stratum;
+	out->freq = clk.freq;
+	out->sync_age = clk.last_sync == 0 ? UINT32_MAX :
+		clock_raw_us(sys_time_us()) / 1000000 - clk.last_sync;
+	out->syncs = stats.syncs;
+	out->timeouts = stats.timeouts;
+	out->dns_fails = stats.dns_fails;
+	out->rejects = stats.rejects;
+}
+
+/*
+ * The stats as one line of key=value pairs, for the console and for the
+ * upgrade server (see ota.c); buf needs CLOCK_STATS_LEN bytes.
+ */
+int ICACHE_FLASH_ATTR clock_format_stats(char *buf)
+{
+	struct clock_stats st;
+	int32_t offset = 0;
+	uint32_t delay = 0;
+
+	clock_get_stats(&st);
+	if (st.count > 0) {
+		offset = st.offset[st.count - 1];
+		delay = st.delay[st.count - 1];
+	}
+
+	return os_snprintf(buf, CLOCK_STATS_LEN,
+		"offset=%d delay=%u jitter=%d freq=%d "
+		"stratum=%u age=%u syncs=%u timeouts=%u dns_fails=%u "
+		"rejects=%u",
+		offset, delay, st.jitter, st.freq, st.stratum, st.sync_age,
+		st.syncs, st.timeouts, st.dns_fails, st.rejects);
+}
+
+/* One line summary, in the same spirit as heapstat_print() */
+void ICACHE_FLASH_ATTR clock_print_stats(void)
+{
+	char buf[CLOCK_STATS_LEN];
+
+	clock_format_stats(buf);
+	os_printf("Clock: %s\n", buf);
+}
+
+/* UTC seconds at the last good sync; 0 if we've never had one */
+uint64_t ICACHE_FLASH_ATTR clock_last_sync(void)
+{
+	return clk.last_sync;
+}
+
+/* Whether get_time() is returning anything like the real time yet */
+bool ICACHE_FLASH_ATTR clock_is_set(void)
+{
+	return clk.set;
+}
+
+/*
+ * Seconds since boot. Unlike get_time() this never gets stepped by NTP, so
+ * it's what should be used for timeouts and cache expiry.
+ */
+uint32_t ICACHE_FLASH_ATTR get_uptime(void)
+{
+	return sys_time_us() / 1000000;
+}
+
+bool ICACHE_FLASH_ATTR is_leap(uint32_t year)
+{
+	return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+}
+
+/*
+ * Fills in the date fields of result from a count of days since 1970-01-01
+ * (a Thursday).
+ */
+static void ICACHE_FLASH_ATTR breakdown_date(uint32_t days, struct tm *result)
+{
+	uint32_t era, doe, yoe, mp;
+
+	result->tm_wday = (days + 4) % 7;
+
+	/* Below from http://howardhinnant.github.io/date_algorithms.html */
+	days += 719468;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+
+	result->tm_year = yoe + era * 400;
+	result->tm_yday = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * result->tm_yday + 2) / 153;
+	result->tm_mday = result->tm_yday - (153 * mp + 2) / 5 + 1;
+	result->tm_mon = mp < 10 ? mp + 2 : mp - 10;
+	if (result->tm_mon <= 1)
+		result->tm_year++;
+
+	/* result->tm_yday is March 1st indexed at this point; fix up */
+	if (mp < 10) {
+		result->tm_yday += 31 + 28 + is_leap(result->tm_year);
+	} else {
+		/* Jan and Feb come after the 306 days of Mar-Dec */
+		result->tm_yday -= 306;
+	}
+}
+
+/* The UTC midnight at the end of the month utc falls in */
+static uint64_t ICACHE_FLASH_ATTR leap_month_end(uint64_t utc)
+{
+	static const uint8_t mdays[] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+	};
+	uint32_t days = utc / 86400;
+	struct tm date;
+
+	breakdown_date(days, &date);
+	days += mdays[date.tm_mon] - date.tm_mday + 1;
+	if (date.tm_mon == 1 && is_leap(date.tm_year))
+		days++;
+
+	return days * 86400ULL;
 }
 
 /*
@@ -129,158 +711,422 @@ bool ICACHE_FLASH_ATTR is_dst(struct tm *time)
  *   tm_mon	0-11
  *   tm_mday	1-31
  *
- *   tm_yday
+ *   tm_yday	0-365
  *   tm_wday	Sunday = 0, Saturday = 6
  *
+ * in local time, as set by tz_set().
+ *
+ * The date only changes once a day, but we get called every display tick,
+ * so the date fields are cached along with the UTC window they're good for
+ * (until local midnight or the next DST change), and within that only the
+ * time of day gets worked out.
  */
-void ICACHE_FLASH_ATTR breakdown_time(uint32_t time, struct tm *result)
+void ICACHE_FLASH_ATTR breakdown_time(uint64_t time, struct tm *result)
 {
-	uint32_t era, doe, yoe, mp;
-
-	/* Do the time component */
-	result->tm_sec = time % 60;
-	time /= 60;
-	result->tm_min = time % 60;
-	time /= 60;
-	result->tm_hour = time % 24;
-	time /= 24;
-
-	/* Now time is the number of days since 1970-01-01 (a Thursday) */
-	result->tm_wday = (time + 4) % 7;
+	static struct {
+		uint64_t from, until;	/* UTC window this is valid for */
+		uint64_t midnight;	/* Local time at the start of the day */
+		int32_t offset;
+		uint32_t tz_serial;
+		struct tm date;
+	} cal;
+	uint64_t local, until;
+	uint32_t secs;
+	bool dst;
 
-	/* Below from http://howardhinnant.github.io/date_algorithms.html */
-	time += 719468;
-	era = time / 146097;
-	doe = time - era * 146097;
-	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	if (time < cal.from || time >= cal.until ||
+			cal.tz_serial != tz_serial()) {
+		cal.offset = tz_offset(time, &dst);
+		local = time + cal.offset;
+		cal.midnight = local - local % 86400;
+		breakdown_date(local / 86400, &cal.date);
+		cal.date.tm_isdst = dst;
 
-	result->tm_year = yoe + era * 400;
-	result->tm_yday = doe - (365 * yoe + yoe / 4 - yoe / 100);
-	mp = (5 * result->tm_yday + 2) / 153;
-	result->tm_mday = result->tm_yday - (153 * mp + 2) / 5 + 1;
-	result->tm_mon = mp + (mp < 10 ? 2 : -10);
-	if (result->tm_mon <= 2)
-		result->tm_year++;
+		cal.from = time;
+		cal.until = cal.midnight + 86400 - cal.offset;
+		until = tz_valid_until(time);
+		if (until < cal.until)
+			cal.until = until;
+		cal.tz_serial = tz_serial();
+	}
 
-	/* result->tm_yday is March 1st indexed at this point; fix up */
-	result->tm_yday += 28 + 31;
-	if (is_leap(result->tm_year))
-		result->tm_yday++;
+	*result = cal.date;
 
-	result->tm_isdst = is_dst(result);
-	if (result->tm_isdst)
-		result->tm_hour++;
-	if (result->tm_hour > 23) {
-		/*
-		 * We can ignore fixing up the date at the end of month etc.
-		 * because all we're actually displaying is the time.
-		 */
-		result->tm_hour = 0;
-		result->tm_wday++;
-		result->tm_mday++;
-		result->tm_yday++;
-	}
+	secs = time + cal.offset - cal.midnight;
+	result->tm_hour = secs / 3600;
+	secs %= 3600;
+	result->tm_min = secs / 60;
+	result->tm_sec = secs % 60;
 }
 
 static void ICACHE_FLASH_ATTR ntp_udp_timeout(void *arg)
 {
-	struct espconn *pCon = (struct espconn *) arg;
-
 	os_timer_disarm(&ntp_timeout);
 	os_printf("NTP timeout.\n");
+	stats.timeouts++;
 
-	// clean up connection
-	if (pCon) {
-		espconn_delete(pCon);
-		os_free(pCon->proto.udp);
-		os_free(pCon);
-		pCon = 0;
-	}
+	ntp_busy = false;
+}
+
+/*
+ * NTP 64 bit timestamp to Unix microseconds. The seconds field wraps every
+ * 136 years (next in 2036), so pick the era that puts the result closest
+ * to what we think the time is, or when we were built if we don't know.
+ */
+static uint64_t ICACHE_FLASH_ATTR ntp_to_us(const uint8 *stamp)
+{
+	uint32_t secs, frac;
+	uint64_t pivot;
+
+	secs = stamp[0] << 24 | stamp[1] << 16 | stamp[2] << 8 | stamp[3];
+	frac = stamp[4] << 24 | stamp[5] << 16 | stamp[6] << 8 | stamp[7];
+
+	pivot = (clk.set ? clock_utc_us(sys_time_us()) / 1000000 : BUILD_TIME) +
+		NTP_UNIX_OFFSET;
+	pivot += (int32_t) (secs - (uint32_t) pivot);
+
+	return (pivot - NTP_UNIX_OFFSET) * 1000000ULL +
+		(((uint64_t) frac * 1000000) >> 32);
+}
+
+static void ICACHE_FLASH_ATTR us_to_ntp(uint64_t us, uint8 *stamp)
+{
+	uint32_t secs, frac;
+
+	secs = us / 1000000 + NTP_UNIX_OFFSET;
+	frac = ((us % 1000000) << 32) / 1000000;
+
+	stamp[0] = secs >> 24;
+	stamp[1] = secs >> 16;
+	stamp[2] = secs >> 8;
+	stamp[3] = secs;
+	stamp[4] = frac >> 24;
+	stamp[5] = frac >> 16;
+	stamp[6] = frac >> 8;
+	stamp[7] = frac;
 }
 
 static void ICACHE_FLASH_ATTR ntp_udp_recv(void *arg, char *pdata,
 	unsigned short len)
 {
-	struct espconn *pCon = (struct espconn *) arg;
-	uint32_t timestamp;
+	uint64_t now_us, recv_us, trans_us;
+	int64_t delay;
 	ntp_t *ntp;
 	struct tm dt;
 
+	if (!ntp_busy || len < sizeof(ntp_t)) {
+		/* Late reply to a request we've given up on, or junk */
+		return;
+	}
+
+	ntp = (ntp_t *) pdata;
+	if (os_memcmp(ntp->orig_time, ntp_sent_stamp, 8) != 0) {
+		/* Not an answer to the request we sent */
+		return;
+	}
+
+	now_us = sys_time_us();
 	os_printf("Got NTP response.\n");
 
 	os_timer_disarm(&ntp_timeout);
+	ntp_busy = false;
 
-	// Extract NTP time
-	ntp = (ntp_t *) pdata;
-	timestamp = ntp->trans_time[0] << 24 | ntp->trans_time[1] << 16 |
-		ntp->trans_time[2] << 8 | ntp->trans_time[3];
-	// NTP 0 is 1st Jan 1900; convert to Unix time 0 of 1st Jan 1970
-	timestamp -= 2208988800ULL;
+	if ((ntp->options >> 6) == 3 || ntp->stratum == 0) {
+		/* Unsynchronised, or a kiss-o'-death telling us to go away */
+		os_printf("NTP server not synchronised.\n");
+		stats.rejects++;
+		return;
+	}
+
+	/*
+	 * Round trip, less however long the server sat on it. Assume the
+	 * network is symmetric, so the time now is what the server said plus
+	 * half the round trip.
+	 */
+	recv_us = ntp_to_us(ntp->recv_time);
+	trans_us = ntp_to_us(ntp->trans_time);
+	delay = (int64_t) (now_us - ntp_sent_us) - (int64_t) (trans_us - recv_us);
+	if (delay < 0) {
+		delay = 0;
+	}
+
+	clock_sync(trans_us + delay / 2, delay, ntp, ntp_udp.remote_ip);
 
-	// Store the time
-	set_time(timestamp);
+#ifdef CFG_NTP_BROADCAST
+	// We know the time properly now; see how late the next broadcast is
+	bcast.calibrate = true;
+	bcast.calibrated = true;
+	bcast.calibrated_at = get_uptime();
+#endif
 
 	// Print it out
-	breakdown_time(timestamp, &dt);
+	breakdown_time(trans_us / 1000000, &dt);
 	os_printf("%04d-%02d-%02d %02d:%02d:%02d (%u)\r\n",
 		dt.tm_year, dt.tm_mon + 1, dt.tm_mday,
-		dt.tm_hour, dt.tm_min, dt.tm_sec, timestamp);
-
-	// clean up connection
-	if (pCon) {
-		espconn_delete(pCon);
-		os_free(pCon->proto.udp);
-		os_free(pCon);
-		pCon = NULL;
-	}
+		dt.tm_hour, dt.tm_min, dt.tm_sec,
+		(uint32_t) (trans_us / 1000000));
 }
 
 void ICACHE_FLASH_ATTR ntp_got_dns(const char *name, ip_addr_t *ip, void *arg)
 {
 	ntp_t ntp;
-	struct espconn *pCon = (struct espconn *) arg;
 
 	if (ip == NULL) {
 		os_printf("NTP DNS request failed.\n");
-		os_free(pCon);
+		stats.dns_fails++;
+		ntp_busy = false;
 		return;
 	}
 
 	os_printf("Sending NTP request.\n");
 
-	// Set up the UDP "connection"
-	pCon->type = ESPCONN_UDP;
-	pCon->state = ESPCONN_NONE;
-	pCon->proto.udp = (esp_udp *) os_zalloc(sizeof(esp_udp));
-	pCon->proto.udp->local_port = espconn_port();
-	pCon->proto.udp->remote_port = 123;
-	os_memcpy(pCon->proto.udp->remote_ip, &ip->addr, 4);
+	// Set up the UDP "connection" the first time round; after that reuse it
+	if (ntp_conn.type == ESPCONN_INVALID) {
+		ntp_conn.type = ESPCONN_UDP;
+		ntp_conn.state = ESPCONN_NONE;
+		ntp_conn.proto.udp = &ntp_udp;
+		ntp_udp.local_port = espconn_port();
+		espconn_create(&ntp_conn);
+		espconn_regist_recvcb(&ntp_conn, ntp_udp_recv);
+	}
+	// Received packets overwrite these, so set them every time
+	ntp_udp.remote_port = 123;
+	os_memcpy(ntp_udp.remote_ip, &ip->addr, 4);
 
 	// Create a really simple NTP request packet
 	os_memset(&ntp, 0, sizeof(ntp_t));
 	ntp.options = 0b00100011; // leap = 0, version = 4, mode = 3 (client)
+	// The server echoes this back, so we can match up its reply
+	ntp_sent_us = sys_time_us();
+	us_to_ntp(clock_utc_us(ntp_sent_us), ntp.trans_time);
+	os_memcpy(ntp_sent_stamp, ntp.trans_time, 8);
 
 	// Set timeout timer
 	os_timer_disarm(&ntp_timeout);
-	os_timer_setfn(&ntp_timeout, (os_timer_func_t*) ntp_udp_timeout, pCon);
+	os_timer_setfn(&ntp_timeout, (os_timer_func_t*) ntp_udp_timeout, NULL);
 	os_timer_arm(&ntp_timeout, NTP_TIMEOUT_MS, 0);
 
 	// Send the NTP request
-	espconn_create(pCon);
-	espconn_regist_recvcb(pCon, ntp_udp_recv);
-	espconn_sent(pCon, (uint8_t *) &ntp, sizeof(ntp_t));
+	espconn_sent(&ntp_conn, (uint8_t *) &ntp, sizeof(ntp_t));
+}
+
+#ifdef CFG_NTP_BROADCAST
+static void ICACHE_FLASH_ATTR ntp_broadcast_recv(ntp_t *ntp)
+{
+	uint64_t sys_us = sys_time_us();
+	uint64_t trans_us;
+	int64_t delay;
+
+	if ((ntp->options >> 6) == 3 || ntp->stratum == 0 ||
+			ntp->stratum > 15) {
+		/* Server isn't synchronised itself */
+		return;
+	}
+
+	trans_us = ntp_to_us(ntp->trans_time);
+	bcast.heard = true;
+	bcast.heard_at = get_uptime();
+
+	if (bcast.calibrate) {
+		bcast.calibrate = false;
+		delay = clock_utc_us(sys_us) - trans_us;
+		if (delay >= 0 && delay < NTP_BCAST_MAX_DELAY_US) {
+			bcast.delay = delay;
+			os_printf("NTP broadcast delay %u us.\n", bcast.delay);
+		}
+		return;
+	}
+
+	/* Broadcasts come every minute or so; we don't need them all */
+	if (clk.sync_sys_us != 0 &&
+			sys_us - clk.sync_sys_us < NTP_BCAST_SYNC_US) {
+		return;
+	}
+
+	os_printf("Syncing from NTP broadcast.\n");
+	clock_sync(trans_us + bcast.delay, bcast.delay * 2, ntp,
+		ntp_listen_udp.remote_ip);
+}
+#endif
+
+#ifdef CFG_NTP_SERVER
+/*
+ * Fills in the parts of a packet describing our own state; false if we've
+ * not been synced recently enough to be worth listening to, or our
+ * upstream is already as far from a reference clock as NTP allows.
+ *
+ * The times we serve are smeared over a leap second, so we never pass on
+ * the leap warning: a client that knew about the leap would make it again
+ * on top of our smear and end up a second out.
+ */
+static bool ICACHE_FLASH_ATTR ntp_server_fill(ntp_t *pkt, uint64_t sys_us,
+	uint8_t version, uint8_t mode)
+{
+	uint64_t age;
+
+	if (clk.last_sync == 0) {
+		return false;
+	}
+	/* last_sync is unsmeared; mid smear, the smeared time is behind it */
+	age = clock_raw_us(sys_us) / 1000000 - clk.last_sync;
+	if (age > NTP_SERVER_MAX_AGE || clk.stratum >= 15) {
+		return false;
+	}
+
+	os_memset(pkt, 0, sizeof(*pkt));
+	pkt->options = (version << 3) | mode;
+	pkt->stratum = clk.stratum + 1;
+	pkt->precision = NTP_PRECISION;
+	pkt->root_delay = us_to_ntp_short(clk.root_delay + clk.sync_delay);
+	pkt->root_disp = us_to_ntp_short(clk.root_disp + clk.sync_delay / 2 +
+		age * NTP_PHI);
+	pkt->ref_id = clk.ref_id;
+	us_to_ntp(clk.last_sync * 1000000, pkt->ref_time);
+
+	return true;
+}
+
+static void ICACHE_FLASH_ATTR ntp_server_recv(ntp_t *req)
+{
+	uint64_t recv_sys_us = sys_time_us();
+	uint8_t version = (req->options >> 3) & 7;
+	ntp_t reply;
+
+	if (version < 1 || version > 4 ||
+			!ntp_server_fill(&reply, recv_sys_us, version, 4)) {
+		return;
+	}
+
+	reply.poll = req->poll;
+	os_memcpy(reply.orig_time, req->trans_time, 8);
+	us_to_ntp(clock_utc_us(recv_sys_us), reply.recv_time);
+	us_to_ntp(clock_utc_us(sys_time_us()), reply.trans_time);
+
+	/* Receiving filled in the remote end, so this goes back to them */
+	espconn_sent(&ntp_listen_conn, (uint8_t *) &reply, sizeof(reply));
+}
+
+#ifdef CFG_NTP_SERVER_BROADCAST
+static void ICACHE_FLASH_ATTR ntp_server_broadcast(void *arg)
+{
+	uint64_t sys_us = sys_time_us();
+	ntp_t pkt;
+
+	if (!ntp_server_fill(&pkt, sys_us, 4, 5)) {
+		return;
+	}
+
+	pkt.poll = 6;	/* 64s, as a power of 2 */
+	us_to_ntp(clock_utc_us(sys_us), pkt.trans_time);
+
+	ntp_listen_udp.remote_port = 123;
+	os_memset(ntp_listen_udp.remote_ip, 0xFF, 4);
+	espconn_sent(&ntp_listen_conn, (uint8_t *) &pkt, sizeof(pkt));
+}
+#endif
+#endif
+
+#ifdef NTP_LISTEN
+static void ICACHE_FLASH_ATTR ntp_listen_recv(void *arg, char *pdata,
+	unsigned short len)
+{
+	ntp_t *ntp = (ntp_t *) pdata;
+
+	if (len < sizeof(ntp_t)) {
+		return;
+	}
+
+	switch (ntp->options & 7) {
+#ifdef CFG_NTP_BROADCAST
+	case 5: /* Broadcast */
+		ntp_broadcast_recv(ntp);
+		break;
+#endif
+#ifdef CFG_NTP_SERVER
+	case 3: /* Client */
+		ntp_server_recv(ntp);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+#endif
+
+/*
+ * Start listening on the NTP port, for whichever of broadcast client and
+ * server mode we've been built with. Call each time we get an IP, so the
+ * multicast group gets joined on the right interface address; it's only
+ * joined once per address, and left on the old one if the address changes.
+ */
+void ICACHE_FLASH_ATTR ntp_listen(void)
+{
+#ifdef NTP_LISTEN
+#ifdef CFG_NTP_BROADCAST
+	struct ip_info info;
+	ip_addr_t group;
+#endif
+
+	if (ntp_listen_conn.type == ESPCONN_INVALID) {
+		ntp_listen_conn.type = ESPCONN_UDP;
+		ntp_listen_conn.state = ESPCONN_NONE;
+		ntp_listen_conn.proto.udp = &ntp_listen_udp;
+		ntp_listen_udp.local_port = 123;
+		espconn_create(&ntp_listen_conn);
+		espconn_regist_recvcb(&ntp_listen_conn, ntp_listen_recv);
+
+#ifdef CFG_NTP_SERVER_BROADCAST
+		os_timer_setfn(&ntp_bcast_timer, ntp_server_broadcast, NULL);
+		os_timer_arm(&ntp_bcast_timer, NTP_SERVER_BCAST_MS, 1);
+#endif
+	}
+
+#ifdef CFG_NTP_BROADCAST
+	if (wifi_get_ip_info(STATION_IF, &info) &&
+			info.ip.addr != ntp_group_if.addr) {
+		IP4_ADDR(&group, 224, 0, 1, 1);
+		if (ntp_group_if.addr != 0)
+			espconn_igmp_leave(&ntp_group_if, &group);
+		if (espconn_igmp_join(&info.ip, &group) == ESPCONN_OK)
+			ntp_group_if = info.ip;
+		else
+			ntp_group_if.addr = 0;
+	}
+#endif
+#endif
 }
 
 void ICACHE_FLASH_ATTR ntp_get_time(void)
 {
-	struct espconn *pCon = NULL;
+	char server[64];
+#ifdef CFG_NTP_BROADCAST
+	uint32_t now = get_uptime();
+
+	if (bcast.heard && now - bcast.heard_at < NTP_BCAST_STALE &&
+			bcast.calibrated &&
+			now - bcast.calibrated_at < NTP_BCAST_CALIBRATE) {
+		/* Broadcasts are keeping us in sync */
+		return;
+	}
+#endif
+
+	if (ntp_busy) {
+		os_printf("NTP request already in progress.\n");
+		return;
+	}
 
-	os_printf("Sending DNS request for NTP server.\n");
-	pCon = (struct espconn *) os_zalloc(sizeof(struct espconn));
-	espconn_gethostbyname(pCon, NTP_SERVER, &ntp_server_ip, ntp_got_dns);
+	ntp_busy = true;
+	/* resolv_lookup() takes its own copy of the name */
+	config_get_default("ntp.server", server, sizeof(server), NTP_SERVER);
+	resolv_lookup(server, ntp_got_dns, NULL);
 }
 
 void ICACHE_FLASH_ATTR rtc_init(void)
 {
+#ifdef CFG_LOW_POWER
+	rtc_last_ticks = system_get_rtc_time();
+#else
 	sys_last_ticks = system_get_time();
+#endif
+	clock_restore();
 }
@@ -29,10 +29,38 @@ struct tm {
 	int tm_isdst;
 };
 
+/* How well we're keeping time, for spotting clocks that aren't */
+#define CLOCK_STATS_SAMPLES	8
+
+struct clock_stats {
+	int32_t offset[CLOCK_STATS_SAMPLES];	/* Oldest first, us */
+	uint32_t delay[CLOCK_STATS_SAMPLES];	/* Round trips, us */
+	uint8_t count;		/* How many of the above are filled */
+	uint8_t stratum;	/* Of our last upstream */
+	int32_t jitter;		/* Mean change in offset between syncs, us */
+	int32_t freq;		/* Drift correction, ppb */
+	uint32_t sync_age;	/* Seconds since the last good sync */
+	uint32_t syncs;
+	uint32_t timeouts;	/* No reply from the server */
+	uint32_t dns_fails;
+	uint32_t rejects;	/* Replies we didn't like */
+};
+
+/* Room for clock_format_stats(), which needs 176 with its NUL at most */
+#define CLOCK_STATS_LEN		192
+
 void rtc_init(void);
-void set_time(uint32_t now);
-uint32_t get_time(void);
-void breakdown_time(uint32_t time, struct tm *result);
+void set_time(uint64_t now);
+uint64_t get_time(void);
+uint32_t get_uptime(void);
+bool clock_is_set(void);
+uint64_t clock_last_sync(void);
+void clock_save(void);
+void ICACHE_FLASH_ATTR clock_get_stats(struct clock_stats *stats);
+int ICACHE_FLASH_ATTR clock_format_stats(char *buf);
+void ICACHE_FLASH_ATTR clock_print_stats(void);
+void breakdown_time(uint64_t time, struct tm *result);
 void ICACHE_FLASH_ATTR ntp_get_time(void);
+void ICACHE_FLASH_ATTR ntp_listen(void);
 
 #endif /* _CLOCK_H_ */
@@ -0,0 +1,518 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Settings that would otherwise need a build per site (wifi details, the
+ * upgrade server, timezone and so on) are kept as key/value pairs in a
+ * small log in flash. Changing one appends a new record rather than
+ * rewriting anything; the last record for a key wins. Each record carries
+ * a CRC, so one cut short by a power cut is ignored and the old value
+ * stands.
+ *
+ * The log runs through the sectors in turn, each stamped with a sequence
+ * number so we know which order to read them in. One is always kept spare:
+ * when the current sector fills we move on to the spare, copy anything
+ * still in use out of the oldest sector, then erase that to be the next
+ * spare. Every sector gets erased in turn, and only when a whole sector's
+ * worth of changes has been made.
+ *
+ * At boot the log is read once to build an index in RAM, hashed by key,
+ * of where the latest record for each key is. After that a lookup is a
+ * probe or two of the index and a single flash read.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+#include <spi_flash.h>
+
+#include "config.h"
+
+/* In a record's klen; the key has been removed */
+#define CONFIG_DELETED		0x80
+#define CONFIG_HDR_LEN		4
+#define CONFIG_REC_MAX		(CONFIG_HDR_LEN + \
+				 ((CONFIG_KEY_LEN + CONFIG_VALUE_LEN + 3) & ~3))
+/* Kept small enough that the oldest sector always fits in a fresh one */
+#define CONFIG_LIVE_MAX		(SPI_FLASH_SEC_SIZE / 2)
+
+#define CONFIG_SECTOR(n)	(CONFIG_BASE + (n) * SPI_FLASH_SEC_SIZE)
+
+/* At the start of each sector in use */
+struct config_sector {
+	uint32_t magic;
+	uint32_t seq;
+};
+
+/*
+ * Records are a CRC-16 (of everything after it), the key length, the
+ * value length, then the key and value, padded with 0xFF to a multiple of
+ * 4 bytes. A klen of 0xFF is unwritten flash: the end of the log.
+ */
+
+struct config_slot {
+	uint32_t addr;		/* Of the latest record for the key; 0 if free */
+	uint16_t hash;
+	uint8_t klen;		/* As in the record, with CONFIG_DELETED */
+	uint8_t vlen;
+};
+
+static struct {
+	uint32_t seq[CONFIG_SECTORS];	/* 0 if not in use */
+	uint8_t active;			/* Sector being added to */
+	bool full;			/* ...unless it's been cut short */
+	uint16_t end;			/* Where the next record goes */
+	uint32_t live;			/* Bytes of records still in use */
+	struct config_slot index[CONFIG_MAX_KEYS];
+} cfg;
+
+static uint32_t ICACHE_FLASH_ATTR config_rec_len(uint8_t klen, uint8_t vlen)
+{
+	return CONFIG_HDR_LEN + (((klen & ~CONFIG_DELETED) + vlen + 3) & ~3);
+}
+
+/* CRC-16/CCITT */
+static uint16_t ICACHE_FLASH_ATTR config_crc(const uint8_t *data,
+		uint32_t len)
+{
+	uint16_t crc = 0xFFFF;
+	int bit;
+
+	while (len--) {
+		crc ^= *data++ << 8;
+		for (bit = 0; bit < 8; bit++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+/* FNV-1a, folded down to 16 bits */
+static uint16_t ICACHE_FLASH_ATTR config_hash(const char *key, uint8_t len)
+{
+	uint32_t hash = 2166136261;
+
+	while (len--) {
+		hash ^= (uint8_t) *key++;
+		hash *= 16777619;
+	}
+
+	return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+/* Read and check the record at addr; it's left in rec */
+static bool ICACHE_FLASH_ATTR config_read(uint32_t addr, uint32_t *rec,
+		uint32_t space)
+{
+	uint8_t *raw = (uint8_t *) rec;
+	uint32_t len;
+
+	if (space < CONFIG_HDR_LEN ||
+			spi_flash_read(addr, rec, CONFIG_HDR_LEN) !=
+			SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+	if ((raw[2] & ~CONFIG_DELETED) == 0 ||
+			(raw[2] & ~CONFIG_DELETED) > CONFIG_KEY_LEN) {
+		return false;
+	}
+	len = config_rec_len(raw[2], raw[3]);
+	if (len > space || spi_flash_read(addr + CONFIG_HDR_LEN,
+			rec + 1, len - CONFIG_HDR_LEN) !=
+			SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+
+	return config_crc(&raw[2], 2 + (raw[2] & ~CONFIG_DELETED) + raw[3]) ==
+		(raw[0] | (raw[1] << 8));
+}
+
+/* Where key is in the index, or where it would go */
+static struct config_slot ICACHE_FLASH_ATTR *config_slot(const char *key,
+		uint8_t klen, uint16_t hash, bool create)
+{
+	uint32_t buf[(CONFIG_HDR_LEN + CONFIG_KEY_LEN + 3) / 4];
+	struct config_slot *slot;
+	unsigned int i, n;
+
+	i = hash % CONFIG_MAX_KEYS;
+	for (n = 0; n < CONFIG_MAX_KEYS; n++) {
+		slot = &cfg.index[i];
+		if (slot->addr == 0) {
+			return create ? slot : NULL;
+		}
+		if (slot->hash == hash &&
+				(slot->klen & ~CONFIG_DELETED) == klen &&
+				spi_flash_read(slot->addr, buf,
+					(CONFIG_HDR_LEN + klen + 3) & ~3) ==
+				SPI_FLASH_RESULT_OK &&
+				os_memcmp((uint8_t *) buf + CONFIG_HDR_LEN, key,
+					klen) == 0) {
+			return slot;
+		}
+		i = (i + 1) % CONFIG_MAX_KEYS;
+	}
+
+	return NULL;
+}
+
+/* Note that the record in rec, at addr, is now the one for its key */
+static bool ICACHE_FLASH_ATTR config_index(uint32_t addr, const uint32_t *rec)
+{
+	const uint8_t *raw = (const uint8_t *) rec;
+	const char *key = (const char *) &raw[CONFIG_HDR_LEN];
+	uint8_t klen = raw[2] & ~CONFIG_DELETED;
+	uint16_t hash = config_hash(key, klen);
+	struct config_slot *slot;
+
+	slot = config_slot(key, klen, hash, true);
+	if (slot == NULL) {
+		os_printf("Too many config keys.\n");
+		return false;
+	}
+
+	if (slot->addr != 0 && !(slot->klen & CONFIG_DELETED)) {
+		cfg.live -= config_rec_len(slot->klen, slot->vlen);
+	}
+	slot->addr = addr;
+	slot->hash = hash;
+	slot->klen = raw[2];
+	slot->vlen = raw[3];
+	if (!(slot->klen & CONFIG_DELETED)) {
+		cfg.live += config_rec_len(slot->klen, slot->vlen);
+	}
+
+	return true;
+}
+
+/* Whether the end of the log is really the end, or a record was cut short */
+static bool ICACHE_FLASH_ATTR config_blank(uint32_t addr, uint32_t space)
+{
+	uint32_t buf[CONFIG_REC_MAX / 4];
+	unsigned int i;
+
+	if (space > CONFIG_REC_MAX) {
+		space = CONFIG_REC_MAX;
+	}
+	if (spi_flash_read(addr, buf, space) != SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+	for (i = 0; i < space / 4; i++) {
+		if (buf[i] != 0xFFFFFFFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Build the index by reading the log from the oldest sector on */
+static void ICACHE_FLASH_ATTR config_scan(void)
+{
+	uint32_t rec[CONFIG_REC_MAX / 4];
+	uint32_t last = 0, pos;
+	int n, sector;
+
+	os_memset(cfg.index, 0, sizeof(cfg.index));
+	cfg.live = 0;
+	cfg.end = 0;
+
+	for (;;) {
+		/* Next sector up in sequence */
+		sector = -1;
+		for (n = 0; n < CONFIG_SECTORS; n++) {
+			if (cfg.seq[n] > last && (sector < 0 ||
+					cfg.seq[n] < cfg.seq[sector])) {
+				sector = n;
+			}
+		}
+		if (sector < 0) {
+			break;
+		}
+		last = cfg.seq[sector];
+
+		cfg.full = false;
+		pos = sizeof(struct config_sector);
+		while (pos < SPI_FLASH_SEC_SIZE) {
+			if (!config_read(CONFIG_SECTOR(sector) + pos, rec,
+					SPI_FLASH_SEC_SIZE - pos)) {
+				/* Unless it's blank, something was cut short */
+				cfg.full = !config_blank(
+					CONFIG_SECTOR(sector) + pos,
+					SPI_FLASH_SEC_SIZE - pos);
+				break;
+			}
+			config_index(CONFIG_SECTOR(sector) + pos, rec);
+			pos += config_rec_len(((uint8_t *) rec)[2],
+				((uint8_t *) rec)[3]);
+		}
+
+		cfg.active = sector;
+		cfg.end = pos;
+	}
+}
+
+static int ICACHE_FLASH_ATTR config_spares(void)
+{
+	int n, spares = 0;
+
+	for (n = 0; n < CONFIG_SECTORS; n++) {
+		if (cfg.seq[n] == 0) {
+			spares++;
+		}
+	}
+
+	return spares;
+}
+
+/* Add a record to the end of the current sector */
+static bool ICACHE_FLASH_ATTR config_put(uint32_t *rec, uint32_t len)
+{
+	if (cfg.seq[cfg.active] == 0 || cfg.full ||
+			cfg.end + len > SPI_FLASH_SEC_SIZE) {
+		return false;
+	}
+
+	if (spi_flash_write(CONFIG_SECTOR(cfg.active) + cfg.end, rec, len) !=
+			SPI_FLASH_RESULT_OK) {
+		cfg.full = true;
+		return false;
+	}
+	cfg.end += len;
+
+	return true;
+}
+
+/* Move anything still in use out of the oldest sector, then erase it */
+static bool ICACHE_FLASH_ATTR config_reclaim(void)
+{
+	uint32_t rec[CONFIG_REC_MAX / 4];
+	struct config_slot *slot;
+	int n, oldest = -1;
+
+	for (n = 0; n < CONFIG_SECTORS; n++) {
+		if (cfg.seq[n] != 0 && n != cfg.active && (oldest < 0 ||
+				cfg.seq[n] < cfg.seq[oldest])) {
+			oldest = n;
+		}
+	}
+	if (oldest < 0) {
+		return false;
+	}
+
+	/* Deleted keys don't need remembering; there's nothing older */
+	for (n = 0; n < CONFIG_MAX_KEYS; n++) {
+		slot = &cfg.index[n];
+		if (slot->addr < CONFIG_SECTOR(oldest) ||
+				slot->addr >= CONFIG_SECTOR(oldest + 1) ||
+				(slot->klen & CONFIG_DELETED)) {
+			continue;
+		}
+		if (!config_read(slot->addr, rec, CONFIG_REC_MAX) ||
+				!config_put(rec, config_rec_len(slot->klen,
+					slot->vlen))) {
+			os_printf("Couldn't move config out of sector %d.\n",
+				oldest);
+			return false;
+		}
+	}
+
+	spi_flash_erase_sector(CONFIG_SECTOR(oldest) / SPI_FLASH_SEC_SIZE);
+	cfg.seq[oldest] = 0;
+
+	/* Everything that was in it has moved */
+	config_scan();
+
+	return true;
+}
+
+/* Start on the next spare sector */
+static bool ICACHE_FLASH_ATTR config_rotate(void)
+{
+	struct config_sector hdr;
+	uint32_t seq = 0;
+	int n, target = -1;
+
+	for (n = 0; n < CONFIG_SECTORS; n++) {
+		if (cfg.seq[n] > seq) {
+			seq = cfg.seq[n];
+		}
+	}
+	/* Round robin, for the wear levelling */
+	for (n = 1; n <= CONFIG_SECTORS && target < 0; n++) {
+		if (cfg.seq[(cfg.active + n) % CONFIG_SECTORS] == 0) {
+			target = (cfg.active + n) % CONFIG_SECTORS;
+		}
+	}
+	if (target < 0) {
+		return false;
+	}
+
+	spi_flash_erase_sector(CONFIG_SECTOR(target) / SPI_FLASH_SEC_SIZE);
+	hdr.magic = CONFIG_MAGIC;
+	hdr.seq = seq + 1;
+	/* The magic goes last so a half written sequence is never used */
+	if (spi_flash_write(CONFIG_SECTOR(target) + 4, &hdr.seq, 4) !=
+			SPI_FLASH_RESULT_OK ||
+			spi_flash_write(CONFIG_SECTOR(target), &hdr.magic, 4) !=
+			SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+	cfg.seq[target] = hdr.seq;
+	cfg.active = target;
+	cfg.end = sizeof(hdr);
+	cfg.full = false;
+
+	if (config_spares() == 0) {
+		return config_reclaim();
+	}
+
+	return true;
+}
+
+bool ICACHE_FLASH_ATTR config_init(void)
+{
+	struct config_sector hdr;
+	int n;
+
+	for (n = 0; n < CONFIG_SECTORS; n++) {
+		cfg.seq[n] = 0;
+		if (spi_flash_read(CONFIG_SECTOR(n), (uint32_t *) &hdr,
+				sizeof(hdr)) == SPI_FLASH_RESULT_OK &&
+				hdr.magic == CONFIG_MAGIC &&
+				hdr.seq != 0 && hdr.seq != 0xFFFFFFFF) {
+			cfg.seq[n] = hdr.seq;
+		}
+	}
+
+	config_scan();
+
+	/* We were part way through moving on to a new sector */
+	if (config_spares() == 0 && !config_reclaim()) {
+		cfg.full = true;
+	}
+
+	os_printf("Config: %u bytes in use.\n", cfg.live);
+
+	return true;
+}
+
+/* Copy the value of key into buf, which must have room for it and a NUL */
+bool ICACHE_FLASH_ATTR config_get(const char *key, char *buf,
+		unsigned int len)
+{
+	uint32_t rec[CONFIG_REC_MAX / 4];
+	struct config_slot *slot;
+	uint8_t klen = os_strlen(key);
+
+	if (klen == 0 || klen > CONFIG_KEY_LEN) {
+		return false;
+	}
+
+	slot = config_slot(key, klen, config_hash(key, klen), false);
+	if (slot == NULL || (slot->klen & CONFIG_DELETED)) {
+		return false;
+	}
+	if (slot->vlen >= len) {
+		os_printf("Config %s is too long (%u bytes, room for %u).\n",
+			key, slot->vlen, len - 1);
+		return false;
+	}
+	if (spi_flash_read(slot->addr, rec,
+			config_rec_len(slot->klen, slot->vlen)) !=
+			SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+
+	os_memcpy(buf, (uint8_t *) rec + CONFIG_HDR_LEN + klen, slot->vlen);
+	buf[slot->vlen] = '\0';
+
+	return true;
+}
+
+/* As config_get(), but falling back to def if key isn't set or won't fit */
+void ICACHE_FLASH_ATTR config_get_default(const char *key, char *buf,
+		unsigned int len, const char *def)
+{
+	if (!config_get(key, buf, len)) {
+		os_strncpy(buf, def, len - 1);
+		buf[len - 1] = '\0';
+	}
+}
+
+static bool ICACHE_FLASH_ATTR config_write(const char *key,
+		const char *value)
+{
+	uint32_t rec[CONFIG_REC_MAX / 4];
+	uint8_t *raw = (uint8_t *) rec;
+	struct config_slot *slot;
+	uint32_t klen = os_strlen(key);
+	uint32_t vlen = value ? os_strlen(value) : 0;
+	uint32_t len, live;
+	char old[CONFIG_VALUE_LEN + 1];
+
+	if (klen == 0 || klen > CONFIG_KEY_LEN || vlen > CONFIG_VALUE_LEN) {
+		return false;
+	}
+
+	/* Don't wear the flash out writing what's already there */
+	slot = config_slot(key, klen, config_hash(key, klen), false);
+	if (value == NULL && (slot == NULL ||
+			(slot->klen & CONFIG_DELETED))) {
+		return true;
+	}
+	if (value != NULL && config_get(key, old, sizeof(old)) &&
+			os_strcmp(old, value) == 0) {
+		return true;
+	}
+
+	len = config_rec_len(klen, vlen);
+	live = cfg.live;
+	if (slot != NULL && !(slot->klen & CONFIG_DELETED)) {
+		live -= config_rec_len(slot->klen, slot->vlen);
+	}
+	if (value != NULL && live + len > CONFIG_LIVE_MAX) {
+		os_printf("No room to set config %s.\n", key);
+		return false;
+	}
+
+	os_memset(rec, 0xFF, len);
+	raw[2] = klen | (value == NULL ? CONFIG_DELETED : 0);
+	raw[3] = vlen;
+	os_memcpy(&raw[CONFIG_HDR_LEN], key, klen);
+	os_memcpy(&raw[CONFIG_HDR_LEN + klen], value, vlen);
+	raw[0] = config_crc(&raw[2], 2 + klen + vlen) & 0xFF;
+	raw[1] = config_crc(&raw[2], 2 + klen + vlen) >> 8;
+
+	if (!config_put(rec, len)) {
+		if (!config_rotate() || !config_put(rec, len)) {
+			os_printf("Couldn't write config %s.\n", key);
+			return false;
+		}
+	}
+
+	return config_index(CONFIG_SECTOR(cfg.active) + cfg.end - len, rec);
+}
+
+bool ICACHE_FLASH_ATTR config_set(const char *key, const char *value)
+{
+	return config_write(key, value);
+}
+
+bool ICACHE_FLASH_ATTR config_unset(const char *key)
+{
+	return config_write(key, NULL);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <c_types.h>
+
+/* After the second slot, before the SDK's own data */
+#define CONFIG_BASE		0xF7000
+#define CONFIG_SECTORS		4
+
+#define CONFIG_MAGIC		0x43505345	/* "ESPC" */
+#define CONFIG_KEY_LEN		31
+#define CONFIG_VALUE_LEN	255
+#define CONFIG_MAX_KEYS		32
+
+bool ICACHE_FLASH_ATTR config_init(void);
+bool ICACHE_FLASH_ATTR config_get(const char *key, char *buf,
+	unsigned int len);
+void ICACHE_FLASH_ATTR config_get_default(const char *key, char *buf,
+	unsigned int len, const char *def);
+bool ICACHE_FLASH_ATTR config_set(const char *key, const char *value);
+bool ICACHE_FLASH_ATTR config_unset(const char *key);
+
+#endif /* _CONFIG_H_ */
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Rebuilds a new image from the one we're running plus a delta made by
+ * tools/mkdelta.py. The delta starts with "ESPD" and the length of the new
+ * image, then has records, all little endian:
+ *
+ *   'C' src len		copy len bytes from src in the old image
+ *   'A' src len <len bytes>	the same, adding each byte on (mod 256)
+ *   'I' len <len bytes>	bytes that go in as they are
+ *
+ * The two slots are linked at different addresses, so much of the code
+ * differs only in the odd address here and there; 'A' records turn those
+ * into runs of mostly zeroes, which compress well.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+#include <spi_flash.h>
+
+#include "delta.h"
+
+#define DELTA_MAGIC	"ESPD"
+
+enum {
+	DELTA_HEADER,
+	DELTA_OP,
+	DELTA_ARGS,
+	DELTA_DATA,
+	DELTA_COPY,
+};
+
+static uint32_t ICACHE_FLASH_ATTR delta_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+/* Read len (<= DELTA_CHUNK) bytes from the old image; NULL on failure */
+static uint8_t ICACHE_FLASH_ATTR *delta_read_src(struct delta *d,
+	uint32_t len)
+{
+	uint32_t skip = d->src & 3;
+
+	if (spi_flash_read(d->src_base + d->src - skip, d->buf,
+			(skip + len + 3) & ~3) != SPI_FLASH_RESULT_OK) {
+		return NULL;
+	}
+
+	return (uint8_t *) d->buf + skip;
+}
+
+static bool ICACHE_FLASH_ATTR delta_emit(struct delta *d, const uint8_t *data,
+	uint32_t len)
+{
+	d->written += len;
+	return d->cb(d->arg, data, len);
+}
+
+static bool ICACHE_FLASH_ATTR delta_add(struct delta *d, const uint8_t *diff,
+	uint32_t len)
+{
+	uint8_t *old;
+	uint32_t i;
+
+	old = delta_read_src(d, len);
+	if (old == NULL)
+		return false;
+	for (i = 0; i < len; i++)
+		old[i] += diff[i];
+	d->src += len;
+
+	return delta_emit(d, old, len);
+}
+
+/* We have the op and its arguments; check them and get going */
+static bool ICACHE_FLASH_ATTR delta_record(struct delta *d)
+{
+	if (d->op == 'I') {
+		d->len = delta_le32(d->fields);
+	} else {
+		d->src = delta_le32(d->fields);
+		d->len = delta_le32(d->fields + 4);
+		if (d->src > d->src_size || d->len > d->src_size - d->src)
+			return false;
+	}
+	if (d->len > d->target_len - d->written)
+		return false;
+
+	/* A copy needs no more input; delta_step() does it */
+	if (d->op == 'C')
+		d->state = d->len ? DELTA_COPY : DELTA_OP;
+	else
+		d->state = d->len ? DELTA_DATA : DELTA_OP;
+	return true;
+}
+
+/*
+ * Output goes to cb as we produce it. The old image is at src_base, which
+ * we'd better not be writing to.
+ */
+void ICACHE_FLASH_ATTR delta_init(struct delta *d, uint32_t src_base,
+	uint32_t src_size, delta_out_cb cb, void *arg)
+{
+	os_memset(d, 0, sizeof(*d));
+	d->src_base = src_base;
+	d->src_size = src_size;
+	d->state = DELTA_HEADER;
+	d->want = 8;
+	d->cb = cb;
+	d->arg = arg;
+}
+
+/* Returns false on a bad delta, or if cb does */
+bool ICACHE_FLASH_ATTR delta_feed(struct delta *d, const uint8_t *data,
+	uint32_t len)
+{
+	uint32_t n;
+
+	while (len > 0) {
+		if (d->state == DELTA_COPY) {
+			/* Keep the rest until the copy's done */
+			if (len > sizeof(d->pending) - d->pending_len)
+				return false;
+			os_memmove(d->pending + d->pending_len, data, len);
+			d->pending_len += len;
+			return true;
+		}
+
+		if (d->state == DELTA_DATA) {
+			n = d->len < len ? d->len : len;
+			if (n > DELTA_CHUNK)
+				n = DELTA_CHUNK;
+			if (d->op == 'A') {
+				if (!delta_add(d, data, n))
+					return false;
+			} else if (!delta_emit(d, data, n)) {
+				return false;
+			}
+			data += n;
+			len -= n;
+			d->len -= n;
+			if (d->len == 0)
+				d->state = DELTA_OP;
+			continue;
+		}
+
+		if (d->state == DELTA_OP) {
+			d->op = *data++;
+			len--;
+			if (d->op != 'C' && d->op != 'A' && d->op != 'I')
+				return false;
+			d->state = DELTA_ARGS;
+			d->got = 0;
+			d->want = (d->op == 'I') ? 4 : 8;
+			continue;
+		}
+
+		/* Header or record arguments */
+		d->fields[d->got++] = *data++;
+		len--;
+		if (d->got < d->want)
+			continue;
+
+		if (d->state == DELTA_HEADER) {
+			if (os_memcmp(d->fields, DELTA_MAGIC, 4) != 0)
+				return false;
+			d->target_len = delta_le32(d->fields + 4);
+			d->state = DELTA_OP;
+		} else if (!delta_record(d)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * A copy can be most of the image, so rather than do it all at once the
+ * caller steps through it a DELTA_CHUNK at a time, while delta_busy(),
+ * giving whatever's writing the output a chance to keep up. Anything fed
+ * in meanwhile is dealt with once the copy's done.
+ */
+bool ICACHE_FLASH_ATTR delta_step(struct delta *d)
+{
+	uint32_t chunk;
+	uint16_t len;
+	uint8_t *old;
+
+	if (d->state != DELTA_COPY)
+		return true;
+
+	chunk = d->len < DELTA_CHUNK ? d->len : DELTA_CHUNK;
+	old = delta_read_src(d, chunk);
+	if (old == NULL || !delta_emit(d, old, chunk))
+		return false;
+	d->src += chunk;
+	d->len -= chunk;
+	if (d->len > 0)
+		return true;
+
+	d->state = DELTA_OP;
+	len = d->pending_len;
+	d->pending_len = 0;
+	return delta_feed(d, d->pending, len);
+}
+
+bool ICACHE_FLASH_ATTR delta_busy(const struct delta *d)
+{
+	return d->state == DELTA_COPY;
+}
+
+/* End of the delta; true if it all hung together */
+bool ICACHE_FLASH_ATTR delta_finish(struct delta *d)
+{
+	return d->state == DELTA_OP && d->written == d->target_len;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <c_types.h>
+
+#define DELTA_CHUNK	64
+/* How much input can be put aside while a copy is under way */
+#define DELTA_PENDING	256
+
+typedef bool (*delta_out_cb)(void *arg, const uint8_t *data, uint32_t len);
+
+struct delta {
+	uint32_t src_base;	/* Flash address of the image we patch */
+	uint32_t src_size;
+	uint32_t target_len;	/* From the header */
+	uint32_t written;
+	uint8_t state;
+	uint8_t op;
+	uint8_t got;		/* Bytes of fields[] we have */
+	uint8_t want;
+	uint8_t fields[8];
+	uint32_t src;		/* Where the current record reads from */
+	uint32_t len;		/* And how much it has left */
+	/* Enough words for DELTA_CHUNK bytes at any alignment */
+	uint32_t buf[DELTA_CHUNK / 4 + 1];
+	uint8_t pending[DELTA_PENDING];
+	uint16_t pending_len;
+	delta_out_cb cb;
+	void *arg;
+};
+
+void ICACHE_FLASH_ATTR delta_init(struct delta *d, uint32_t src_base,
+	uint32_t src_size, delta_out_cb cb, void *arg);
+bool ICACHE_FLASH_ATTR delta_feed(struct delta *d, const uint8_t *data,
+	uint32_t len);
+bool ICACHE_FLASH_ATTR delta_step(struct delta *d);
+bool ICACHE_FLASH_ATTR delta_busy(const struct delta *d);
+bool ICACHE_FLASH_ATTR delta_finish(struct delta *d);
+
+#endif /* _DELTA_H_ */
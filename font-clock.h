@@ -0,0 +1,56 @@
+/*
+ * Full height digits for the time display, 0 to 9. Drawn for this clock,
+ * as the fonts are all too small to make good use of the display.
+ */
+
+/*
+ * Copyright 2018 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Full height digits for the time display, 0 to 9.
+ */
+
+static const struct fontchar clocknums[] = {
+	/* 48 (zero) */
+	{ .width = 5,
+	  .bitmap = { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e } },
+	/* 49 (one) */
+	{ .width = 3,
+	  .bitmap = { 0x02, 0x03, 0x02, 0x02, 0x02, 0x02, 0x02, 0x07 } },
+	/* 50 (two) */
+	{ .width = 5,
+	  .bitmap = { 0x0e, 0x11, 0x10, 0x10, 0x08, 0x04, 0x02, 0x1f } },
+	/* 51 (three) */
+	{ .width = 5,
+	  .bitmap = { 0x0e, 0x11, 0x10, 0x0c, 0x10, 0x10, 0x11, 0x0e } },
+	/* 52 (four) */
+	{ .width = 6,
+	  .bitmap = { 0x10, 0x18, 0x14, 0x12, 0x11, 0x3f, 0x10, 0x10 } },
+	/* 53 (five) */
+	{ .width = 5,
+	  .bitmap = { 0x1f, 0x01, 0x01, 0x0f, 0x10, 0x10, 0x11, 0x0e } },
+	/* 54 (six) */
+	{ .width = 5,
+	  .bitmap = { 0x0e, 0x11, 0x01, 0x0f, 0x11, 0x11, 0x11, 0x0e } },
+	/* 55 (seven) */
+	{ .width = 5,
+	  .bitmap = { 0x1f, 0x10, 0x10, 0x08, 0x04, 0x02, 0x02, 0x02 } },
+	/* 56 (eight) */
+	{ .width = 5,
+	  .bitmap = { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x11, 0x0e } },
+	/* 57 (nine) */
+	{ .width = 5,
+	  .bitmap = { 0x0e, 0x11, 0x11, 0x11, 0x1e, 0x10, 0x11, 0x0e } }
+};
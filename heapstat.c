@@ -0,0 +1,54 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Keep an eye on the heap. The SDK doesn't tell us anything about free
+ * block sizes, so we can't measure fragmentation directly; instead we
+ * count how often the free heap has moved between two samples taken while
+ * idle. Once everything uses static state that count should stop going up,
+ * and min_free tells us how close we've come to running out.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+
+#include "heapstat.h"
+
+static struct heap_stats heap;
+
+void ICACHE_FLASH_ATTR heapstat_sample(void)
+{
+	uint32_t free = system_get_free_heap_size();
+
+	if (heap.samples == 0 || free < heap.min_free)
+		heap.min_free = free;
+	if (heap.samples != 0 && free != heap.free)
+		heap.changes++;
+
+	heap.free = free;
+	heap.samples++;
+}
+
+void ICACHE_FLASH_ATTR heapstat_get(struct heap_stats *stats)
+{
+	*stats = heap;
+}
+
+void ICACHE_FLASH_ATTR heapstat_print(void)
+{
+	os_printf("Heap: %u free, %u minimum, %u changes in %u samples.\n",
+		heap.free, heap.min_free, heap.changes, heap.samples);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HEAPSTAT_H_
+#define _HEAPSTAT_H_
+
+struct heap_stats {
+	uint32_t free;		/* Free heap at the last sample */
+	uint32_t min_free;	/* Lowest free heap we've seen */
+	uint32_t changes;	/* Samples where free heap had moved */
+	uint32_t samples;
+};
+
+void ICACHE_FLASH_ATTR heapstat_sample(void);
+void ICACHE_FLASH_ATTR heapstat_get(struct heap_stats *stats);
+void ICACHE_FLASH_ATTR heapstat_print(void);
+
+#endif /* _HEAPSTAT_H_ */
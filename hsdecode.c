@@ -0,0 +1,133 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Decoder for the heatshrink LZSS format (as written by
+ * "heatshrink -e -w 8 -l 4"), fed however much input we happen to have.
+ * The stream is a run of bit fields, most significant bit first: a 1
+ * followed by an 8 bit literal, or a 0 followed by how far back (less one)
+ * in the window and how many bytes (less one) to copy from there. The
+ * window is only 256 bytes, which is all the state we need.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+
+#include "hsdecode.h"
+
+#define HSDECODE_WINDOW_MASK	((1 << HSDECODE_WINDOW_BITS) - 1)
+
+enum {
+	HSDECODE_TAG,
+	HSDECODE_LITERAL,
+	HSDECODE_INDEX,
+	HSDECODE_COUNT,
+};
+
+static bool ICACHE_FLASH_ATTR hsdecode_flush(struct hsdecode *hs)
+{
+	uint8_t len = hs->out_len;
+
+	hs->out_len = 0;
+	return len == 0 || hs->cb(hs->arg, hs->out, len);
+}
+
+static bool ICACHE_FLASH_ATTR hsdecode_emit(struct hsdecode *hs, uint8_t c)
+{
+	hs->window[hs->head++ & HSDECODE_WINDOW_MASK] = c;
+	hs->out[hs->out_len++] = c;
+
+	return hs->out_len < HSDECODE_OUT_LEN || hsdecode_flush(hs);
+}
+
+/* We have a whole field; act on it and work out what comes next */
+static bool ICACHE_FLASH_ATTR hsdecode_field(struct hsdecode *hs)
+{
+	uint16_t count;
+
+	switch (hs->state) {
+	case HSDECODE_TAG:
+		if (hs->value) {
+			hs->state = HSDECODE_LITERAL;
+			hs->need = 8;
+		} else {
+			hs->state = HSDECODE_INDEX;
+			hs->need = HSDECODE_WINDOW_BITS;
+		}
+		break;
+	case HSDECODE_LITERAL:
+		if (!hsdecode_emit(hs, hs->value))
+			return false;
+		hs->state = HSDECODE_TAG;
+		hs->need = 1;
+		break;
+	case HSDECODE_INDEX:
+		hs->index = hs->value + 1;
+		hs->state = HSDECODE_COUNT;
+		hs->need = HSDECODE_COUNT_BITS;
+		break;
+	case HSDECODE_COUNT:
+		for (count = hs->value + 1; count > 0; count--) {
+			if (!hsdecode_emit(hs, hs->window[(hs->head - hs->index) &
+					HSDECODE_WINDOW_MASK]))
+				return false;
+		}
+		hs->state = HSDECODE_TAG;
+		hs->need = 1;
+		break;
+	}
+
+	hs->value = 0;
+	return true;
+}
+
+/* Output is passed to cb in pieces of up to HSDECODE_OUT_LEN bytes */
+void ICACHE_FLASH_ATTR hsdecode_init(struct hsdecode *hs, hsdecode_out_cb cb,
+	void *arg)
+{
+	os_memset(hs, 0, sizeof(*hs));
+	hs->state = HSDECODE_TAG;
+	hs->need = 1;
+	hs->cb = cb;
+	hs->arg = arg;
+}
+
+/* Returns false if cb did */
+bool ICACHE_FLASH_ATTR hsdecode_feed(struct hsdecode *hs,
+	const uint8_t *data, uint32_t len)
+{
+	uint8_t byte, bit;
+
+	while (len--) {
+		byte = *data++;
+		for (bit = 0x80; bit; bit >>= 1) {
+			hs->value = (hs->value << 1) | ((byte & bit) ? 1 : 0);
+			if (--hs->need == 0 && !hsdecode_field(hs))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * End of the input; whatever's left is padding out the last byte. Pass
+ * on anything we're still holding.
+ */
+bool ICACHE_FLASH_ATTR hsdecode_finish(struct hsdecode *hs)
+{
+	return hsdecode_flush(hs);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HSDECODE_H_
+#define _HSDECODE_H_
+
+#include <c_types.h>
+
+/* Must match the -w and -l the image was compressed with */
+#define HSDECODE_WINDOW_BITS	8
+#define HSDECODE_COUNT_BITS	4
+#define HSDECODE_OUT_LEN	64
+
+typedef bool (*hsdecode_out_cb)(void *arg, const uint8_t *data,
+	uint32_t len);
+
+struct hsdecode {
+	uint8_t window[1 << HSDECODE_WINDOW_BITS];
+	uint16_t head;		/* Where the next byte goes in window */
+	uint8_t state;
+	uint8_t need;		/* Bits still to read for this field */
+	uint16_t value;		/* The field so far */
+	uint16_t index;		/* Of the back reference being read */
+	uint8_t out[HSDECODE_OUT_LEN];
+	uint8_t out_len;
+	hsdecode_out_cb cb;
+	void *arg;
+};
+
+void ICACHE_FLASH_ATTR hsdecode_init(struct hsdecode *hs, hsdecode_out_cb cb,
+	void *arg);
+bool ICACHE_FLASH_ATTR hsdecode_feed(struct hsdecode *hs,
+	const uint8_t *data, uint32_t len);
+bool ICACHE_FLASH_ATTR hsdecode_finish(struct hsdecode *hs);
+
+#endif /* _HSDECODE_H_ */
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * An HTTP/1.x response parser that can be fed a TCP segment at a time,
+ * split wherever the network likes. The status line, headers and chunk
+ * sizes are gathered a line at a time into our own small buffer (so we
+ * never write into, or run off the end of, the segment we were given);
+ * the body is handed on in place without being copied.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+
+#include "http.h"
+
+enum {
+	HTTP_STATUS,
+	HTTP_HEADER,
+	HTTP_BODY,
+	HTTP_CHUNK_SIZE,
+	HTTP_CHUNK_DATA,
+	HTTP_CHUNK_END,		/* The CRLF after a chunk's data */
+	HTTP_TRAILER,
+	HTTP_FINISHED,
+	HTTP_FAILED,
+};
+
+static char ICACHE_FLASH_ATTR http_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* Header names are case insensitive; want should be lower case */
+bool ICACHE_FLASH_ATTR http_name_is(const char *name, const char *want)
+{
+	while (*name && http_lower(*name) == *want) {
+		name++;
+		want++;
+	}
+
+	return *name == '\0' && *want == '\0';
+}
+
+/* Returns HTTP_LEN_UNKNOWN if there are no digits, or on overflow */
+static uint32_t ICACHE_FLASH_ATTR http_number(const char *s, int base)
+{
+	uint32_t val = 0;
+	int digit;
+	bool any = false;
+
+	for (;; s++) {
+		if (*s >= '0' && *s <= '9')
+			digit = *s - '0';
+		else if (base == 16 && http_lower(*s) >= 'a' &&
+				http_lower(*s) <= 'f')
+			digit = http_lower(*s) - 'a' + 10;
+		else
+			break;
+
+		if (val > (HTTP_LEN_UNKNOWN - 1 - digit) / base)
+			return HTTP_LEN_UNKNOWN;
+		val = val * base + digit;
+		any = true;
+	}
+
+	return any ? val : HTTP_LEN_UNKNOWN;
+}
+
+static bool ICACHE_FLASH_ATTR http_status_line(struct http_parser *p)
+{
+	const char *s = p->line;
+
+	if (os_strncmp(s, "HTTP/1.", 7) != 0 || s[8] != ' ')
+		return false;
+	s += 9;
+	if (s[0] < '1' || s[0] > '5' || s[1] < '0' || s[1] > '9' ||
+			s[2] < '0' || s[2] > '9')
+		return false;
+	p->status = (s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0');
+	/* 1.1 keeps the connection open unless it says otherwise */
+	p->keep_alive = (p->line[7] != '0');
+
+	return true;
+}
+
+/* The blank line; work out what sort of body follows */
+static bool ICACHE_FLASH_ATTR http_headers_done(struct http_parser *p)
+{
+	if (p->status < 200) {
+		/* We never ask to switch protocols */
+		if (p->status == 101)
+			return false;
+		/* 100 Continue and the like; the real response follows */
+		p->status = 0;
+		p->state = HTTP_STATUS;
+		return true;
+	}
+
+	if (!p->header(p->arg, NULL, NULL))
+		return false;
+
+	if (p->head || p->status == 204 || p->status == 304) {
+		p->state = HTTP_FINISHED;
+	} else if (p->chunked) {
+		p->state = HTTP_CHUNK_SIZE;
+	} else {
+		/* No length means it runs until the server hangs up */
+		p->remaining = p->content_len;
+		if (p->remaining == HTTP_LEN_UNKNOWN)
+			p->keep_alive = false;
+		p->state = p->remaining ? HTTP_BODY : HTTP_FINISHED;
+	}
+
+	return true;
+}
+
+static bool ICACHE_FLASH_ATTR http_header_line(struct http_parser *p)
+{
+	char *name = p->line, *value, *end;
+
+	if (p->line[0] == '\0')
+		return http_headers_done(p);
+	/* An interim response's headers aren't the real response's */
+	if (p->status < 200)
+		return true;
+
+	value = os_strchr(name, ':');
+	if (value == NULL)
+		return false;
+	*value++ = '\0';
+	while (*value == ' ' || *value == '\t')
+		value++;
+	end = value + os_strlen(value);
+	while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+		*--end = '\0';
+
+	if (http_name_is(name, "content-length")) {
+		p->content_len = http_number(value, 10);
+		if (p->content_len == HTTP_LEN_UNKNOWN)
+			return false;
+	} else if (http_name_is(name, "transfer-encoding")) {
+		/* Anything other than chunked we can't undo */
+		if (!http_name_is(value, "chunked"))
+			return false;
+		p->chunked = true;
+	} else if (http_name_is(name, "connection")) {
+		if (http_name_is(value, "close"))
+			p->keep_alive = false;
+		else if (http_name_is(value, "keep-alive"))
+			p->keep_alive = true;
+	}
+
+	return p->header(p->arg, name, value);
+}
+
+/* Deal with a complete line, according to where we are */
+static bool ICACHE_FLASH_ATTR http_line(struct http_parser *p)
+{
+	switch (p->state) {
+	case HTTP_STATUS:
+		if (!http_status_line(p))
+			return false;
+		p->state = HTTP_HEADER;
+		return true;
+	case HTTP_HEADER:
+		return http_header_line(p);
+	case HTTP_CHUNK_SIZE:
+		/* Anything after the size is an extension we don't care about */
+		p->remaining = http_number(p->line, 16);
+		if (p->remaining == HTTP_LEN_UNKNOWN)
+			return false;
+		p->state = p->remaining ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+		return true;
+	case HTTP_CHUNK_END:
+		p->state = HTTP_CHUNK_SIZE;
+		return p->line[0] == '\0';
+	case HTTP_TRAILER:
+		if (p->line[0] == '\0')
+			p->state = HTTP_FINISHED;
+		return true;
+	default:
+		return false;
+	}
+}
+
+void ICACHE_FLASH_ATTR http_init(struct http_parser *p, bool head,
+	http_header_cb header, http_body_cb body, void *arg)
+{
+	os_memset(p, 0, sizeof(*p));
+	p->state = HTTP_STATUS;
+	p->head = head;
+	p->content_len = HTTP_LEN_UNKNOWN;
+	p->header = header;
+	p->body = body;
+	p->arg = arg;
+}
+
+/*
+ * Feed in the next len bytes of the response. Anything after the end of
+ * the response is ignored.
+ */
+int ICACHE_FLASH_ATTR http_parse(struct http_parser *p, const char *data,
+	uint32_t len)
+{
+	uint32_t n;
+	char c;
+
+	while (len > 0 && p->state != HTTP_FINISHED &&
+			p->state != HTTP_FAILED) {
+		if (p->state == HTTP_BODY || p->state == HTTP_CHUNK_DATA) {
+			n = len < p->remaining ? len : p->remaining;
+			if (!p->body(p->arg, (const uint8_t *) data, n)) {
+				p->state = HTTP_FAILED;
+				break;
+			}
+			data += n;
+			len -= n;
+			/* Unknown length is left alone, so never reaches 0 */
+			if (p->remaining != HTTP_LEN_UNKNOWN)
+				p->remaining -= n;
+			if (p->remaining == 0)
+				p->state = (p->state == HTTP_BODY) ?
+					HTTP_FINISHED : HTTP_CHUNK_END;
+			continue;
+		}
+
+		c = *data++;
+		len--;
+		if (c == '\r')
+			continue;
+		if (c != '\n') {
+			/* Overlong lines get cut short; we don't need them */
+			if (p->line_len < HTTP_LINE_LEN - 1)
+				p->line[p->line_len++] = c;
+			continue;
+		}
+
+		p->line[p->line_len] = '\0';
+		p->line_len = 0;
+		if (!http_line(p))
+			p->state = HTTP_FAILED;
+	}
+
+	if (p->state == HTTP_FAILED)
+		return HTTP_ERROR;
+
+	return p->state == HTTP_FINISHED ? HTTP_DONE : HTTP_MORE;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <c_types.h>
+
+#define HTTP_LINE_LEN		128
+#define HTTP_LEN_UNKNOWN	0xFFFFFFFF
+
+/* What http_parse() returns */
+#define HTTP_ERROR		-1
+#define HTTP_MORE		0
+#define HTTP_DONE		1
+
+/*
+ * Called for each header, with name and value NUL terminated; then once
+ * more with both NULL when the headers are over. Return false to give up.
+ */
+typedef bool (*http_header_cb)(void *arg, const char *name,
+	const char *value);
+/* Called with each piece of the body, as it arrives */
+typedef bool (*http_body_cb)(void *arg, const uint8_t *data, uint32_t len);
+
+struct http_parser {
+	uint8_t state;
+	bool head;		/* Response to a HEAD, so no body */
+	bool chunked;
+	bool keep_alive;	/* Server will take another request after */
+	uint16_t status;
+	uint32_t content_len;	/* HTTP_LEN_UNKNOWN if we weren't told */
+	uint32_t remaining;	/* Of the body, or the current chunk */
+	uint16_t line_len;
+	char line[HTTP_LINE_LEN];
+	http_header_cb header;
+	http_body_cb body;
+	void *arg;
+};
+
+void ICACHE_FLASH_ATTR http_init(struct http_parser *p, bool head,
+	http_header_cb header, http_body_cb body, void *arg);
+int ICACHE_FLASH_ATTR http_parse(struct http_parser *p, const char *data,
+	uint32_t len);
+bool ICACHE_FLASH_ATTR http_name_is(const char *name, const char *want);
+
+#endif /* _HTTP_H_ */
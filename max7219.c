@@ -22,6 +22,7 @@
 #include <os_type.h>
 #include <gpio.h>
 
+#include "assets.h"
 #include "max7219.h"
 #include "spi.h"
 
@@ -132,12 +133,36 @@ void ICACHE_FLASH_ATTR max7219_clear(void)
 		ctx.buf[i] = 0;
 }
 
-void ICACHE_FLASH_ATTR max7219_show(void)
+/*
+ * Copy the given rows in from a buffer laid out like ours, width pixels
+ * across starting from the left.
+ */
+void ICACHE_FLASH_ATTR max7219_load_rows(const uint8_t *buf,
+	unsigned int width, uint8_t rows)
+{
+	unsigned int y, block;
+
+	for (y = 0; y < 8; y++) {
+		if (!(rows & (1 << y))) {
+			continue;
+		}
+		for (block = 0; block < width / 8 && block < ctx.width;
+				block++) {
+			ctx.buf[y + (block << 3)] = buf[y + (block << 3)];
+		}
+	}
+}
+
+/* Only send the rows that have changed; bit 0 is the top row */
+void ICACHE_FLASH_ATTR max7219_show_rows(uint8_t rows)
 {
 	int y, block;
 	uint8_t data[2];
 
 	for (y = 0; y < 8; y++) {
+		if (!(rows & (1 << y))) {
+			continue;
+		}
 		/* Set CS low */
 		gpio_output_set(0, ctx.cs, ctx.cs, 0);
 		for (block = ctx.width - 1; block >= 0; block--) {
@@ -151,18 +176,28 @@ void ICACHE_FLASH_ATTR max7219_show(void)
 	}
 }
 
+void ICACHE_FLASH_ATTR max7219_show(void)
+{
+	max7219_show_rows(0xFF);
+}
+
 void ICACHE_FLASH_ATTR max7219_print(const char *str)
 {
+	const struct asset_entry *asset = asset_find("text", ASSET_FONT);
+	struct fontchar glyph;
 	int x = 0;
 	unsigned char cur;
 
 	while ((cur = (unsigned char) *str++) && x < (ctx.width * 8)) {
-		if ((cur > 31) && (cur < 127)) {
-			cur -= 32;
-			max7219_blit(x, 0, font[cur].bitmap,
-				font[cur].width, 8);
-			x += font[cur].width + 1;
+		if (asset != NULL && asset_glyph(asset, cur, &glyph)) {
+			/* Font from the asset partition */
+		} else if ((cur > 31) && (cur < 127)) {
+			glyph = font[cur - 32];
+		} else {
+			continue;
 		}
+		max7219_blit(x, 0, glyph.bitmap, glyph.width, 8);
+		x += glyph.width + 1;
 	}
 }
 
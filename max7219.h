@@ -28,6 +28,9 @@ void ICACHE_FLASH_ATTR max7219_blit(unsigned int x, unsigned int y,
 	const uint8_t *data, unsigned int width, unsigned int height);
 void ICACHE_FLASH_ATTR max7219_clear(void);
 void ICACHE_FLASH_ATTR max7219_print(const char *str);
+void ICACHE_FLASH_ATTR max7219_load_rows(const uint8_t *buf,
+	unsigned int width, uint8_t rows);
+void ICACHE_FLASH_ATTR max7219_show_rows(uint8_t rows);
 void ICACHE_FLASH_ATTR max7219_show(void);
 void ICACHE_FLASH_ATTR max7219_init(unsigned int cs);
 
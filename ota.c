@@ -17,25 +17,171 @@
 #include <user_interface.h>
 #include <osapi.h>
 #include <espconn.h>
-#include <mem.h>
 #include <stdlib.h>
 #include <upgrade.h>
 
+#include "anim.h"
+#include "assets.h"
+#include "clock.h"
+#include "config.h"
+#include "delta.h"
+#include "hsdecode.h"
+#include "http.h"
 #include "ota.h"
+#include "otaflash.h"
+#include "resolv.h"
 #include "project_config.h"
 
+/* Biggest image that fits in a slot */
+#define OTA_MAX_IMAGE	0x6B000
+/* Reconnects we'll make in one upgrade before giving up until next time */
+#define OTA_MAX_RETRIES	5
+/* Longest validators we'll remember for a conditional version check */
+#define OTA_ETAG_LEN	48
+#define OTA_DATE_LEN	32
+#define OTA_HOST_LEN	64
+#define OTA_PATH_LEN	64
+/*
+ * Received data waits here until the pump gets to it. The connection is
+ * held meanwhile, which stops the window opening again, so the most that
+ * can be waiting is the SDK's TCP_WND.
+ */
+#define OTA_IN_LEN	(4 * 1460)
+/*
+ * Bytes handed to the parser at a time. Even compressed that unpacks to
+ * under 200 bytes, which delta.c can put aside if it's in the middle of a
+ * copy (DELTA_PENDING).
+ */
+#define OTA_STEP	16
+/* How long the pump keeps going before letting everything else run */
+#define OTA_PUMP_US	2000
+
+#ifndef CFG_OTA_INTERVAL
+/* Seconds between upgrade checks */
+#define CFG_OTA_INTERVAL	(24 * 3600)
+#endif
+#ifndef CFG_OTA_SPREAD
+/* Up to this many seconds are added at random to each check */
+#define CFG_OTA_SPREAD		(15 * 60)
+#endif
+#ifndef CFG_OTA_RETRY
+/*
+ * Seconds before trying again when a check doesn't get an answer, with up
+ * to as many again added at random.
+ */
+#define CFG_OTA_RETRY		(5 * 60)
+#endif
+/*
+ * Local hours between which checks are allowed, start inclusive. If they're
+ * the same there's no restriction; if start is later than end the window
+ * runs over midnight.
+ */
+#ifndef CFG_OTA_WINDOW_START
+#define CFG_OTA_WINDOW_START	0
+#endif
+#ifndef CFG_OTA_WINDOW_END
+#define CFG_OTA_WINDOW_END	0
+#endif
+
 struct ota_status {
+	/* First, as the espconn callbacks are handed it rather than us */
 	struct espconn conn;
+	char host[OTA_HOST_LEN];
+	char path[OTA_PATH_LEN];
+	struct http_parser http;
+	struct hsdecode hs;
+	struct delta patch;
+	bool busy;
 	bool do_update;
+	bool do_assets;
+	bool image;		/* Current request is for the image... */
+	bool assets;		/* ...or rather the asset blob */
+	bool got_version;
+	bool checked;		/* The server answered the version check */
+	bool receiving;		/* Image is on its way into flash */
+	bool compressed;	/* ...and needs decompressing first */
+	bool want_delta;	/* Ask for a delta rather than the image */
+	bool delta;		/* ...and that's what the current request is */
+	bool connected;
+	uint8_t retries;
+	uint32_t resume_from;	/* Asked for the image from here on */
+	uint32_t range_start;	/* Where the server says it's sending from */
+	bool verifying;		/* All received; checking it before boot */
+	bool got_md5;
+	uint8_t md5[OTAFLASH_MD5_LEN];
 	uint8_t slot;
-	uint32_t rcvd_len;
-	uint32_t content_len;
-	ip_addr_t server_ip;
+	uint8_t maj, min;	/* Version the server has */
+	uint16_t assets_ver;
+	bool got_assets_md5;
+	uint8_t assets_md5[OTAFLASH_MD5_LEN];
+	char etag[OTA_ETAG_LEN];
+	char modified[OTA_DATE_LEN];
 };
 
+/* When to check next, and the validators from the last check to send */
+static struct {
+	uint32_t next;		/* Uptime, in seconds */
+	bool waiting;		/* Due, but outside the window */
+	char etag[OTA_ETAG_LEN];
+	char modified[OTA_DATE_LEN];
+	os_timer_t timer;
+} sched;
+
+/*
+ * There's only ever one upgrade check running, so its state and TCP
+ * details live here rather than on the heap. upgrade.busy marks the slot
+ * as owned from ota_check() until the final disconnect or failure.
+ */
+static struct ota_status upgrade;
+static esp_tcp upgrade_tcp;
+
+/*
+ * What the server's sent that we haven't dealt with yet. Receive callbacks
+ * just queue it here and hold the connection; the pump then feeds it to
+ * the parser from a timer, a little at a time, stepping through any delta
+ * copies along the way. Only once it's all been dealt with is the
+ * connection let go, so the server can't get ahead of us.
+ */
+static struct {
+	char buf[OTA_IN_LEN];
+	uint16_t len;
+	uint16_t pos;		/* Dealt with up to here */
+	bool held;
+	bool complete;		/* All the image is in; finish once caught up */
+	bool closed;		/* Server has gone; deal with it once caught up */
+	bool overrun;		/* Sent more than fits; drop the connection */
+	os_timer_t timer;
+} pump;
+
+static void ICACHE_FLASH_ATTR ota_closed(struct ota_status *upgrade);
+static void ICACHE_FLASH_ATTR ota_retry(void);
+
+/* Forget anything still queued; it's no use to us now */
+static void ICACHE_FLASH_ATTR ota_pump_stop(void)
+{
+	os_timer_disarm(&pump.timer);
+	pump.len = pump.pos = 0;
+	pump.held = false;
+	pump.complete = false;
+	pump.closed = false;
+	pump.overrun = false;
+}
+
+/* Done with this connection; ota_closed() decides what happens next */
+static void ICACHE_FLASH_ATTR ota_hangup(struct ota_status *upgrade)
+{
+	ota_pump_stop();
+	if (upgrade->connected) {
+		espconn_disconnect(&upgrade->conn);
+	} else {
+		/* The server beat us to it */
+		ota_closed(upgrade);
+	}
+}
+
 static void ICACHE_FLASH_ATTR ota_finish(struct ota_status *upgrade)
 {
-	espconn_disconnect(&upgrade->conn);
+	ota_hangup(upgrade);
 
 	if (system_upgrade_flag_check() == UPGRADE_FLAG_FINISH) {
 		os_printf("Rebooting into new ROM.\n");
@@ -47,146 +193,718 @@ static void ICACHE_FLASH_ATTR ota_finish(struct ota_status *upgrade)
 	return;
 }
 
-static void ICACHE_FLASH_ATTR ota_receive(void *arg, char *buf,
-		unsigned short len)
+/* Something went wrong; leave the slot alone */
+static void ICACHE_FLASH_ATTR ota_fail(struct ota_status *upgrade)
+{
+	if (upgrade->delta) {
+		/* We'll have another go with the whole image on reconnect */
+		os_printf("Delta failed; trying full image.\n");
+		otaflash_abort();
+		upgrade->want_delta = false;
+		upgrade->receiving = false;
+		ota_hangup(upgrade);
+		return;
+	}
+
+	otaflash_abort();
+	upgrade->do_update = false;
+	upgrade->do_assets = false;
+	upgrade->receiving = false;
+	ota_finish(upgrade);
+}
+
+static bool ICACHE_FLASH_ATTR ota_write(void *arg, const uint8_t *data,
+		uint32_t len)
+{
+	return otaflash_write(data, len);
+}
+
+/* Decompressed (if need be); apply it to the old image if it's a delta */
+static bool ICACHE_FLASH_ATTR ota_unpacked(void *arg, const uint8_t *data,
+		uint32_t len)
 {
-	uint8_t maj, min;
-	char *verstr;
-	char *lenhdr, *data, *ptr;
 	struct ota_status *upgrade = arg;
-	int sectors;
 
-	if (!upgrade->do_update) {
-		if ((os_strncmp(buf + 9, "200", 3) != 0)) {
-			os_printf("Failed to fetch version info: %.3s\n",
-					buf + 9);
-			return;
-		}
-		/* We're checking if we need an update; look for the version */
-		verstr = os_strstr(buf, "ESP8266-Upgrade-Version: ");
-		if (!verstr) {
-			os_printf("Couldn't find version. Got data: %s\n",
-					buf);
-			return;
-		}
-		verstr += strlen("ESP8266-Upgrade-Version: ");
+	if (upgrade->delta) {
+		return delta_feed(&upgrade->patch, data, len);
+	}
 
-		maj = strtol(verstr, &verstr, 10);
-		if (*verstr != '.') {
-			os_printf("Parsed major version %d, "
-					"but unexpected %c\n",
-					maj, *verstr);
-		}
-		verstr++;
-		min = strtol(verstr, NULL, 10);
+	return otaflash_write(data, len);
+}
+
+/* Where the current download goes */
+static uint32_t ICACHE_FLASH_ATTR ota_base(const struct ota_status *upgrade)
+{
+	if (upgrade->assets) {
+		return ASSET_BASE;
+	}
+
+	return upgrade->slot ? 0x81000 : 0x1000;
+}
+
+/* ...and what it should hash to, if we know */
+static const uint8_t ICACHE_FLASH_ATTR *ota_md5(
+		const struct ota_status *upgrade)
+{
+	if (upgrade->assets) {
+		return upgrade->assets_md5;
+	}
+
+	return upgrade->got_md5 ? upgrade->md5 : NULL;
+}
+
+/* We have the status and all the headers; decide what to do */
+static bool ICACHE_FLASH_ATTR ota_headers_done(struct ota_status *upgrade)
+{
+	uint32_t len = upgrade->http.content_len;
+	uint32_t max = upgrade->assets ? ASSET_SIZE : OTA_MAX_IMAGE;
+
+	if (upgrade->delta && upgrade->http.status != 200) {
+		/* Not every old version will have one; ask for the lot */
+		os_printf("No delta from %d.%d; fetching full image.\n",
+			VER_MAJ, VER_MIN);
+		upgrade->want_delta = false;
+		return true;
+	}
+
+	if (!upgrade->image && upgrade->http.status == 304) {
+		os_printf("Version info unchanged since last check.\n");
+		upgrade->checked = true;
+		return true;
+	}
+
+	if (upgrade->http.status != 200 &&
+			!(upgrade->resume_from != 0 &&
+			  upgrade->http.status == 206)) {
+		os_printf("Failed to fetch %s: %u\n",
+			upgrade->assets ? "assets" :
+			upgrade->image ? "ROM data" : "version info",
+			upgrade->http.status);
+		return false;
+	}
 
+	if (!upgrade->image) {
+		if (!upgrade->got_version) {
+			os_printf("Couldn't find version.\n");
+			return false;
+		}
 		os_printf("Got version %d.%d; I have version %d.%d\n",
-				maj, min, VER_MAJ, VER_MIN);
-		if (maj > VER_MAJ || (maj == VER_MAJ && min > VER_MIN)) {
+				upgrade->maj, upgrade->min, VER_MAJ, VER_MIN);
+		upgrade->checked = true;
+		if (upgrade->maj > VER_MAJ ||
+				(upgrade->maj == VER_MAJ &&
+				 upgrade->min > VER_MIN)) {
 			os_printf("Need upgrade.\n");
 			upgrade->do_update = true;
 		}
-	} else {
-		/* Trying to read the rom image */
-
-		/* First reply? */
-		if (upgrade->content_len == 0) {
-			if ((lenhdr = os_strstr(buf, "Content-Length: ")) &&
-				(data = os_strstr(lenhdr, "\r\n\r\n")) &&
-				(os_strncmp(buf + 9, "200", 3) == 0)) {
-
-				data += 4;
-				len -= (data - buf);
-
-				lenhdr += 16; /* Content-Length:<sp> */
-				ptr = os_strstr(lenhdr, "\r\n");
-				*ptr = '\0';
-				upgrade->content_len = atoi(lenhdr);
-				os_printf("Reading %d bytes of image.\n,",
-						upgrade->content_len);
-
-				if (upgrade->content_len > 0x6B000) {
-					os_printf("Image too large.\n");
-					upgrade->do_update = false;
-					ota_finish(upgrade);
-					return;
-				}
-
-				sectors = (upgrade->content_len +
-						SPI_FLASH_SEC_SIZE - 1) >> 12;
-				while (sectors--) {
-					spi_flash_erase_sector(sectors +
-						(upgrade->slot ? 129 : 1));
-				}
-
-				spi_flash_write(
-					(upgrade->slot ? 0x81000 : 0x1000),
-					(void *) data, len);
-				upgrade->rcvd_len = len;
-
-			} else {
-				ptr = os_strstr(buf, "\r\n");
-				*ptr = '\0';
-				os_printf("Error getting ROM data: %s\n", buf);
-				upgrade->do_update = false;
-				ota_finish(upgrade);
-				return;
-			}
+		/* Fonts and so on are versioned separately from the code */
+		if (upgrade->got_assets_md5 &&
+				upgrade->assets_ver > asset_version()) {
+			os_printf("Need assets version %u; I have %u.\n",
+				upgrade->assets_ver, asset_version());
+			upgrade->do_assets = true;
+		}
+		/*
+		 * Only remember these once there's nothing to do, so a failed
+		 * upgrade doesn't get a 304 next time round.
+		 */
+		if (upgrade->do_update || upgrade->do_assets) {
+			sched.etag[0] = sched.modified[0] = '\0';
 		} else {
-			spi_flash_write((upgrade->slot ? 0x81000 : 0x1000) +
-				upgrade->rcvd_len, (void *) buf, len);
-			upgrade->rcvd_len += len;
+			os_strcpy(sched.etag, upgrade->etag);
+			os_strcpy(sched.modified, upgrade->modified);
 		}
-
-		if (upgrade->rcvd_len == upgrade->content_len) {
+#ifndef CFG_OTA_ALLOW_NO_MD5
+		/* otaflash_finish() would only refuse to boot it */
+		if (upgrade->do_update && !upgrade->got_md5) {
+			os_printf("No MD5 for image; not upgrading.\n");
 			upgrade->do_update = false;
-			system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
-			ota_finish(upgrade);
 		}
+#endif
+		/* Without a checksum we can't tell a bad patch from a good one */
+		if (!upgrade->got_md5) {
+			upgrade->want_delta = false;
+		}
+		return true;
 	}
+
+	if (upgrade->resume_from != 0 && upgrade->http.status == 206) {
+		/* otaflash_resume() already has the writer ready */
+		if (upgrade->range_start != upgrade->resume_from ||
+				upgrade->compressed) {
+			os_printf("Server sent the wrong range.\n");
+			return false;
+		}
+		upgrade->receiving = true;
+		return true;
+	}
+	/* A 200 means the server ignored our Range; start from scratch */
+	upgrade->resume_from = 0;
+
+	if (len == HTTP_LEN_UNKNOWN && !upgrade->http.chunked) {
+		/* We'd have no way to tell a short image from a whole one */
+		os_printf("Image has no length.\n");
+		return false;
+	}
+	if (len != HTTP_LEN_UNKNOWN && len > max) {
+		os_printf("Image too large.\n");
+		return false;
+	}
+
+	if (upgrade->compressed) {
+		hsdecode_init(&upgrade->hs, ota_unpacked, upgrade);
+	}
+
+	if (upgrade->delta) {
+		/* Patching the slot we're running from to make the other */
+		os_printf("Reading %sdelta.\n",
+			upgrade->compressed ? "compressed " : "");
+		delta_init(&upgrade->patch, upgrade->slot ? 0x1000 : 0x81000,
+			OTA_MAX_IMAGE, ota_write, upgrade);
+		len = OTA_MAX_IMAGE;
+	} else if (upgrade->compressed) {
+		/* No telling how big it'll be until we've unpacked it */
+		os_printf("Reading compressed image.\n");
+		len = max;
+	} else if (len == HTTP_LEN_UNKNOWN) {
+		os_printf("Reading chunked image.\n");
+		len = max;
+	} else {
+		os_printf("Reading %u bytes of image.\n", len);
+	}
+	if (upgrade->assets) {
+		/* Don't draw from them while they're being overwritten */
+		anim_stop();
+		asset_drop();
+	}
+	otaflash_start(ota_base(upgrade), len, ota_md5(upgrade));
+	upgrade->receiving = true;
+
+	return true;
 }
 
-static void ICACHE_FLASH_ATTR ota_sent(void *arg)
+/* 32 hex digits into 16 bytes */
+static bool ICACHE_FLASH_ATTR ota_parse_md5(const char *hex, uint8_t *md5)
 {
-	/* Callback when all data sent by us down TCP connection */
+	int i, nibble;
+	char c;
+
+	for (i = 0; i < OTAFLASH_MD5_LEN * 2; i++) {
+		c = hex[i];
+		if (c >= '0' && c <= '9')
+			nibble = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			nibble = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			nibble = c - 'A' + 10;
+		else
+			return false;
+
+		if (i & 1)
+			md5[i / 2] |= nibble;
+		else
+			md5[i / 2] = nibble << 4;
+	}
+
+	return hex[i] == '\0';
 }
 
-static void ICACHE_FLASH_ATTR ota_connect(void *arg)
+/*
+ * The server can change our settings with "ESP8266-Config: key=value" on
+ * the version check, or clear one with "key=". Most are only read at boot,
+ * so take effect from the next one.
+ */
+static void ICACHE_FLASH_ATTR ota_config(const char *name, const char *value)
+{
+	char key[CONFIG_KEY_LEN + 1];
+	const char *eq = os_strchr(value, '=');
+	bool ok;
+
+	if (eq == NULL || eq == value || eq - value > CONFIG_KEY_LEN) {
+		os_printf("Bad config setting from server.\n");
+		return;
+	}
+	os_memcpy(key, value, eq - value);
+	key[eq - value] = '\0';
+
+	/* A line this long may have been cut short */
+	if (os_strlen(name) + 2 + os_strlen(value) >= HTTP_LINE_LEN - 1) {
+		os_printf("Config %s from server is too long.\n", key);
+		return;
+	}
+
+	ok = eq[1] ? config_set(key, eq + 1) : config_unset(key);
+	os_printf(ok ? "Config %s updated.\n" : "Couldn't update config %s.\n",
+		key);
+}
+
+static bool ICACHE_FLASH_ATTR ota_header(void *arg, const char *name,
+		const char *value)
 {
 	struct ota_status *upgrade = arg;
+	char md5hdr[32];
+	char *end;
+	uint32_t ver;
+
+	if (name == NULL) {
+		return ota_headers_done(upgrade);
+	}
+
+	if (!upgrade->image &&
+			http_name_is(name, "esp8266-upgrade-version")) {
+		upgrade->maj = strtol(value, &end, 10);
+		if (*end == '.') {
+			upgrade->min = strtol(end + 1, NULL, 10);
+		} else {
+			os_printf("Parsed major version %d, "
+					"but unexpected %c\n",
+					upgrade->maj, *end);
+		}
+		upgrade->got_version = true;
+	}
+
+	if (!upgrade->image && upgrade->http.status == 200 &&
+			http_name_is(name, "esp8266-config")) {
+		ota_config(name, value);
+	}
+
+	if (!upgrade->image &&
+			http_name_is(name, "esp8266-upgrade-assets-version")) {
+		ver = strtol(value, NULL, 10);
+		upgrade->assets_ver = ver > 0xFFFF ? 0 : ver;
+	}
+	if (!upgrade->image &&
+			http_name_is(name, "esp8266-upgrade-assets-md5")) {
+		upgrade->got_assets_md5 = ota_parse_md5(value,
+			upgrade->assets_md5);
+		if (!upgrade->got_assets_md5) {
+			os_printf("Couldn't parse assets MD5.\n");
+		}
+	}
+
+	/* Too long and we just don't make the next check conditional */
+	if (!upgrade->image && http_name_is(name, "etag") &&
+			os_strlen(value) < OTA_ETAG_LEN) {
+		os_strcpy(upgrade->etag, value);
+	}
+	if (!upgrade->image && http_name_is(name, "last-modified") &&
+			os_strlen(value) < OTA_DATE_LEN) {
+		os_strcpy(upgrade->modified, value);
+	}
+
+	/* The server only compresses the image if we said we could cope */
+	if (upgrade->image && http_name_is(name, "content-encoding")) {
+		if (!http_name_is(value, "heatshrink")) {
+			os_printf("Can't decode %s image.\n", value);
+			return false;
+		}
+		upgrade->compressed = true;
+	}
+
+	if (upgrade->image && http_name_is(name, "content-range") &&
+			os_strncmp(value, "bytes ", 6) == 0) {
+		upgrade->range_start = strtol(value + 6, NULL, 10);
+	}
+
+	/* Each slot gets its own image, so each has its own checksum */
+	os_sprintf(md5hdr, "esp8266-upgrade-rom%d-md5", upgrade->slot);
+	if (!upgrade->image && http_name_is(name, md5hdr)) {
+		upgrade->got_md5 = ota_parse_md5(value, upgrade->md5);
+		if (!upgrade->got_md5) {
+			os_printf("Couldn't parse image MD5.\n");
+		}
+	}
+
+	return true;
+}
+
+static bool ICACHE_FLASH_ATTR ota_body(void *arg, const uint8_t *data,
+		uint32_t len)
+{
+	struct ota_status *upgrade = arg;
+
+	/* The body of the version check doesn't matter */
+	if (!upgrade->receiving) {
+		return true;
+	}
+
+	if (upgrade->compressed) {
+		return hsdecode_feed(&upgrade->hs, data, len);
+	}
+
+	return ota_unpacked(upgrade, data, len);
+}
+
+/*
+ * Ask for the version (just the headers; it's all we need), the assets or
+ * the image. The assets come first as they don't need a reboot. All go over
+ * the same connection if the server lets us keep it open.
+ */
+static void ICACHE_FLASH_ATTR ota_request(struct ota_status *upgrade)
+{
 	int len;
-	char buf[256];
+	/*
+	 * The longest HEAD, with a 63 byte host and path and full validators,
+	 * needs about 510; checked below, in case PROJECT or the stats grow.
+	 */
+	char buf[320 + CLOCK_STATS_LEN];
+	char stats[CLOCK_STATS_LEN];
+	char extra[32];
+	char file[16];
 
-	espconn_regist_recvcb(&upgrade->conn, ota_receive);
-	espconn_regist_sentcb(&upgrade->conn, ota_sent);
+	upgrade->assets = upgrade->do_assets;
+	upgrade->image = upgrade->do_update || upgrade->do_assets;
+	upgrade->compressed = false;
+	http_init(&upgrade->http, !upgrade->image, ota_header, ota_body,
+		upgrade);
+
+	/* If we got part of this image before, just ask for the rest */
+	upgrade->resume_from = 0;
+	if (upgrade->image && ota_md5(upgrade) != NULL) {
+		upgrade->resume_from = otaflash_resume(ota_base(upgrade),
+			ota_md5(upgrade));
+		if (upgrade->resume_from != 0 && !upgrade->assets) {
+			upgrade->want_delta = false;
+		}
+	}
+	upgrade->delta = upgrade->image && !upgrade->assets &&
+		upgrade->want_delta;
 
-	if (upgrade->do_update) {
-		os_printf("Sending rom image request header.\n");
-		len = os_sprintf(buf, "GET %srom%d.bin HTTP/1.0\r\n"
+	if (upgrade->delta) {
+		os_printf("Sending delta request header.\n");
+		len = os_snprintf(buf, sizeof(buf),
+			"GET %srom%d-from-%d.%d.delta HTTP/1.1\r\n"
 			"Host: %s:%d\r\n"
-			"Connection: close\r\n"
+			"Accept-Encoding: heatshrink\r\n"
 			"User-Agent: ESP8266 " PROJECT "\r\n"
 			"\r\n",
-			UPGRADE_PATH,
+			upgrade->path,
 			upgrade->slot,
-			UPGRADE_HOST,
+			VER_MAJ, VER_MIN,
+			upgrade->host,
 			80);
+	} else if (upgrade->image) {
+		if (upgrade->assets) {
+			os_printf("Sending assets request header.\n");
+			os_strcpy(file, "assets.bin");
+		} else {
+			os_printf("Sending rom image request header.\n");
+			os_sprintf(file, "rom%d.bin", upgrade->slot);
+		}
+		/* Resumes have to be of the plain image */
+		if (upgrade->resume_from != 0) {
+			os_sprintf(extra, "Range: bytes=%u-\r\n",
+				upgrade->resume_from);
+		} else {
+			os_strcpy(extra, "Accept-Encoding: heatshrink\r\n");
+		}
+		len = os_snprintf(buf, sizeof(buf), "GET %s%s HTTP/1.1\r\n"
+			"Host: %s:%d\r\n"
+			"%s"
+			"User-Agent: ESP8266 " PROJECT "\r\n"
+			"\r\n",
+			upgrade->path,
+			file,
+			upgrade->host,
+			80,
+			extra);
 	} else {
 		os_printf("Sending version check request header.\n");
-		len = os_sprintf(buf, "GET %s%s HTTP/1.1\r\n"
+		/* Lets the server keep an eye on how well we're keeping time */
+		clock_format_stats(stats);
+		/* Nothing new means a bare 304 */
+		len = os_snprintf(buf, sizeof(buf), "HEAD %s%s HTTP/1.1\r\n"
 			"Host: %s:%d\r\n"
-			"Connection: close\r\n"
+			"%s%s%s"
+			"%s%s%s"
+			"ESP8266-Sync-Stats: %s\r\n"
 			"User-Agent: ESP8266 " PROJECT "\r\n"
 			"\r\n",
-			UPGRADE_PATH,
+			upgrade->path,
 			"version.txt",
-			UPGRADE_HOST,
-			80);
+			upgrade->host,
+			80,
+			sched.etag[0] ? "If-None-Match: " : "", sched.etag,
+			sched.etag[0] ? "\r\n" : "",
+			sched.modified[0] ? "If-Modified-Since: " : "",
+			sched.modified, sched.modified[0] ? "\r\n" : "",
+			stats);
+	}
+
+	/* Cut short, the server would take it as something else entirely */
+	if (len < 0 || len >= sizeof(buf)) {
+		os_printf("Upgrade request too long.\n");
+		ota_fail(upgrade);
+		return;
 	}
 
 	espconn_send(&upgrade->conn, (uint8_t *) buf, len);
 }
 
+static void ICACHE_FLASH_ATTR ota_verified(bool ok)
+{
+	upgrade.verifying = false;
+
+	if (upgrade.assets) {
+		/* No need to reboot; just start drawing with them */
+		if (!ok) {
+			os_printf("Assets didn't verify.\n");
+		}
+		asset_init();
+		if (upgrade.do_update) {
+			/* On to the image, over the same connection if it's open */
+			if (!upgrade.connected) {
+				upgrade.conn.state = ESPCONN_NONE;
+				espconn_connect(&upgrade.conn);
+			} else if (upgrade.http.keep_alive) {
+				ota_request(&upgrade);
+			}
+			/* Otherwise we'll go again on disconnect */
+			return;
+		}
+		upgrade.busy = false;
+		system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+		return;
+	}
+
+	if (!ok && upgrade.delta) {
+		/* Patched the wrong thing somehow; start again from scratch */
+		os_printf("Delta didn't produce the right image; "
+			"trying full image.\n");
+		upgrade.want_delta = false;
+		upgrade.do_update = true;
+		/* If we're still connected, we'll go again on disconnect */
+		if (!upgrade.connected) {
+			upgrade.conn.state = ESPCONN_NONE;
+			espconn_connect(&upgrade.conn);
+		}
+		return;
+	}
+
+	upgrade.busy = false;
+
+	if (ok) {
+		os_printf("Rebooting into new ROM.\n");
+		system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+		system_upgrade_reboot();
+	} else {
+		system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+	}
+}
+
+/* Returns false if the upgrade has moved on and the queue's been dropped */
+static bool ICACHE_FLASH_ATTR ota_parse(struct ota_status *upgrade,
+		const char *buf, uint16_t len)
+{
+	int ret;
+
+	ret = http_parse(&upgrade->http, buf, len);
+	if (ret == HTTP_ERROR) {
+		ota_fail(upgrade);
+		return false;
+	} else if (ret == HTTP_MORE) {
+		return true;
+	}
+
+	/* Anything after the response isn't something we asked for */
+	pump.pos = pump.len;
+
+	if (!upgrade->image) {
+		if (!upgrade->do_update && !upgrade->do_assets) {
+			ota_finish(upgrade);
+			return false;
+		} else if (upgrade->http.keep_alive) {
+			ota_request(upgrade);
+		}
+		/* Otherwise we reconnect once the server hangs up */
+		return true;
+	}
+
+	if (!upgrade->receiving) {
+		/* There was no delta for us; ask for the image instead */
+		if (upgrade->http.keep_alive) {
+			ota_request(upgrade);
+		}
+		return true;
+	}
+
+	if (upgrade->compressed && !hsdecode_finish(&upgrade->hs)) {
+		ota_fail(upgrade);
+		return false;
+	}
+	/* The delta may still be copying the last of it */
+	pump.complete = true;
+	return true;
+}
+
+/* All the image is in, and through the delta if there was one */
+static void ICACHE_FLASH_ATTR ota_complete(struct ota_status *upgrade)
+{
+	pump.complete = false;
+	if (upgrade->delta && !delta_finish(&upgrade->patch)) {
+		ota_fail(upgrade);
+		return;
+	}
+
+	if (upgrade->assets) {
+		upgrade->do_assets = false;
+	} else {
+		upgrade->do_update = false;
+	}
+	upgrade->receiving = false;
+	upgrade->verifying = true;
+	if (upgrade->assets && upgrade->do_update &&
+			upgrade->http.keep_alive && upgrade->connected) {
+		/* The image is next; keep the connection for it */
+		if (pump.held) {
+			espconn_recv_unhold(&upgrade->conn);
+		}
+		ota_pump_stop();
+	} else {
+		/* We don't need the server while we check what we got */
+		ota_hangup(upgrade);
+	}
+	otaflash_finish(ota_verified);
+}
+
+static bool ICACHE_FLASH_ATTR ota_copying(struct ota_status *upgrade)
+{
+	return upgrade->receiving && upgrade->delta &&
+		delta_busy(&upgrade->patch);
+}
+
+/* Is a sector on its way to flash? Nothing more can go in until it's out */
+static bool ICACHE_FLASH_ATTR ota_flashing(struct ota_status *upgrade)
+{
+	return upgrade->receiving && otaflash_busy();
+}
+
+/* Is there anything left to do with what we've been sent? */
+static bool ICACHE_FLASH_ATTR ota_pump_busy(struct ota_status *upgrade)
+{
+	return pump.pos < pump.len || pump.complete || pump.overrun ||
+		ota_copying(upgrade) || ota_flashing(upgrade);
+}
+
+/*
+ * Deal with what's queued, until it's all done or OTA_PUMP_US runs out,
+ * stopping to let otaflash write out each sector. Returns false if the
+ * upgrade has moved on and the queue's been dropped.
+ */
+static bool ICACHE_FLASH_ATTR ota_pump_run(struct ota_status *upgrade)
+{
+	uint32_t start = system_get_time();
+	uint16_t len;
+
+	while (system_get_time() - start < OTA_PUMP_US) {
+		if (ota_flashing(upgrade)) {
+			break;
+		} else if (ota_copying(upgrade)) {
+			if (!delta_step(&upgrade->patch)) {
+				ota_fail(upgrade);
+				return false;
+			}
+		} else if (pump.pos < pump.len) {
+			len = pump.len - pump.pos;
+			if (len > OTA_STEP) {
+				len = OTA_STEP;
+			}
+			pump.pos += len;
+			if (!ota_parse(upgrade, pump.buf + pump.pos - len,
+					len)) {
+				return false;
+			}
+		} else if (pump.complete) {
+			ota_complete(upgrade);
+			return false;
+		} else {
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void ICACHE_FLASH_ATTR ota_pump_func(void *arg)
+{
+	struct ota_status *upgrade = arg;
+
+	if (pump.overrun) {
+		/* Reconnecting picks up from what's reached flash */
+		ota_hangup(upgrade);
+		return;
+	}
+	if (!ota_pump_run(upgrade)) {
+		return;
+	}
+	if (ota_pump_busy(upgrade)) {
+		/* Give everything else a go; back in a moment */
+		os_timer_arm(&pump.timer, 0, 0);
+		return;
+	}
+
+	/* Caught up, so the server can send some more */
+	pump.len = pump.pos = 0;
+	if (pump.closed) {
+		pump.closed = false;
+		ota_closed(upgrade);
+	} else if (pump.held) {
+		pump.held = false;
+		espconn_recv_unhold(&upgrade->conn);
+	}
+}
+
+static void ICACHE_FLASH_ATTR ota_receive(void *arg, char *buf,
+		unsigned short len)
+{
+	struct ota_status *upgrade = arg;
+
+	if (pump.overrun) {
+		return;
+	}
+	if (len > sizeof(pump.buf) - pump.len) {
+		os_memmove(pump.buf, pump.buf + pump.pos,
+			pump.len - pump.pos);
+		pump.len -= pump.pos;
+		pump.pos = 0;
+	}
+	if (len > sizeof(pump.buf) - pump.len) {
+		/*
+		 * The hold should stop this, but we can't catch up in here
+		 * without blocking on flash; the pump hangs up instead.
+		 */
+		os_printf("Upgrade data overran; reconnecting.\n");
+		pump.overrun = true;
+		os_timer_arm(&pump.timer, 0, 0);
+		return;
+	}
+
+	os_memcpy(pump.buf + pump.len, buf, len);
+	pump.len += len;
+
+	if (!pump.held) {
+		pump.held = true;
+		espconn_recv_hold(&upgrade->conn);
+	}
+	os_timer_arm(&pump.timer, 0, 0);
+}
+
+static void ICACHE_FLASH_ATTR ota_sent(void *arg)
+{
+	/* Callback when all data sent by us down TCP connection */
+}
+
+static void ICACHE_FLASH_ATTR ota_connect(void *arg)
+{
+	struct ota_status *upgrade = arg;
+
+	upgrade->connected = true;
+	espconn_regist_recvcb(&upgrade->conn, ota_receive);
+	espconn_regist_sentcb(&upgrade->conn, ota_sent);
+
+	ota_request(upgrade);
+}
+
 static void ICACHE_FLASH_ATTR ota_disconnect(void *arg)
 {
 	struct ota_status *upgrade = arg;
@@ -196,17 +914,51 @@ static void ICACHE_FLASH_ATTR ota_disconnect(void *arg)
 	}
 
 	espconn_delete(&upgrade->conn);
+	upgrade->connected = false;
+	pump.held = false;
 
-	if (!upgrade->do_update) {
-		if (upgrade->conn.proto.tcp != NULL) {
-			os_free(upgrade->conn.proto.tcp);
+	/* What we already have still counts; the pump gets back to us */
+	if (ota_pump_busy(upgrade)) {
+		pump.closed = true;
+		return;
+	}
+
+	ota_closed(upgrade);
+}
+
+/* The connection has gone; try again if there's more to fetch */
+static void ICACHE_FLASH_ATTR ota_closed(struct ota_status *upgrade)
+{
+	if (upgrade->verifying) {
+		/* ota_verified() will finish things off */
+		return;
+	}
+
+	if (upgrade->receiving) {
+		/* Dropped part way through; keep what we have for the retry */
+		otaflash_suspend();
+		upgrade->receiving = false;
+	}
+
+	if ((upgrade->do_update || upgrade->do_assets) &&
+			upgrade->retries++ >= OTA_MAX_RETRIES) {
+		/* Progress is kept, so the next check can pick up from here */
+		os_printf("Giving up on upgrade for now.\n");
+		upgrade->do_update = false;
+		upgrade->do_assets = false;
+	}
+
+	if (!upgrade->do_update && !upgrade->do_assets) {
+		if (!upgrade->checked) {
+			/* Don't wait a whole interval to find out */
+			ota_retry();
 		}
-		os_free(upgrade);
+		upgrade->busy = false;
 		system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
 		return;
 	}
 
-	/* Reuse conn for the rom download */
+	/* Server closed before we got the image; try again */
 	upgrade->conn.state = ESPCONN_NONE;
 
 	espconn_connect(&upgrade->conn);
@@ -225,14 +977,15 @@ static void ICACHE_FLASH_ATTR ota_got_dns(const char *name, ip_addr_t *ip,
 
 	if (ip == NULL) {
 		os_printf("Upgrade DNS request failed.\n");
-		os_free(upgrade);
+		ota_retry();
+		upgrade->busy = false;
 		system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
 		return;
 	}
 
 	upgrade->conn.type = ESPCONN_TCP;
 	upgrade->conn.state = ESPCONN_NONE;
-	upgrade->conn.proto.tcp = (esp_tcp *)os_malloc(sizeof(esp_tcp));
+	upgrade->conn.proto.tcp = &upgrade_tcp;
 	upgrade->conn.proto.tcp->local_port = espconn_port();
 	upgrade->conn.proto.tcp->remote_port = 80; /* FIXME; HTTPS */
 
@@ -247,27 +1000,109 @@ static void ICACHE_FLASH_ATTR ota_got_dns(const char *name, ip_addr_t *ip,
 
 bool ICACHE_FLASH_ATTR ota_check()
 {
-	struct ota_status *upgrade = NULL;
-
 	/* Don't start an upgrade if one is in progress */
-	if (system_upgrade_flag_check() == UPGRADE_FLAG_START) {
+	if (upgrade.busy ||
+			system_upgrade_flag_check() == UPGRADE_FLAG_START) {
 		return false;
 	}
 
-	upgrade = (struct ota_status *) os_zalloc(sizeof(struct ota_status));
-	if (!upgrade) {
-		os_printf("Couldn't allocate memory for upgrade structure.\n");
-		return false;
-	}
+	ota_pump_stop();
+	os_timer_setfn(&pump.timer, ota_pump_func, &upgrade);
+	os_memset(&upgrade, 0, sizeof(upgrade));
+	os_memset(&upgrade_tcp, 0, sizeof(upgrade_tcp));
+	upgrade.busy = true;
 
 	system_upgrade_flag_set(UPGRADE_FLAG_START);
 
-	upgrade->slot = system_upgrade_userbin_check() ? 0 : 1;
+	upgrade.slot = system_upgrade_userbin_check() ? 0 : 1;
+	upgrade.want_delta = true;
+
+	config_get_default("ota.host", upgrade.host, sizeof(upgrade.host),
+		UPGRADE_HOST);
+	config_get_default("ota.path", upgrade.path, sizeof(upgrade.path),
+		UPGRADE_PATH);
 
 	/* Kick off the DNS lookup to start */
-	espconn_gethostbyname(&upgrade->conn, UPGRADE_HOST,
-		&upgrade->server_ip,
-		ota_got_dns);
+	resolv_lookup(upgrade.host, ota_got_dns, &upgrade);
 
 	return true;
 }
+
+static bool ICACHE_FLASH_ATTR ota_in_window(void)
+{
+	struct tm now;
+
+	if (CFG_OTA_WINDOW_START == CFG_OTA_WINDOW_END) {
+		return true;
+	}
+	/* No idea what the local time is yet */
+	if (!clock_is_set()) {
+		return false;
+	}
+
+	breakdown_time(get_time(), &now);
+	if (CFG_OTA_WINDOW_START < CFG_OTA_WINDOW_END) {
+		return now.tm_hour >= CFG_OTA_WINDOW_START &&
+			now.tm_hour < CFG_OTA_WINDOW_END;
+	}
+	return now.tm_hour >= CFG_OTA_WINDOW_START ||
+		now.tm_hour < CFG_OTA_WINDOW_END;
+}
+
+/* Spread out so a whole site of clocks doesn't check at the same moment */
+static void ICACHE_FLASH_ATTR ota_check_in(uint32_t secs)
+{
+	sched.next = get_uptime() + secs + os_random() % (CFG_OTA_SPREAD + 1);
+}
+
+/* The check didn't get an answer; try again soon, but not all at once */
+static void ICACHE_FLASH_ATTR ota_retry(void)
+{
+	sched.next = get_uptime() + CFG_OTA_RETRY +
+		os_random() % (CFG_OTA_RETRY + 1);
+}
+
+static void ICACHE_FLASH_ATTR ota_schedule_func(void *arg)
+{
+	if ((int32_t) (get_uptime() - sched.next) < 0) {
+		return;
+	}
+
+	if (!ota_in_window()) {
+		sched.waiting = true;
+		return;
+	}
+	if (sched.waiting) {
+		/* The window has just opened; don't all pile in at once */
+		sched.waiting = false;
+		ota_check_in(0);
+		return;
+	}
+
+	/* First, as a check that fails straight away will want it sooner */
+	ota_check_in(CFG_OTA_INTERVAL);
+	if (!ota_check()) {
+		/* One's already under way; look again once it's done */
+		ota_retry();
+	}
+}
+
+/*
+ * Start checking for upgrades; called whenever we get an IP. The first check
+ * is made within CFG_OTA_SPREAD seconds, then every CFG_OTA_INTERVAL.
+ */
+void ICACHE_FLASH_ATTR ota_schedule(void)
+{
+	sched.waiting = false;
+	ota_check_in(0);
+
+	os_timer_disarm(&sched.timer);
+	os_timer_setfn(&sched.timer, ota_schedule_func, NULL);
+	os_timer_arm(&sched.timer, 60 * 1000 /* 1 minute */, 1);
+}
+
+/* No network, so no point checking until ota_schedule() is called again */
+void ICACHE_FLASH_ATTR ota_unschedule(void)
+{
+	os_timer_disarm(&sched.timer);
+}
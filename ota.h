@@ -4,5 +4,7 @@
 #include <c_types.h>
 
 bool ICACHE_FLASH_ATTR ota_check(void);
+void ICACHE_FLASH_ATTR ota_schedule(void);
+void ICACHE_FLASH_ATTR ota_unschedule(void);
 
 #endif /* USER_OTA_H_ */
@@ -0,0 +1,499 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Streams an upgrade image into flash as it arrives. Erasing a sector
+ * takes tens of milliseconds, so rather than clear the whole slot up front
+ * we only erase a sector when it's about to be written, and only then if
+ * we have to: the slot often still holds an older image that's mostly the
+ * same, so we compare first and leave sectors alone if they already match,
+ * and don't erase if the new data can be written straight over the old
+ * (which covers sectors that are already blank). Each sector goes out from
+ * a timer, a step per tick: compare, erase if need be, then write. The
+ * caller holds the TCP connection and waits while otaflash_busy(), which
+ * stops the server sending faster than we can write.
+ *
+ * spi_flash_write() wants a 4 byte aligned buffer and length, which TCP
+ * payloads rarely are, so everything goes through a sector sized staging
+ * buffer and each sector goes out in one write. Anything that arrives
+ * while that's happening waits in a smaller spill buffer.
+ *
+ * The image is hashed as it goes by, so by the time the last of it has
+ * arrived we know whether it's what the server said it would be. Before
+ * we let anyone boot it we also read it all back out of flash, a sector
+ * per timer tick, and check that hashes to the same thing.
+ *
+ * Each time a sector goes out we note how far we've got, and the hash so
+ * far, in RTC memory. If the connection drops (or we reset) we can then
+ * carry on from there, as long as the image we're after is the same one.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+#include <spi_flash.h>
+
+#include "md5.h"
+#include "otaflash.h"
+#include "rtcmem.h"
+#include "project_config.h"
+
+/*
+ * Room for what the caller hands us while a sector is going out. It waits
+ * for us between steps, so this only has to cover one of them.
+ */
+#define OTAFLASH_SPILL	1024
+
+/* What we keep in RTC memory so a download can be resumed */
+struct otaflash_resume {
+	uint32_t base;
+	uint32_t size;
+	uint32_t offset;
+	uint8_t expect[OTAFLASH_MD5_LEN];
+	struct MD5Context md5;	/* Of everything up to offset */
+};
+
+static struct {
+	uint32_t base;		/* Flash address of the slot */
+	uint32_t size;		/* How much we're allowed to write */
+	uint32_t offset;	/* Bytes written out to flash so far */
+	uint32_t staged;	/* Bytes waiting in stage[] */
+	uint32_t flushing;	/* ...of which are on their way to flash */
+	uint32_t spilled;	/* Bytes waiting in spill[] behind them */
+	uint32_t len;		/* Image bytes we've been given */
+	uint32_t resumed;	/* Where this session started from */
+	uint32_t verified;	/* How far the read back has got */
+	uint32_t start_us;
+	uint16_t same;		/* Sectors that already matched */
+	uint16_t written;	/* ...that could be written without an erase */
+	uint16_t erased;	/* ...and that had to be erased first */
+	struct MD5Context md5;	/* Hashed as it goes out to flash */
+	uint8_t digest[OTAFLASH_MD5_LEN];
+	uint8_t expect[OTAFLASH_MD5_LEN];
+	bool have_expect;
+	otaflash_done_cb done;
+	uint8_t step;		/* What the flush does next */
+	bool active;
+	bool finishing;		/* Check the image once it's all out */
+	bool failed;
+} wr;
+
+static os_timer_t flash_timer;
+/* uint32_t so it's aligned the way spi_flash_write() needs */
+static uint32_t stage[SPI_FLASH_SEC_SIZE / 4];
+static uint8_t spill[OTAFLASH_SPILL];
+
+enum {
+	OTAFLASH_SAME,		/* Flash already holds this */
+	OTAFLASH_WRITABLE,	/* Only needs bits cleared; no erase */
+	OTAFLASH_DIRTY,		/* Needs erasing first */
+};
+
+/* Steps of a flush, one per tick */
+enum {
+	OTAFLASH_IDLE,
+	OTAFLASH_COMPARE,
+	OTAFLASH_ERASE,
+	OTAFLASH_WRITE,
+};
+
+static void ICACHE_FLASH_ATTR otaflash_check(void);
+
+/* How the len bytes in stage[] compare to what's in flash where they go */
+static int ICACHE_FLASH_ATTR otaflash_compare(uint32_t len)
+{
+	uint32_t buf[16];
+	uint32_t i, j, words;
+	bool same = true;
+
+	for (i = 0; i < len / 4; i += words) {
+		words = len / 4 - i;
+		if (words > 16) {
+			words = 16;
+		}
+		if (spi_flash_read(wr.base + wr.offset + i * 4, buf,
+				words * 4) != SPI_FLASH_RESULT_OK) {
+			return OTAFLASH_DIRTY;
+		}
+		for (j = 0; j < words; j++) {
+			if (buf[j] == stage[i + j]) {
+				continue;
+			}
+			same = false;
+			/* Writing can only turn 1s into 0s */
+			if ((buf[j] & stage[i + j]) != stage[i + j]) {
+				return OTAFLASH_DIRTY;
+			}
+		}
+	}
+
+	return same ? OTAFLASH_SAME : OTAFLASH_WRITABLE;
+}
+
+static void ICACHE_FLASH_ATTR otaflash_save(void)
+{
+	struct otaflash_resume res;
+
+	os_memset(&res, 0, sizeof(res));
+	/* No way to know it's the same image next time; don't resume */
+	if (wr.have_expect && wr.active) {
+		res.base = wr.base;
+		res.size = wr.size;
+		res.offset = wr.offset;
+		os_memcpy(res.expect, wr.expect, OTAFLASH_MD5_LEN);
+		res.md5 = wr.md5;
+	}
+
+	rtcmem_save(RTCMEM_OTA, &res, sizeof(res));
+}
+
+static void ICACHE_FLASH_ATTR otaflash_begin(void)
+{
+	wr.active = true;
+	wr.staged = 0;
+	wr.len = wr.offset;
+	wr.resumed = wr.offset;
+	wr.start_us = system_get_time();
+}
+
+/*
+ * Get ready to write up to size bytes at base, which must be sector
+ * aligned. md5 is what the image should hash to, if we know; it's also
+ * how we tell whether a half finished download is worth resuming.
+ */
+void ICACHE_FLASH_ATTR otaflash_start(uint32_t base, uint32_t size,
+	const uint8_t *md5)
+{
+	os_timer_disarm(&flash_timer);
+	os_memset(&wr, 0, sizeof(wr));
+	wr.base = base;
+	wr.size = size;
+	if (md5 != NULL) {
+		os_memcpy(wr.expect, md5, OTAFLASH_MD5_LEN);
+		wr.have_expect = true;
+	}
+	MD5Init(&wr.md5);
+
+	otaflash_begin();
+	otaflash_save();
+}
+
+/*
+ * If we were part way through writing the image that hashes to md5 into
+ * base, get ready to carry on. Returns how much we already have, which is
+ * where the download should pick up; 0 if we need to start again.
+ */
+uint32_t ICACHE_FLASH_ATTR otaflash_resume(uint32_t base,
+	const uint8_t *md5)
+{
+	struct otaflash_resume res;
+
+	if (!rtcmem_load(RTCMEM_OTA, &res, sizeof(res)) ||
+			res.offset == 0 || res.base != base ||
+			os_memcmp(res.expect, md5, OTAFLASH_MD5_LEN) != 0) {
+		return 0;
+	}
+
+	os_timer_disarm(&flash_timer);
+	os_memset(&wr, 0, sizeof(wr));
+	wr.base = res.base;
+	wr.size = res.size;
+	wr.offset = res.offset;
+	os_memcpy(wr.expect, res.expect, OTAFLASH_MD5_LEN);
+	wr.have_expect = true;
+	wr.md5 = res.md5;
+
+	otaflash_begin();
+	os_printf("Resuming image at %u bytes.\n", wr.offset);
+
+	return wr.offset;
+}
+
+/* The sector's out; note how far we've got and carry on from spill[] */
+static void ICACHE_FLASH_ATTR otaflash_flushed(void)
+{
+	/* Hash here, so the hash always matches what's reached flash */
+	MD5Update(&wr.md5, stage, wr.flushing);
+	wr.offset += (wr.flushing + 3) & ~3;
+	wr.flushing = 0;
+	wr.step = OTAFLASH_IDLE;
+
+	otaflash_save();
+
+	os_memcpy(stage, spill, wr.spilled);
+	wr.staged = wr.spilled;
+	wr.spilled = 0;
+}
+
+/* Do the next step of writing out stage[]; false once there's no more */
+static bool ICACHE_FLASH_ATTR otaflash_flush_step(void)
+{
+	/* len gets rounded up to a whole word */
+	uint32_t len = (wr.flushing + 3) & ~3;
+
+	switch (wr.step) {
+	case OTAFLASH_COMPARE:
+		switch (otaflash_compare(len)) {
+		case OTAFLASH_SAME:
+			wr.same++;
+			otaflash_flushed();
+			return false;
+		case OTAFLASH_DIRTY:
+			wr.step = OTAFLASH_ERASE;
+			break;
+		case OTAFLASH_WRITABLE:
+			wr.step = OTAFLASH_WRITE;
+			break;
+		}
+		return true;
+	case OTAFLASH_ERASE:
+		spi_flash_erase_sector((wr.base + wr.offset) /
+			SPI_FLASH_SEC_SIZE);
+		wr.erased++;
+		wr.step = OTAFLASH_WRITE;
+		return true;
+	case OTAFLASH_WRITE:
+		if (spi_flash_write(wr.base + wr.offset, stage, len) !=
+				SPI_FLASH_RESULT_OK) {
+			os_printf("Flash write failed at 0x%x.\n",
+				wr.base + wr.offset);
+			wr.failed = true;
+			wr.step = OTAFLASH_IDLE;
+			return false;
+		}
+		wr.written++;
+		otaflash_flushed();
+		return false;
+	}
+
+	return false;
+}
+
+static void ICACHE_FLASH_ATTR otaflash_flush_func(void *arg)
+{
+	if (otaflash_flush_step()) {
+		os_timer_arm(&flash_timer, 0, 0);
+	} else if (wr.finishing) {
+		otaflash_check();
+	}
+}
+
+/* Start writing out the first len bytes of stage[] */
+static void ICACHE_FLASH_ATTR otaflash_flush(uint32_t len)
+{
+	wr.flushing = len;
+	wr.step = OTAFLASH_COMPARE;
+	os_timer_setfn(&flash_timer, otaflash_flush_func, NULL);
+	os_timer_arm(&flash_timer, 0, 0);
+}
+
+/* Is a sector on its way out? Hold off sending more until it's done */
+bool ICACHE_FLASH_ATTR otaflash_busy(void)
+{
+	return wr.step != OTAFLASH_IDLE;
+}
+
+/* Finish writing out the sector now; for when we can't wait for it */
+static bool ICACHE_FLASH_ATTR otaflash_drain(void)
+{
+	os_timer_disarm(&flash_timer);
+	while (otaflash_flush_step())
+		;
+
+	return !wr.failed;
+}
+
+bool ICACHE_FLASH_ATTR otaflash_write(const uint8_t *data, uint32_t len)
+{
+	uint32_t chunk;
+
+	if (!wr.active || wr.failed) {
+		return false;
+	}
+	if (len > wr.size - wr.offset - wr.staged - wr.spilled) {
+		os_printf("Image doesn't fit in the slot.\n");
+		return false;
+	}
+
+	wr.len += len;
+
+	while (len > 0) {
+		if (otaflash_busy()) {
+			if (len <= sizeof(spill) - wr.spilled) {
+				os_memcpy(spill + wr.spilled, data, len);
+				wr.spilled += len;
+				return true;
+			}
+			/* The caller should have waited; better late than lost */
+			os_printf("Flash fell behind; catching up.\n");
+			if (!otaflash_drain()) {
+				return false;
+			}
+			continue;
+		}
+
+		chunk = SPI_FLASH_SEC_SIZE - wr.staged;
+		if (chunk > len) {
+			chunk = len;
+		}
+		os_memcpy((uint8_t *) stage + wr.staged, data, chunk);
+		wr.staged += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if (wr.staged == SPI_FLASH_SEC_SIZE) {
+			otaflash_flush(SPI_FLASH_SEC_SIZE);
+		}
+	}
+
+	return true;
+}
+
+static void ICACHE_FLASH_ATTR otaflash_stop(void)
+{
+	os_timer_disarm(&flash_timer);
+	/* A sector left half done gets written again if we resume */
+	wr.step = OTAFLASH_IDLE;
+	wr.finishing = false;
+	wr.active = false;
+}
+
+/* Read back the next sector of the image, and check it once we're done */
+static void ICACHE_FLASH_ATTR otaflash_verify_func(void *arg)
+{
+	uint8_t digest[OTAFLASH_MD5_LEN];
+	uint32_t len = wr.len - wr.verified;
+	bool ok;
+
+	if (len > SPI_FLASH_SEC_SIZE) {
+		len = SPI_FLASH_SEC_SIZE;
+	}
+
+	/* Reads need to be whole words too; the padding isn't hashed */
+	if (spi_flash_read(wr.base + wr.verified, stage, (len + 3) & ~3) !=
+			SPI_FLASH_RESULT_OK) {
+		os_printf("Flash read failed at 0x%x.\n",
+			wr.base + wr.verified);
+		wr.done(false);
+		return;
+	}
+	MD5Update(&wr.md5, stage, len);
+	wr.verified += len;
+
+	if (wr.verified < wr.len) {
+		os_timer_arm(&flash_timer, 0, 0);
+		return;
+	}
+
+	MD5Final(digest, &wr.md5);
+	ok = (os_memcmp(digest, wr.digest, OTAFLASH_MD5_LEN) == 0);
+	os_printf(ok ? "Image verified.\n" :
+		"Image didn't read back correctly.\n");
+	wr.done(ok);
+}
+
+/* Write out the last of it, then check what we've got */
+static void ICACHE_FLASH_ATTR otaflash_check(void)
+{
+	otaflash_done_cb done = wr.done;
+	uint32_t ms;
+
+	if (wr.failed) {
+		otaflash_abort();
+		done(false);
+		return;
+	}
+
+	/* Pad out the last partial word; erased flash reads as 0xFF anyway */
+	if (wr.staged > 0) {
+		os_memset((uint8_t *) stage + wr.staged, 0xFF,
+			SPI_FLASH_SEC_SIZE - wr.staged);
+		otaflash_flush(wr.staged);
+		return;
+	}
+
+	/* Whatever happens now, there's nothing left to resume */
+	otaflash_stop();
+	otaflash_save();
+
+	ms = (system_get_time() - wr.start_us) / 1000;
+	os_printf("Wrote %u bytes in %u ms (%u bytes/s).\n",
+		wr.len - wr.resumed, ms, ms ? (uint32_t) ((uint64_t)
+		(wr.len - wr.resumed) * 1000 / ms) : 0);
+	os_printf("Sectors: %u unchanged, %u written, %u of them erased.\n",
+		wr.same, wr.written, wr.erased);
+
+	MD5Final(wr.digest, &wr.md5);
+	if (!wr.have_expect) {
+#ifdef CFG_OTA_ALLOW_NO_MD5
+		os_printf("No MD5 for image; only checking the flash copy.\n");
+#else
+		/* A short or mangled image would look just as good */
+		os_printf("No MD5 for image; not booting it.\n");
+		done(false);
+		return;
+#endif
+	} else if (os_memcmp(wr.expect, wr.digest, OTAFLASH_MD5_LEN) != 0) {
+		os_printf("Image MD5 doesn't match.\n");
+		done(false);
+		return;
+	}
+
+	wr.verified = 0;
+	MD5Init(&wr.md5);
+	os_timer_setfn(&flash_timer, otaflash_verify_func, NULL);
+	os_timer_arm(&flash_timer, 0, 0);
+}
+
+/*
+ * All the image has arrived. Once it's all in flash, check it against the
+ * MD5 we were given and then read it back. Without an MD5 we can only check
+ * it got to flash intact, so the image is refused unless
+ * CFG_OTA_ALLOW_NO_MD5 says that's good enough. done gets told whether it's
+ * safe to boot.
+ */
+void ICACHE_FLASH_ATTR otaflash_finish(otaflash_done_cb done)
+{
+	if (!wr.active) {
+		done(false);
+		return;
+	}
+
+	wr.done = done;
+	wr.finishing = true;
+	/* Otherwise otaflash_flush_func() gets to it */
+	if (!otaflash_busy()) {
+		otaflash_check();
+	}
+}
+
+/* The connection has gone, but we can carry on with otaflash_resume() */
+void ICACHE_FLASH_ATTR otaflash_suspend(void)
+{
+	otaflash_stop();
+}
+
+/* Give up on the image altogether */
+void ICACHE_FLASH_ATTR otaflash_abort(void)
+{
+	otaflash_suspend();
+	otaflash_save();
+}
+
+/* Bytes accepted so far, whether or not they've reached flash yet */
+uint32_t ICACHE_FLASH_ATTR otaflash_written(void)
+{
+	return wr.len;
+}
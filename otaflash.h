@@ -0,0 +1,38 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _OTAFLASH_H_
+#define _OTAFLASH_H_
+
+#include <c_types.h>
+
+#define OTAFLASH_MD5_LEN	16
+
+/* Told whether the image made it into flash intact */
+typedef void (*otaflash_done_cb)(bool ok);
+
+void ICACHE_FLASH_ATTR otaflash_start(uint32_t base, uint32_t size,
+	const uint8_t *md5);
+uint32_t ICACHE_FLASH_ATTR otaflash_resume(uint32_t base,
+	const uint8_t *md5);
+bool ICACHE_FLASH_ATTR otaflash_write(const uint8_t *data, uint32_t len);
+bool ICACHE_FLASH_ATTR otaflash_busy(void);
+void ICACHE_FLASH_ATTR otaflash_finish(otaflash_done_cb done);
+void ICACHE_FLASH_ATTR otaflash_suspend(void);
+void ICACHE_FLASH_ATTR otaflash_abort(void);
+uint32_t ICACHE_FLASH_ATTR otaflash_written(void);
+
+#endif /* _OTAFLASH_H_ */
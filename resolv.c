@@ -0,0 +1,140 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A small cache in front of espconn_gethostbyname(). The SDK doesn't hand
+ * us the TTL of an answer, but lwIP's own table honours it: if lwIP still
+ * has a live answer espconn_gethostbyname() returns ESPCONN_OK straight
+ * away. On top of that we keep every answer for at least RESOLV_MIN_TTL
+ * so we don't hit the network on every hourly NTP sync, and remember the
+ * last good answer so a flaky DNS server doesn't stop us syncing.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <espconn.h>
+#include <osapi.h>
+
+#include "clock.h"
+#include "resolv.h"
+
+#define RESOLV_CACHE_SIZE	4
+#define RESOLV_NAME_LEN		64
+#define RESOLV_MIN_TTL		(6 * 3600)
+
+struct resolv_entry {
+	char name[RESOLV_NAME_LEN];
+	ip_addr_t ip;
+	uint32_t expires;
+	bool valid;
+	bool pending;
+	resolv_callback cb;
+	void *arg;
+	/* Only used to carry the lookup through espconn_gethostbyname */
+	struct espconn conn;
+};
+
+static struct resolv_entry cache[RESOLV_CACHE_SIZE];
+
+static struct resolv_entry ICACHE_FLASH_ATTR *resolv_find(const char *name)
+{
+	struct resolv_entry *entry, *victim = NULL;
+	int i;
+
+	for (i = 0; i < RESOLV_CACHE_SIZE; i++) {
+		entry = &cache[i];
+		if (entry->name[0] && os_strcmp(entry->name, name) == 0)
+			return entry;
+	}
+
+	/* Not cached; use an empty slot or evict the stalest answer */
+	for (i = 0; i < RESOLV_CACHE_SIZE; i++) {
+		entry = &cache[i];
+		if (entry->pending)
+			continue;
+		if (!entry->name[0])
+			return entry;
+		if (!victim || entry->expires < victim->expires)
+			victim = entry;
+	}
+
+	return victim;
+}
+
+static void ICACHE_FLASH_ATTR resolv_got_dns(const char *name, ip_addr_t *ip,
+	void *arg)
+{
+	struct espconn *conn = arg;
+	struct resolv_entry *entry = conn->reverse;
+
+	entry->pending = false;
+
+	if (ip != NULL) {
+		entry->ip = *ip;
+		entry->valid = true;
+		entry->expires = get_uptime() + RESOLV_MIN_TTL;
+	} else if (entry->valid) {
+		os_printf("DNS lookup for %s failed, using last known address.\n",
+			entry->name);
+	}
+
+	entry->cb(entry->name, entry->valid ? &entry->ip : NULL, entry->arg);
+}
+
+void ICACHE_FLASH_ATTR resolv_lookup(const char *name, resolv_callback cb,
+	void *arg)
+{
+	struct resolv_entry *entry;
+	ip_addr_t ip;
+	sint8 ret;
+
+	entry = resolv_find(name);
+	if (entry == NULL || os_strlen(name) >= RESOLV_NAME_LEN) {
+		/* Cache is tied up with outstanding lookups */
+		os_printf("No room to resolve %s.\n", name);
+		cb(name, NULL, arg);
+		return;
+	}
+
+	if (os_strcmp(entry->name, name) != 0) {
+		os_memset(entry, 0, sizeof(*entry));
+		os_strcpy(entry->name, name);
+	}
+
+	if (entry->pending) {
+		/* Don't stack lookups; answer from what we have */
+		cb(name, entry->valid ? &entry->ip : NULL, arg);
+		return;
+	}
+
+	if (entry->valid && (int32_t) (entry->expires - get_uptime()) > 0) {
+		cb(name, &entry->ip, arg);
+		return;
+	}
+
+	entry->cb = cb;
+	entry->arg = arg;
+	entry->conn.reverse = entry;
+	entry->pending = true;
+
+	os_printf("Sending DNS request for %s.\n", name);
+	ret = espconn_gethostbyname(&entry->conn, name, &ip, resolv_got_dns);
+	if (ret == ESPCONN_OK) {
+		/* lwIP already had it (or it was a literal address) */
+		resolv_got_dns(name, &ip, &entry->conn);
+	} else if (ret != ESPCONN_INPROGRESS) {
+		resolv_got_dns(name, NULL, &entry->conn);
+	}
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RESOLV_H_
+#define _RESOLV_H_
+
+#include <ip_addr.h>
+
+/* Same shape as the espconn DNS callback; ip is NULL on failure */
+typedef void (*resolv_callback)(const char *name, ip_addr_t *ip, void *arg);
+
+void ICACHE_FLASH_ATTR resolv_lookup(const char *name, resolv_callback cb,
+	void *arg);
+
+#endif /* _RESOLV_H_ */
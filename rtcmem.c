@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * RTC user memory survives everything except a power cycle or external
+ * reset, at which point it holds garbage. Store a checksum after each
+ * record so we can tell the difference. Data and len must be 4 byte
+ * aligned, as the SDK copies whole words.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+
+#include "rtcmem.h"
+
+static uint32_t ICACHE_FLASH_ATTR rtcmem_csum(uint8_t block,
+	const uint32_t *data, uint16_t len)
+{
+	/* Seed with where and how big, so a layout change invalidates */
+	uint32_t csum = 0xC10C0000 ^ (block << 8) ^ len;
+
+	for (len /= 4; len > 0; len--) {
+		csum = ((csum << 5) | (csum >> 27)) ^ *data++;
+	}
+
+	return csum;
+}
+
+bool ICACHE_FLASH_ATTR rtcmem_load(uint8_t block, void *data, uint16_t len)
+{
+	uint32_t csum;
+
+	if (!system_rtc_mem_read(block, data, len) ||
+			!system_rtc_mem_read(block + len / 4, &csum, 4)) {
+		return false;
+	}
+
+	return csum == rtcmem_csum(block, data, len);
+}
+
+void ICACHE_FLASH_ATTR rtcmem_save(uint8_t block, const void *data,
+	uint16_t len)
+{
+	uint32_t csum = rtcmem_csum(block, data, len);
+
+	system_rtc_mem_write(block, data, len);
+	system_rtc_mem_write(block + len / 4, &csum, 4);
+}
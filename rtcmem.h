@@ -0,0 +1,32 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _RTCMEM_H_
+#define _RTCMEM_H_
+
+/*
+ * RTC user memory is 4 byte blocks 64-191; below that belongs to the SDK.
+ * Each user gets its data plus one checksum block.
+ */
+#define RTCMEM_CLOCK	64	/* 18 + 1 blocks */
+#define RTCMEM_OTA	83	/* 29 + 1 blocks */
+#define RTCMEM_WIFI	113	/* 8 + 1 blocks */
+
+bool ICACHE_FLASH_ATTR rtcmem_load(uint8_t block, void *data, uint16_t len);
+void ICACHE_FLASH_ATTR rtcmem_save(uint8_t block, const void *data,
+	uint16_t len);
+
+#endif /* _RTCMEM_H_ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * How much the date cache in breakdown_time() saves. The display asks for
+ * consecutive seconds, which should all hit the cache; asking for times a
+ * day apart misses it every time, which is what every call cost before.
+ * The host has a hardware divider and the ESP8266 doesn't, so the gap on
+ * the device is wider than this shows.
+ */
+#include <osapi.h>
+
+#include "clock.h"
+#include "tz.h"
+#include "host.h"
+
+#define CALLS	2000000
+
+static double bench(const char *what, uint64_t start, uint32_t step)
+{
+	volatile int sink = 0;
+	struct tm tm;
+	uint64_t before;
+	double ns;
+	int i;
+
+	before = host_ns();
+	for (i = 0; i < CALLS; i++) {
+		breakdown_time(start + (uint64_t) i * step, &tm);
+		sink += tm.tm_sec;
+	}
+	ns = (double) (host_ns() - before) / CALLS;
+	printf("  %-36s %7.1f ns/call\n", what, ns);
+
+	return ns;
+}
+
+int main(void)
+{
+	/* 2019-06-01 00:00:00 UTC */
+	const uint64_t start = 1559347200;
+	double hit, miss;
+
+	host_init();
+	CHECK(tz_set("GMT0BST,M3.5.0/1,M10.5.0"));
+
+	printf("breakdown_time, %d calls each:\n", CALLS);
+	hit = bench("consecutive seconds (cached)", start, 1);
+	miss = bench("a day apart (uncached)", start, 86400 + 1);
+	printf("  cached is %.1fx faster\n", miss / hit);
+
+	CHECK(hit < miss);
+
+	return 0;
+}
@@ -0,0 +1,1123 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The SDK functions the firmware uses, done on the host: timers run from
+ * host_run(), flash and RTC memory are arrays, and espconn is real sockets
+ * so the tests can talk to ntpdate, Python and each other.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <espconn.h>
+#include <osapi.h>
+#include <spi_flash.h>
+#include <upgrade.h>
+#include <user_interface.h>
+
+#include "md5.h"
+#include "host.h"
+
+#define HOST_SOCKS	8
+#define HOST_DEFERRED	16
+#define HOST_MAPS	4
+
+uint8_t host_flash[HOST_FLASH_SIZE];
+uint8_t host_upgrade_flag;
+uint8_t host_userbin;
+struct ip_info host_ip_info;
+struct host_stats host_stats;
+
+uint32_t host_rtc[HOST_RTC_BLOCKS];
+static os_timer_t *timers;
+static bool verbose;
+
+/* Flash time used by the callback running now; see HOST_ERASE_US */
+static uint32_t cb_flash_us;
+
+struct host_sock {
+	struct espconn *conn;
+	int fd;
+	bool connecting;
+	bool held;
+};
+
+static struct host_sock socks[HOST_SOCKS];
+
+enum host_deferred_type {
+	HOST_SENT,
+	HOST_DISCONNECTED,
+	HOST_DNS,
+};
+
+struct host_deferred {
+	enum host_deferred_type type;
+	struct espconn *conn;
+	dns_found_callback found;
+	ip_addr_t ip;
+	bool resolved;
+	char name[64];
+};
+
+static struct host_deferred deferred[HOST_DEFERRED];
+static int deferred_count;
+
+static struct {
+	int port;
+	int to;
+} local_maps[HOST_MAPS], remote_maps[HOST_MAPS];
+
+static unsigned int segment_max = 1460;
+static bool segment_vary;
+
+uint64_t host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t host_now_us(void)
+{
+	return host_ns() / 1000;
+}
+
+static uint32_t host_now_ms(void)
+{
+	return host_now_us() / 1000;
+}
+
+void host_reset_stats(void)
+{
+	memset(&host_stats, 0, sizeof(host_stats));
+	cb_flash_us = 0;
+}
+
+void host_init(void)
+{
+	memset(host_flash, 0xFF, sizeof(host_flash));
+	memset(host_rtc, 0, sizeof(host_rtc));
+	host_reset_stats();
+	host_upgrade_flag = UPGRADE_FLAG_IDLE;
+	host_userbin = 0;
+	IP4_ADDR(&host_ip_info.ip, 127, 0, 0, 1);
+	IP4_ADDR(&host_ip_info.netmask, 255, 0, 0, 0);
+	IP4_ADDR(&host_ip_info.gw, 127, 0, 0, 1);
+	timers = NULL;
+	deferred_count = 0;
+	verbose = getenv("HOST_VERBOSE") != NULL;
+	srandom(1);
+}
+
+void host_map_local(int port, int to)
+{
+	int i;
+
+	for (i = 0; i < HOST_MAPS; i++) {
+		if (local_maps[i].port == 0 || local_maps[i].port == port) {
+			local_maps[i].port = port;
+			local_maps[i].to = to;
+			return;
+		}
+	}
+}
+
+void host_map_remote(int port, int to)
+{
+	int i;
+
+	for (i = 0; i < HOST_MAPS; i++) {
+		if (remote_maps[i].port == 0 || remote_maps[i].port == port) {
+			remote_maps[i].port = port;
+			remote_maps[i].to = to;
+			return;
+		}
+	}
+}
+
+static int host_local_port(int port)
+{
+	int i;
+
+	for (i = 0; i < HOST_MAPS; i++)
+		if (local_maps[i].port && local_maps[i].port == port)
+			return local_maps[i].to;
+	return port;
+}
+
+static int host_remote_port(int port)
+{
+	int i;
+
+	for (i = 0; i < HOST_MAPS; i++)
+		if (remote_maps[i].port && remote_maps[i].port == port)
+			return remote_maps[i].to;
+	return port;
+}
+
+static int host_remote_unmap(int port)
+{
+	int i;
+
+	for (i = 0; i < HOST_MAPS; i++)
+		if (remote_maps[i].port && remote_maps[i].to == port)
+			return remote_maps[i].port;
+	return port;
+}
+
+void host_segments(unsigned int max, bool vary)
+{
+	segment_max = max;
+	segment_vary = vary;
+}
+
+/* os_* */
+
+int os_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int ret = 0;
+
+	if (verbose) {
+		va_start(ap, fmt);
+		ret = vprintf(fmt, ap);
+		va_end(ap);
+	}
+
+	return ret;
+}
+
+int os_sprintf(char *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsprintf(buf, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int os_snprintf(char *buf, unsigned int size, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+unsigned long os_random(void)
+{
+	return random();
+}
+
+void *os_malloc(size_t size)
+{
+	return malloc(size);
+}
+
+void *os_zalloc(size_t size)
+{
+	return calloc(1, size);
+}
+
+void os_free(void *ptr)
+{
+	free(ptr);
+}
+
+void ets_delay_us(uint32_t us)
+{
+}
+
+static void host_timer_remove(os_timer_t *t)
+{
+	os_timer_t **p;
+
+	for (p = &timers; *p; p = &(*p)->timer_next) {
+		if (*p == t) {
+			*p = t->timer_next;
+			t->timer_next = NULL;
+			return;
+		}
+	}
+}
+
+static void host_timer_insert(os_timer_t *t)
+{
+	os_timer_t **p;
+
+	/* After anything due at the same time, as the SDK does */
+	for (p = &timers; *p; p = &(*p)->timer_next)
+		if ((int32_t) (t->timer_expire - (*p)->timer_expire) < 0)
+			break;
+	t->timer_next = *p;
+	*p = t;
+}
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *fn, void *arg)
+{
+	host_timer_remove(t);
+	t->timer_func = fn;
+	t->timer_arg = arg;
+}
+
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat)
+{
+	host_timer_remove(t);
+	t->timer_expire = host_now_ms() + ms;
+	t->timer_period = repeat ? ms : 0;
+	host_timer_insert(t);
+}
+
+void os_timer_disarm(os_timer_t *t)
+{
+	host_timer_remove(t);
+}
+
+/* System */
+
+uint32 system_get_time(void)
+{
+	return host_now_us();
+}
+
+/* A 6us RTC tick, roughly what the parts we have run at */
+uint32 system_get_rtc_time(void)
+{
+	return host_now_us() / 6;
+}
+
+uint32 system_rtc_clock_cali_proc(void)
+{
+	return 6 << 12;
+}
+
+bool system_rtc_mem_read(uint8 des_addr, void *src_addr, uint16 load_size)
+{
+	if (des_addr < 64 || des_addr * 4 + load_size > sizeof(host_rtc))
+		return false;
+	memcpy(src_addr, &host_rtc[des_addr], load_size);
+	return true;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr,
+	uint16 save_size)
+{
+	if (des_addr < 64 || des_addr * 4 + save_size > sizeof(host_rtc))
+		return false;
+	memcpy(&host_rtc[des_addr], src_addr, save_size);
+	return true;
+}
+
+uint32 system_get_free_heap_size(void)
+{
+	return 40000;
+}
+
+void system_soft_wdt_feed(void)
+{
+}
+
+void system_restart(void)
+{
+	host_stats.reboots++;
+}
+
+void system_deep_sleep(uint64 time_in_us)
+{
+}
+
+bool system_deep_sleep_set_option(uint8 option)
+{
+	return true;
+}
+
+struct rst_info *system_get_rst_info(void)
+{
+	static struct rst_info info;
+
+	return &info;
+}
+
+flash_size_map system_get_flash_size_map(void)
+{
+	return FLASH_SIZE_8M_MAP_512_512;
+}
+
+bool system_partition_table_regist(const partition_item_t *table,
+	uint32_t num, uint32_t map)
+{
+	return true;
+}
+
+uint8 system_upgrade_userbin_check(void)
+{
+	return host_userbin;
+}
+
+void system_upgrade_flag_set(uint8 flag)
+{
+	host_upgrade_flag = flag;
+}
+
+uint8 system_upgrade_flag_check(void)
+{
+	return host_upgrade_flag;
+}
+
+void system_upgrade_reboot(void)
+{
+	host_stats.reboots++;
+}
+
+/* Flash: erased is 0xFF and writes can only clear bits, as on the part */
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec)
+{
+	if ((sec + 1) * SPI_FLASH_SEC_SIZE > HOST_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	memset(&host_flash[sec * SPI_FLASH_SEC_SIZE], 0xFF, SPI_FLASH_SEC_SIZE);
+	host_stats.erases++;
+	cb_flash_us += HOST_ERASE_US;
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr,
+	uint32 size)
+{
+	uint8_t *src = (uint8_t *) src_addr;
+	uint32 i;
+
+	if ((des_addr | size) & 3 || des_addr + size > HOST_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	for (i = 0; i < size; i++)
+		host_flash[des_addr + i] &= src[i];
+	host_stats.writes++;
+	cb_flash_us += (size + 255) / 256 * HOST_PAGE_US;
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr,
+	uint32 size)
+{
+	if ((src_addr | size) & 3 || src_addr + size > HOST_FLASH_SIZE)
+		return SPI_FLASH_RESULT_ERR;
+	memcpy(des_addr, &host_flash[src_addr], size);
+	return SPI_FLASH_RESULT_OK;
+}
+
+/* Wifi; the tests are always associated */
+
+bool wifi_set_opmode(uint8 opmode)
+{
+	return true;
+}
+
+bool wifi_station_set_hostname(char *name)
+{
+	return true;
+}
+
+bool wifi_station_set_config(struct station_config *config)
+{
+	return true;
+}
+
+bool wifi_station_set_config_current(struct station_config *config)
+{
+	return true;
+}
+
+bool wifi_station_connect(void)
+{
+	return true;
+}
+
+bool wifi_station_disconnect(void)
+{
+	return true;
+}
+
+bool wifi_station_dhcpc_start(void)
+{
+	return true;
+}
+
+bool wifi_station_dhcpc_stop(void)
+{
+	return true;
+}
+
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info)
+{
+	*info = host_ip_info;
+	return true;
+}
+
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info)
+{
+	return true;
+}
+
+bool wifi_set_channel(uint8 channel)
+{
+	return true;
+}
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb)
+{
+}
+
+/* espconn */
+
+static struct host_sock *host_sock_find(struct espconn *conn)
+{
+	int i;
+
+	for (i = 0; i < HOST_SOCKS; i++)
+		if (socks[i].conn == conn)
+			return &socks[i];
+	return NULL;
+}
+
+static struct host_sock *host_sock_new(struct espconn *conn, int fd)
+{
+	struct host_sock *sock = host_sock_find(NULL);
+
+	if (sock == NULL) {
+		fprintf(stderr, "host: out of sockets\n");
+		exit(1);
+	}
+	memset(sock, 0, sizeof(*sock));
+	sock->conn = conn;
+	sock->fd = fd;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	return sock;
+}
+
+static void host_sock_close(struct host_sock *sock)
+{
+	close(sock->fd);
+	sock->conn = NULL;
+}
+
+static void host_defer(enum host_deferred_type type, struct espconn *conn)
+{
+	if (deferred_count == HOST_DEFERRED) {
+		fprintf(stderr, "host: too many deferred callbacks\n");
+		exit(1);
+	}
+	memset(&deferred[deferred_count], 0, sizeof(deferred[0]));
+	deferred[deferred_count].type = type;
+	deferred[deferred_count].conn = conn;
+	deferred_count++;
+}
+
+static void host_addr(struct sockaddr_in *sin, uint8 ip[4], int port)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	memcpy(&sin->sin_addr, ip, 4);
+	sin->sin_port = htons(port);
+}
+
+sint8 espconn_create(struct espconn *espconn)
+{
+	struct sockaddr_in sin;
+	uint8 any[4] = { 0, 0, 0, 0 };
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+	host_addr(&sin, any, host_local_port(espconn->proto.udp->local_port));
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		perror("host: bind");
+		close(fd);
+		return ESPCONN_ARG;
+	}
+	espconn->type = ESPCONN_UDP;
+	host_sock_new(espconn, fd);
+
+	return ESPCONN_OK;
+}
+
+sint8 espconn_connect(struct espconn *espconn)
+{
+	struct host_sock *sock;
+	struct sockaddr_in sin;
+	int fd;
+
+	if (host_sock_find(espconn) != NULL)
+		return ESPCONN_ISCONN;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	sock = host_sock_new(espconn, fd);
+	espconn->type = ESPCONN_TCP;
+	espconn->state = ESPCONN_WAIT;
+	host_addr(&sin, espconn->proto.tcp->remote_ip,
+		host_remote_port(espconn->proto.tcp->remote_port));
+	if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 &&
+			errno != EINPROGRESS) {
+		host_sock_close(sock);
+		return ESPCONN_RTE;
+	}
+	sock->connecting = true;
+	host_stats.connects++;
+
+	return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *espconn)
+{
+	struct host_sock *sock = host_sock_find(espconn);
+
+	if (sock == NULL || espconn->type != ESPCONN_TCP)
+		return ESPCONN_ARG;
+	host_sock_close(sock);
+	espconn->state = ESPCONN_CLOSE;
+	host_defer(HOST_DISCONNECTED, espconn);
+
+	return ESPCONN_OK;
+}
+
+sint8 espconn_delete(struct espconn *espconn)
+{
+	struct host_sock *sock = host_sock_find(espconn);
+	int i;
+
+	if (sock != NULL)
+		host_sock_close(sock);
+
+	/* Nothing more is delivered for it */
+	for (i = 0; i < deferred_count; i++)
+		if (deferred[i].conn == espconn &&
+				deferred[i].type != HOST_DNS)
+			deferred[i].conn = NULL;
+
+	return ESPCONN_OK;
+}
+
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length)
+{
+	struct host_sock *sock = host_sock_find(espconn);
+	struct sockaddr_in sin;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	if (sock == NULL)
+		return ESPCONN_ARG;
+
+	if (espconn->type == ESPCONN_UDP) {
+		host_addr(&sin, espconn->proto.udp->remote_ip,
+			host_remote_port(espconn->proto.udp->remote_port));
+		sendto(sock->fd, psent, length, 0, (struct sockaddr *) &sin,
+			sizeof(sin));
+		return ESPCONN_OK;
+	}
+
+	while (length) {
+		ret = send(sock->fd, psent, length, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EAGAIN) {
+			pfd.fd = sock->fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 1000);
+			continue;
+		}
+		if (ret < 0)
+			return ESPCONN_CONN;
+		psent += ret;
+		length -= ret;
+	}
+	if (espconn->sent_callback)
+		host_defer(HOST_SENT, espconn);
+
+	return ESPCONN_OK;
+}
+
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length)
+{
+	return espconn_send(espconn, psent, length);
+}
+
+sint8 espconn_regist_recvcb(struct espconn *espconn,
+	espconn_recv_callback recv_cb)
+{
+	espconn->recv_callback = recv_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *espconn,
+	espconn_sent_callback sent_cb)
+{
+	espconn->sent_callback = sent_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *espconn,
+	espconn_connect_callback connect_cb)
+{
+	espconn->proto.tcp->connect_callback = connect_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *espconn,
+	espconn_connect_callback discon_cb)
+{
+	espconn->proto.tcp->disconnect_callback = discon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *espconn,
+	espconn_reconnect_callback recon_cb)
+{
+	espconn->proto.tcp->reconnect_callback = recon_cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_recv_hold(struct espconn *espconn)
+{
+	struct host_sock *sock = host_sock_find(espconn);
+
+	if (sock == NULL)
+		return ESPCONN_ARG;
+	sock->held = true;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_recv_unhold(struct espconn *espconn)
+{
+	struct host_sock *sock = host_sock_find(espconn);
+
+	if (sock == NULL)
+		return ESPCONN_ARG;
+	sock->held = false;
+	return ESPCONN_OK;
+}
+
+uint32 espconn_port(void)
+{
+	static uint32 port = 49152;
+
+	return port++;
+}
+
+sint8 espconn_gethostbyname(struct espconn *espconn, const char *hostname,
+	ip_addr_t *addr, dns_found_callback found)
+{
+	struct addrinfo hints, *res;
+	struct host_deferred *dns;
+
+	host_defer(HOST_DNS, espconn);
+	dns = &deferred[deferred_count - 1];
+	dns->found = found;
+	strncpy(dns->name, hostname, sizeof(dns->name) - 1);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	if (getaddrinfo(hostname, NULL, &hints, &res) == 0) {
+		memcpy(&dns->ip.addr,
+			&((struct sockaddr_in *) res->ai_addr)->sin_addr, 4);
+		dns->resolved = true;
+		freeaddrinfo(res);
+	}
+
+	return ESPCONN_INPROGRESS;
+}
+
+static ip_addr_t dns_servers[2];
+
+void espconn_dns_setserver(uint8 numdns, ip_addr_t *dnsserver)
+{
+	if (numdns < 2)
+		dns_servers[numdns] = *dnsserver;
+}
+
+ip_addr_t espconn_dns_getserver(uint8 numdns)
+{
+	return dns_servers[numdns < 2 ? numdns : 0];
+}
+
+sint8 espconn_igmp_join(ip_addr_t *host_ip, ip_addr_t *multicast_ip)
+{
+	host_stats.igmp_joins++;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_igmp_leave(ip_addr_t *host_ip, ip_addr_t *multicast_ip)
+{
+	host_stats.igmp_leaves++;
+	return ESPCONN_OK;
+}
+
+/* The main loop */
+
+static void host_account(uint32_t *worst)
+{
+	if (cb_flash_us > *worst)
+		*worst = cb_flash_us;
+	cb_flash_us = 0;
+}
+
+static void host_run_deferred(void)
+{
+	struct host_deferred call;
+	struct espconn *conn;
+
+	while (deferred_count) {
+		call = deferred[0];
+		deferred_count--;
+		memmove(&deferred[0], &deferred[1],
+			deferred_count * sizeof(deferred[0]));
+		conn = call.conn;
+		if (conn == NULL)
+			continue;
+
+		switch (call.type) {
+		case HOST_SENT:
+			conn->sent_callback(conn);
+			break;
+		case HOST_DISCONNECTED:
+			conn->state = ESPCONN_CLOSE;
+			if (conn->proto.tcp->disconnect_callback)
+				conn->proto.tcp->disconnect_callback(conn);
+			break;
+		case HOST_DNS:
+			call.found(call.name, call.resolved ? &call.ip : NULL,
+				conn);
+			break;
+		}
+		host_account(&host_stats.timer_flash_us);
+	}
+}
+
+static void host_run_timers(void)
+{
+	uint32_t now = host_now_ms();
+	os_timer_t *t;
+
+	while ((t = timers) && (int32_t) (t->timer_expire - now) <= 0) {
+		timers = t->timer_next;
+		t->timer_next = NULL;
+		if (t->timer_period) {
+			t->timer_expire = now + t->timer_period;
+			host_timer_insert(t);
+		}
+		t->timer_func(t->timer_arg);
+		host_account(&host_stats.timer_flash_us);
+	}
+}
+
+static void host_tcp_event(struct host_sock *sock, short revents)
+{
+	struct espconn *conn = sock->conn;
+	/* lwIP can hand over chained pbufs, more than a segment, in one go */
+	static char buf[16384];
+	unsigned int len;
+	socklen_t size;
+	ssize_t ret;
+	int err = 0;
+
+	if (sock->connecting) {
+		size = sizeof(err);
+		getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &err, &size);
+		sock->connecting = false;
+		if (err) {
+			host_sock_close(sock);
+			conn->proto.tcp->reconnect_callback(conn, ESPCONN_CONN);
+		} else {
+			conn->state = ESPCONN_CONNECT;
+			conn->proto.tcp->connect_callback(conn);
+		}
+		host_account(&host_stats.timer_flash_us);
+		return;
+	}
+
+	len = segment_max;
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+	if (segment_vary)
+		len = 1 + random() % len;
+	ret = recv(sock->fd, buf, len, 0);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+	if (ret <= 0) {
+		host_sock_close(sock);
+		conn->state = ESPCONN_CLOSE;
+		if (ret == 0)
+			conn->proto.tcp->disconnect_callback(conn);
+		else
+			conn->proto.tcp->reconnect_callback(conn, ESPCONN_RST);
+		host_account(&host_stats.timer_flash_us);
+		return;
+	}
+
+	conn->state = ESPCONN_READ;
+	conn->recv_callback(conn, buf, ret);
+	host_account(&host_stats.recv_flash_us);
+}
+
+static void host_udp_event(struct host_sock *sock)
+{
+	struct espconn *conn = sock->conn;
+	struct sockaddr_in sin;
+	socklen_t size = sizeof(sin);
+	static char buf[1500];
+	ssize_t ret;
+
+	ret = recvfrom(sock->fd, buf, sizeof(buf), 0,
+		(struct sockaddr *) &sin, &size);
+	if (ret < 0)
+		return;
+	memcpy(conn->proto.udp->remote_ip, &sin.sin_addr, 4);
+	conn->proto.udp->remote_port = host_remote_unmap(ntohs(sin.sin_port));
+	if (conn->recv_callback)
+		conn->recv_callback(conn, buf, ret);
+	host_account(&host_stats.recv_flash_us);
+}
+
+static void host_step(uint32_t deadline, bool (*done)(void))
+{
+	struct pollfd pfd[HOST_SOCKS];
+	struct host_sock *who[HOST_SOCKS];
+	int32_t wait;
+	int i, n = 0;
+
+	host_run_deferred();
+	host_run_timers();
+	/* Don't sit in poll() if that's what we were waiting for */
+	if (done && done())
+		return;
+
+	wait = deadline - host_now_ms();
+	if (timers && (int32_t) (timers->timer_expire - host_now_ms()) < wait)
+		wait = timers->timer_expire - host_now_ms();
+	if (deferred_count || wait < 0)
+		wait = 0;
+
+	for (i = 0; i < HOST_SOCKS; i++) {
+		if (socks[i].conn == NULL || socks[i].held)
+			continue;
+		pfd[n].fd = socks[i].fd;
+		pfd[n].events = socks[i].connecting ? POLLOUT : POLLIN;
+		who[n++] = &socks[i];
+	}
+
+	if (poll(pfd, n, wait) <= 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		/* An earlier callback may have closed it */
+		if (!pfd[i].revents || who[i]->conn == NULL ||
+				who[i]->fd != pfd[i].fd)
+			continue;
+		if (who[i]->conn->type == ESPCONN_UDP)
+			host_udp_event(who[i]);
+		else
+			host_tcp_event(who[i], pfd[i].revents);
+	}
+}
+
+bool host_run_until(bool (*done)(void), uint32_t ms)
+{
+	uint32_t deadline = host_now_ms() + ms;
+
+	while ((int32_t) (deadline - host_now_ms()) > 0) {
+		if (done && done())
+			return true;
+		host_step(deadline, done);
+	}
+
+	return done && done();
+}
+
+void host_run(uint32_t ms)
+{
+	host_run_until(NULL, ms);
+}
+
+/*
+ * MD5 is in the ESP8266's ROM; this is the usual public domain version
+ * (Colin Plumb's), which keeps its state in the same struct.
+ */
+
+#define MD5_F1(x, y, z) (z ^ (x & (y ^ z)))
+#define MD5_F2(x, y, z) MD5_F1(z, x, y)
+#define MD5_F3(x, y, z) (x ^ y ^ z)
+#define MD5_F4(x, y, z) (y ^ (x | ~z))
+#define MD5_STEP(f, w, x, y, z, data, s) \
+	(w += f(x, y, z) + data, w = w << s | w >> (32 - s), w += x)
+
+static void md5_transform(uint32_t buf[4], const uint8_t block[64])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+	uint32_t in[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		in[i] = block[i * 4] | block[i * 4 + 1] << 8 |
+			block[i * 4 + 2] << 16 | (uint32_t) block[i * 4 + 3] << 24;
+
+	MD5_STEP(MD5_F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+	MD5_STEP(MD5_F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+	MD5_STEP(MD5_F1, c, d, a, b, in[2] + 0x242070db, 17);
+	MD5_STEP(MD5_F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+	MD5_STEP(MD5_F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+	MD5_STEP(MD5_F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+	MD5_STEP(MD5_F1, c, d, a, b, in[6] + 0xa8304613, 17);
+	MD5_STEP(MD5_F1, b, c, d, a, in[7] + 0xfd469501, 22);
+	MD5_STEP(MD5_F1, a, b, c, d, in[8] + 0x698098d8, 7);
+	MD5_STEP(MD5_F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+	MD5_STEP(MD5_F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5_STEP(MD5_F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5_STEP(MD5_F1, a, b, c, d, in[12] + 0x6b901122, 7);
+	MD5_STEP(MD5_F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5_STEP(MD5_F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5_STEP(MD5_F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5_STEP(MD5_F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5_STEP(MD5_F2, d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5_STEP(MD5_F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5_STEP(MD5_F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5_STEP(MD5_F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5_STEP(MD5_F2, d, a, b, c, in[10] + 0x02441453, 9);
+	MD5_STEP(MD5_F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5_STEP(MD5_F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5_STEP(MD5_F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5_STEP(MD5_F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5_STEP(MD5_F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5_STEP(MD5_F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5_STEP(MD5_F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5_STEP(MD5_F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5_STEP(MD5_F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5_STEP(MD5_F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5_STEP(MD5_F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+	MD5_STEP(MD5_F3, d, a, b, c, in[8] + 0x8771f681, 11);
+	MD5_STEP(MD5_F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5_STEP(MD5_F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5_STEP(MD5_F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+	MD5_STEP(MD5_F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+	MD5_STEP(MD5_F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+	MD5_STEP(MD5_F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5_STEP(MD5_F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+	MD5_STEP(MD5_F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+	MD5_STEP(MD5_F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+	MD5_STEP(MD5_F3, b, c, d, a, in[6] + 0x04881d05, 23);
+	MD5_STEP(MD5_F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+	MD5_STEP(MD5_F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5_STEP(MD5_F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5_STEP(MD5_F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+	MD5_STEP(MD5_F4, a, b, c, d, in[0] + 0xf4292244, 6);
+	MD5_STEP(MD5_F4, d, a, b, c, in[7] + 0x432aff97, 10);
+	MD5_STEP(MD5_F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5_STEP(MD5_F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+	MD5_STEP(MD5_F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+	MD5_STEP(MD5_F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+	MD5_STEP(MD5_F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5_STEP(MD5_F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+	MD5_STEP(MD5_F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+	MD5_STEP(MD5_F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5_STEP(MD5_F4, c, d, a, b, in[6] + 0xa3014314, 15);
+	MD5_STEP(MD5_F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5_STEP(MD5_F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+	MD5_STEP(MD5_F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5_STEP(MD5_F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+	MD5_STEP(MD5_F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+void MD5Init(struct MD5Context *ctx)
+{
+	ctx->buf[0] = 0x67452301;
+	ctx->buf[1] = 0xefcdab89;
+	ctx->buf[2] = 0x98badcfe;
+	ctx->buf[3] = 0x10325476;
+	ctx->bits[0] = 0;
+	ctx->bits[1] = 0;
+}
+
+void MD5Update(struct MD5Context *ctx, const void *data, uint32_t len)
+{
+	const uint8_t *buf = data;
+	uint32_t used = (ctx->bits[0] >> 3) & 0x3f;
+	uint32_t t;
+
+	t = ctx->bits[0];
+	if ((ctx->bits[0] = t + (len << 3)) < t)
+		ctx->bits[1]++;
+	ctx->bits[1] += len >> 29;
+
+	while (len) {
+		t = 64 - used;
+		if (t > len)
+			t = len;
+		memcpy(ctx->in + used, buf, t);
+		used += t;
+		buf += t;
+		len -= t;
+		if (used == 64) {
+			md5_transform(ctx->buf, ctx->in);
+			used = 0;
+		}
+	}
+}
+
+void MD5Final(uint8_t digest[MD5_LEN], struct MD5Context *ctx)
+{
+	static const uint8_t pad[64] = { 0x80 };
+	uint8_t bits[8];
+	uint32_t used = (ctx->bits[0] >> 3) & 0x3f;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		bits[i] = ctx->bits[0] >> (i * 8);
+		bits[i + 4] = ctx->bits[1] >> (i * 8);
+	}
+	MD5Update(ctx, pad, used < 56 ? 56 - used : 120 - used);
+	MD5Update(ctx, bits, 8);
+
+	for (i = 0; i < 4; i++) {
+		digest[i * 4] = ctx->buf[i];
+		digest[i * 4 + 1] = ctx->buf[i] >> 8;
+		digest[i * 4 + 2] = ctx->buf[i] >> 16;
+		digest[i * 4 + 3] = ctx->buf[i] >> 24;
+	}
+	memset(ctx, 0, sizeof(*ctx));
+}
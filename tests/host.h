@@ -0,0 +1,90 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <c_types.h>
+
+/* A 1MB part, laid out as in user_main.c */
+#define HOST_FLASH_SIZE	0x100000
+/* 768 bytes of RTC memory, the first 256 the SDK's */
+#define HOST_RTC_BLOCKS	192
+
+/*
+ * What a flash operation costs on a real part, in microseconds. Nothing
+ * sleeps; the costs are added up per callback so a test can check how long
+ * the device would have spent in one.
+ */
+#define HOST_ERASE_US		45000
+#define HOST_PAGE_US		700	/* Per 256 byte page written */
+
+struct host_stats {
+	uint32_t erases;
+	uint32_t writes;
+	uint32_t reboots;
+	uint32_t igmp_joins;
+	uint32_t igmp_leaves;
+	uint32_t connects;
+	/* Longest flash time spent in a single callback, by kind */
+	uint32_t recv_flash_us;
+	uint32_t timer_flash_us;
+};
+
+extern uint8_t host_flash[HOST_FLASH_SIZE];
+extern uint8_t host_upgrade_flag;
+extern uint8_t host_userbin;
+/* RTC memory, in 4 byte blocks; kept over a reset, but not by host_init() */
+extern uint32_t host_rtc[HOST_RTC_BLOCKS];
+/* What wifi_get_ip_info() hands back; 127.0.0.1 after host_init() */
+extern struct ip_info host_ip_info;
+extern struct host_stats host_stats;
+
+/* A monotonic clock, for benchmarks */
+uint64_t host_ns(void);
+
+/* Resets flash, RTC memory, timers and the counters */
+void host_init(void);
+/* Just the counters, including flash time not yet put down to a callback */
+void host_reset_stats(void);
+
+/* Runs timers and sockets for ms milliseconds of real time */
+void host_run(uint32_t ms);
+/* As host_run, but returns true as soon as done() does */
+bool host_run_until(bool (*done)(void), uint32_t ms);
+
+/* Sends UDP/TCP traffic for port to another one, so tests needn't be root */
+void host_map_local(int port, int to);
+void host_map_remote(int port, int to);
+
+/*
+ * Hands TCP data to receive callbacks at most max bytes at a time; with
+ * vary set each callback gets a random amount up to max.
+ */
+void host_segments(unsigned int max, bool vary);
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", \
+				__FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+#endif /* _HOST_H_ */
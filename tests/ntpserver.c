@@ -0,0 +1,93 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * clock.c's NTP server (CFG_NTP_SERVER) on the host, so it can be checked
+ * with ntpdate or sntp rather than a second clock. It syncs from an
+ * upstream server just as the device does, then answers on port 123:
+ *
+ *   sudo ./ntpserver
+ *   ntpdate -q 127.0.0.1
+ *
+ * -p serves on another port instead, and -u syncs from another upstream
+ * (host[:port]) than the built in one; test_ntpserver.py uses both.
+ */
+#include <getopt.h>
+#include <unistd.h>
+
+#include <osapi.h>
+
+#include "clock.h"
+#include "config.h"
+#include "host.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-u upstream[:port]] "
+		"[-t seconds]\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seconds = 0;
+	char *upstream = NULL;
+	char *colon;
+	int opt;
+
+	host_init();
+	config_init();
+
+	while ((opt = getopt(argc, argv, "p:u:t:")) != -1) {
+		switch (opt) {
+		case 'p':
+			host_map_local(123, atoi(optarg));
+			break;
+		case 'u':
+			upstream = optarg;
+			colon = strchr(upstream, ':');
+			if (colon) {
+				*colon = '\0';
+				host_map_remote(123, atoi(colon + 1));
+			}
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	if (upstream)
+		CHECK(config_set("ntp.server", upstream));
+
+	rtc_init();
+	ntp_listen();
+	ntp_get_time();
+	if (host_run_until(clock_is_set, 6000))
+		printf("synced\n");
+	else
+		printf("not synced\n");
+	fflush(stdout);
+
+	do {
+		host_run(1000);
+	} while (seconds == 0 || --seconds);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ota.c on the host, making one upgrade check against an upgrade server
+ * on 127.0.0.1 rather than UPGRADE_HOST:
+ *
+ *   otaclient -p port [-r running.bin] [-t target.bin] [-o out.bin]
+ *	[-s segment] [-b bytes] [-m rtc.bin] [-c key]...
+ *
+ * It runs from slot 0, so upgrades slot 1. -r puts an image in slot 0 for
+ * a delta to patch, -t leaves one in slot 1 as an earlier upgrade would
+ * have, and -o writes slot 1 out afterwards. -s hands the data over in
+ * random sized pieces of up to that many bytes, and -b in pieces of that
+ * many where there's that much to hand. -m keeps RTC memory in a file
+ * from one run to the next, as a reset would, so a download can be
+ * resumed. -c prints what the server left key set to. What it took goes to
+ * stdout for test_ota.py.
+ */
+#include <getopt.h>
+
+#include <osapi.h>
+#include <upgrade.h>
+
+#include "anim.h"
+#include "config.h"
+#include "host.h"
+#include "ota.h"
+
+/* Where slot 0 and slot 1 live; see ota_base() */
+#define SLOT0_BASE	0x1000
+#define SLOT1_BASE	0x81000
+#define SLOT_SIZE	0x6B000
+#define MAX_KEYS	8
+
+/* There's no display; nothing's drawing from the assets */
+void anim_stop(void)
+{
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s -p port [-r running.bin] [-t target.bin] "
+		"[-o out.bin] [-s segment] [-b bytes] [-m rtc.bin] "
+		"[-c key]...\n", name);
+	exit(2);
+}
+
+static void load(const char *file, uint32_t base)
+{
+	FILE *f = fopen(file, "rb");
+
+	if (f == NULL) {
+		perror(file);
+		exit(1);
+	}
+	fread(&host_flash[base], 1, SLOT_SIZE, f);
+	fclose(f);
+}
+
+/* A missing file is fine; RTC memory starts out as garbage anyway */
+static void load_rtc(const char *file)
+{
+	FILE *f = fopen(file, "rb");
+
+	if (f == NULL)
+		return;
+	fread(host_rtc, 1, sizeof(host_rtc), f);
+	fclose(f);
+}
+
+static void save_rtc(const char *file)
+{
+	FILE *f = fopen(file, "wb");
+
+	if (f == NULL) {
+		perror(file);
+		exit(1);
+	}
+	fwrite(host_rtc, 1, sizeof(host_rtc), f);
+	fclose(f);
+}
+
+static void save(const char *file, uint32_t base)
+{
+	FILE *f = fopen(file, "wb");
+
+	if (f == NULL) {
+		perror(file);
+		exit(1);
+	}
+	fwrite(&host_flash[base], 1, SLOT_SIZE, f);
+	fclose(f);
+}
+
+static bool finished(void)
+{
+	return system_upgrade_flag_check() != UPGRADE_FLAG_START;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out = NULL, *rtc = NULL;
+	const char *keys[MAX_KEYS];
+	char value[CONFIG_VALUE_LEN + 1];
+	int i, nkeys = 0, opt, port = 0;
+
+	host_init();
+	config_init();
+
+	while ((opt = getopt(argc, argv, "p:r:t:o:s:b:m:c:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			load(optarg, SLOT0_BASE);
+			break;
+		case 't':
+			load(optarg, SLOT1_BASE);
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 's':
+			host_segments(atoi(optarg), true);
+			break;
+		case 'b':
+			host_segments(atoi(optarg), false);
+			break;
+		case 'm':
+			rtc = optarg;
+			load_rtc(rtc);
+			break;
+		case 'c':
+			if (nkeys == MAX_KEYS)
+				usage(argv[0]);
+			keys[nkeys++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (port == 0 || optind != argc)
+		usage(argv[0]);
+
+	host_map_remote(80, port);
+	CHECK(config_set("ota.host", "127.0.0.1"));
+	/* Only count what the upgrade does */
+	host_reset_stats();
+
+	CHECK(ota_check());
+	if (!host_run_until(finished, 30000)) {
+		printf("timed out\n");
+		return 1;
+	}
+	/* Let the last disconnect through */
+	host_run(100);
+
+	if (out)
+		save(out, SLOT1_BASE);
+	if (rtc)
+		save_rtc(rtc);
+	for (i = 0; i < nkeys; i++) {
+		if (config_get(keys[i], value, sizeof(value)))
+			printf("config %s=%s\n", keys[i], value);
+		else
+			printf("config %s unset\n", keys[i]);
+	}
+
+	printf("connects=%u reboots=%u erases=%u writes=%u "
+		"recv_flash_us=%u timer_flash_us=%u\n",
+		host_stats.connects, host_stats.reboots, host_stats.erases,
+		host_stats.writes, host_stats.recv_flash_us,
+		host_stats.timer_flash_us);
+
+	return 0;
+}
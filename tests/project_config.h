@@ -0,0 +1,12 @@
+/*
+ * Only used when there's no project_config.h at the top level; the tests
+ * don't depend on what's in it.
+ */
+#define PROJECT "clock"
+#define VER_MAJ 0
+#define VER_MIN 1
+#define CFG_WIFI_SSID "My Wifi"
+#define CFG_WIFI_PASSWORD "password"
+#define UPGRADE_HOST "upgrade-host.local"
+#define UPGRADE_PATH "/esp8266/" PROJECT "/"
+#define CFG_TZ "GMT0BST,M3.5.0/1,M10.5.0"
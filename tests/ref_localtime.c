@@ -0,0 +1,46 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The C library's localtime(), as the reference for breakdown_time(). It's
+ * on its own because clock.h has its own struct tm.
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include "ref_localtime.h"
+
+void ref_tz(const char *tz)
+{
+	setenv("TZ", tz, 1);
+	tzset();
+}
+
+void ref_localtime(unsigned long long t, int fields[REF_FIELDS])
+{
+	time_t when = t;
+	struct tm tm;
+
+	localtime_r(&when, &tm);
+	fields[0] = tm.tm_sec;
+	fields[1] = tm.tm_min;
+	fields[2] = tm.tm_hour;
+	fields[3] = tm.tm_mday;
+	fields[4] = tm.tm_mon;
+	fields[5] = tm.tm_year + 1900;
+	fields[6] = tm.tm_wday;
+	fields[7] = tm.tm_yday;
+	fields[8] = tm.tm_isdst > 0;
+}
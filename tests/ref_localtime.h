@@ -0,0 +1,10 @@
+#ifndef _REF_LOCALTIME_H_
+#define _REF_LOCALTIME_H_
+
+/* sec, min, hour, mday, mon, year, wday, yday, isdst */
+#define REF_FIELDS	9
+
+void ref_tz(const char *tz);
+void ref_localtime(unsigned long long t, int fields[REF_FIELDS]);
+
+#endif /* _REF_LOCALTIME_H_ */
@@ -0,0 +1,351 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Just enough of the NONOS SDK to build the firmware's modules on the host
+ * for the tests. Every SDK header in this directory includes this one; the
+ * functions are implemented in ../host.c on top of sockets, an in-memory
+ * flash and a timer queue run by host_run().
+ */
+#ifndef _HOST_SDK_H_
+#define _HOST_SDK_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+typedef int8_t int8;
+typedef int16_t int16;
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define STORE_ATTR __attribute__((aligned(4)))
+
+#define BIT(n) (1UL << (n))
+#define BIT12 BIT(12)
+
+/* osapi.h / os_type.h */
+typedef void os_timer_func_t(void *timer_arg);
+
+typedef struct _ETSTIMER_ {
+	struct _ETSTIMER_ *timer_next;
+	uint32_t timer_expire;
+	uint32_t timer_period;
+	os_timer_func_t *timer_func;
+	void *timer_arg;
+} os_timer_t;
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *fn, void *arg);
+void os_timer_arm(os_timer_t *t, uint32_t ms, bool repeat);
+void os_timer_disarm(os_timer_t *t);
+
+int os_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int os_sprintf(char *buf, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int os_snprintf(char *buf, unsigned int size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+unsigned long os_random(void);
+
+#define os_memcmp memcmp
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#define os_strchr strchr
+#define os_strcmp strcmp
+#define os_strcpy strcpy
+#define os_strlen strlen
+#define os_strncmp strncmp
+#define os_strncpy strncpy
+#define os_strstr strstr
+
+void ets_delay_us(uint32_t us);
+
+/* mem.h */
+void *os_malloc(size_t size);
+void *os_zalloc(size_t size);
+void os_free(void *ptr);
+
+/* ip_addr.h */
+typedef struct ip_addr {
+	uint32 addr;
+} ip_addr_t;
+
+struct ip_info {
+	ip_addr_t ip;
+	ip_addr_t netmask;
+	ip_addr_t gw;
+};
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+	((ipaddr)->addr = ((uint32)((d) & 0xff) << 24) | \
+		((uint32)((c) & 0xff) << 16) | \
+		((uint32)((b) & 0xff) << 8) | (uint32)((a) & 0xff))
+
+/* user_interface.h */
+uint32 system_get_time(void);
+uint32 system_get_rtc_time(void);
+uint32 system_rtc_clock_cali_proc(void);
+bool system_rtc_mem_read(uint8 des_addr, void *src_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr,
+	uint16 save_size);
+uint32 system_get_free_heap_size(void);
+void system_soft_wdt_feed(void);
+void system_restart(void);
+void system_deep_sleep(uint64 time_in_us);
+bool system_deep_sleep_set_option(uint8 option);
+
+enum rst_reason {
+	REASON_DEFAULT_RST = 0,
+	REASON_WDT_RST,
+	REASON_EXCEPTION_RST,
+	REASON_SOFT_WDT_RST,
+	REASON_SOFT_RESTART,
+	REASON_DEEP_SLEEP_AWAKE,
+	REASON_EXT_SYS_RST,
+};
+
+struct rst_info {
+	uint32 reason;
+	uint32 exccause;
+	uint32 epc1;
+	uint32 epc2;
+	uint32 epc3;
+	uint32 excvaddr;
+	uint32 depc;
+};
+
+struct rst_info *system_get_rst_info(void);
+
+typedef enum {
+	FLASH_SIZE_4M_MAP_256_256 = 0,
+	FLASH_SIZE_2M,
+	FLASH_SIZE_8M_MAP_512_512,
+	FLASH_SIZE_16M_MAP_512_512,
+	FLASH_SIZE_32M_MAP_512_512,
+	FLASH_SIZE_16M_MAP_1024_1024,
+	FLASH_SIZE_32M_MAP_1024_1024,
+} flash_size_map;
+
+typedef enum {
+	SYSTEM_PARTITION_INVALID = 0,
+	SYSTEM_PARTITION_BOOTLOADER,
+	SYSTEM_PARTITION_OTA_1,
+	SYSTEM_PARTITION_OTA_2,
+	SYSTEM_PARTITION_RF_CAL,
+	SYSTEM_PARTITION_PHY_DATA,
+	SYSTEM_PARTITION_SYSTEM_PARAMETER,
+	SYSTEM_PARTITION_CUSTOMER_BEGIN = 100,
+} partition_type_t;
+
+typedef struct {
+	partition_type_t type;
+	uint32_t addr;
+	uint32_t size;
+} partition_item_t;
+
+flash_size_map system_get_flash_size_map(void);
+bool system_partition_table_regist(const partition_item_t *table,
+	uint32_t num, uint32_t map);
+
+#define STATION_IF	0
+#define STATION_MODE	1
+
+struct station_config {
+	uint8 ssid[32];
+	uint8 password[64];
+	uint8 bssid_set;
+	uint8 bssid[6];
+};
+
+enum {
+	EVENT_STAMODE_CONNECTED = 0,
+	EVENT_STAMODE_DISCONNECTED,
+	EVENT_STAMODE_AUTHMODE_CHANGE,
+	EVENT_STAMODE_GOT_IP,
+	EVENT_STAMODE_DHCP_TIMEOUT,
+};
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 channel;
+} Event_StaMode_Connected_t;
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef struct {
+	ip_addr_t ip;
+	ip_addr_t mask;
+	ip_addr_t gw;
+} Event_StaMode_Got_IP_t;
+
+typedef struct {
+	uint32 event;
+	union {
+		Event_StaMode_Connected_t connected;
+		Event_StaMode_Disconnected_t disconnected;
+		Event_StaMode_Got_IP_t got_ip;
+	} event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+bool wifi_set_opmode(uint8 opmode);
+bool wifi_station_set_hostname(char *name);
+bool wifi_station_set_config(struct station_config *config);
+bool wifi_station_set_config_current(struct station_config *config);
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+bool wifi_station_dhcpc_start(void);
+bool wifi_station_dhcpc_stop(void);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_channel(uint8 channel);
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+
+/* upgrade.h */
+#define UPGRADE_FLAG_IDLE	0x00
+#define UPGRADE_FLAG_START	0x01
+#define UPGRADE_FLAG_FINISH	0x02
+
+uint8 system_upgrade_userbin_check(void);
+void system_upgrade_flag_set(uint8 flag);
+uint8 system_upgrade_flag_check(void);
+void system_upgrade_reboot(void);
+
+/* spi_flash.h */
+#define SPI_FLASH_SEC_SIZE	4096
+
+typedef enum {
+	SPI_FLASH_RESULT_OK,
+	SPI_FLASH_RESULT_ERR,
+	SPI_FLASH_RESULT_TIMEOUT,
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr,
+	uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr,
+	uint32 size);
+
+/* espconn.h */
+#define ESPCONN_OK		0
+#define ESPCONN_MEM		-1
+#define ESPCONN_TIMEOUT		-3
+#define ESPCONN_RTE		-4
+#define ESPCONN_INPROGRESS	-5
+#define ESPCONN_ABRT		-8
+#define ESPCONN_RST		-9
+#define ESPCONN_CLSD		-10
+#define ESPCONN_CONN		-11
+#define ESPCONN_ARG		-12
+#define ESPCONN_ISCONN		-15
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata,
+	unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+typedef void (*dns_found_callback)(const char *name, ip_addr_t *ipaddr,
+	void *callback_arg);
+
+enum espconn_type {
+	ESPCONN_INVALID = 0,
+	ESPCONN_TCP = 0x10,
+	ESPCONN_UDP = 0x20,
+};
+
+enum espconn_state {
+	ESPCONN_NONE,
+	ESPCONN_WAIT,
+	ESPCONN_LISTEN,
+	ESPCONN_CONNECT,
+	ESPCONN_WRITE,
+	ESPCONN_READ,
+	ESPCONN_CLOSE,
+};
+
+typedef struct _esp_tcp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+	espconn_connect_callback connect_callback;
+	espconn_reconnect_callback reconnect_callback;
+	espconn_connect_callback disconnect_callback;
+	espconn_connect_callback write_finish_fn;
+} esp_tcp;
+
+typedef struct _esp_udp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+} esp_udp;
+
+struct espconn {
+	enum espconn_type type;
+	enum espconn_state state;
+	union {
+		esp_tcp *tcp;
+		esp_udp *udp;
+	} proto;
+	espconn_recv_callback recv_callback;
+	espconn_sent_callback sent_callback;
+	uint8 link_cnt;
+	void *reverse;
+};
+
+sint8 espconn_create(struct espconn *espconn);
+sint8 espconn_delete(struct espconn *espconn);
+sint8 espconn_connect(struct espconn *espconn);
+sint8 espconn_disconnect(struct espconn *espconn);
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_sent(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_regist_recvcb(struct espconn *espconn,
+	espconn_recv_callback recv_cb);
+sint8 espconn_regist_sentcb(struct espconn *espconn,
+	espconn_sent_callback sent_cb);
+sint8 espconn_regist_connectcb(struct espconn *espconn,
+	espconn_connect_callback connect_cb);
+sint8 espconn_regist_disconcb(struct espconn *espconn,
+	espconn_connect_callback discon_cb);
+sint8 espconn_regist_reconcb(struct espconn *espconn,
+	espconn_reconnect_callback recon_cb);
+sint8 espconn_recv_hold(struct espconn *espconn);
+sint8 espconn_recv_unhold(struct espconn *espconn);
+uint32 espconn_port(void);
+sint8 espconn_gethostbyname(struct espconn *espconn, const char *hostname,
+	ip_addr_t *addr, dns_found_callback found);
+void espconn_dns_setserver(uint8 numdns, ip_addr_t *dnsserver);
+ip_addr_t espconn_dns_getserver(uint8 numdns);
+sint8 espconn_igmp_join(ip_addr_t *host_ip, ip_addr_t *multicast_ip);
+sint8 espconn_igmp_leave(ip_addr_t *host_ip, ip_addr_t *multicast_ip);
+
+#endif /* _HOST_SDK_H_ */
@@ -0,0 +1,2 @@
+/* The host stand-in for the SDK's osapi.h; see host_sdk.h */
+#include "host_sdk.h"
@@ -0,0 +1,2 @@
+/* The host stand-in for the SDK's user_interface.h; see host_sdk.h */
+#include "host_sdk.h"
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Checks breakdown_time() against the C library's localtime() from 1970 to
+ * 2200 in a few zones: once walking forwards, as the display does, and once
+ * jumping about so the cached date is thrown away in both directions.
+ */
+#include <osapi.h>
+
+#include "clock.h"
+#include "tz.h"
+#include "host.h"
+#include "ref_localtime.h"
+
+/* Starts a day in, so zones west of Greenwich don't go before 1970 */
+#define SWEEP_FROM	86400ULL
+#define SWEEP_TO	7258118400ULL	/* 2200-01-01 */
+/* Not a divisor of anything, so every time of day gets a look in */
+#define SWEEP_STEP	3593
+
+static const char *zones[] = {
+	"UTC0",
+	"GMT0BST,M3.5.0/1,M10.5.0",
+	"EST5EDT,M3.2.0,M11.1.0",
+	"NZST-12NZDT,M9.5.0,M4.1.0/3",
+	"<+0530>-5:30",
+};
+
+static unsigned int failures;
+
+static void check(const char *zone, uint64_t t)
+{
+	static const char *names[REF_FIELDS] = {
+		"sec", "min", "hour", "mday", "mon", "year", "wday", "yday",
+		"isdst",
+	};
+	int want[REF_FIELDS], got[REF_FIELDS];
+	struct tm tm;
+	int i;
+
+	ref_localtime(t, want);
+	breakdown_time(t, &tm);
+	got[0] = tm.tm_sec;
+	got[1] = tm.tm_min;
+	got[2] = tm.tm_hour;
+	got[3] = tm.tm_mday;
+	got[4] = tm.tm_mon;
+	got[5] = tm.tm_year;
+	got[6] = tm.tm_wday;
+	got[7] = tm.tm_yday;
+	got[8] = tm.tm_isdst;
+
+	for (i = 0; i < REF_FIELDS; i++) {
+		if (got[i] == want[i])
+			continue;
+		if (failures++ < 10)
+			printf("%s at %llu: tm_%s is %d, should be %d\n", zone,
+				(unsigned long long) t, names[i], got[i],
+				want[i]);
+		return;
+	}
+}
+
+int main(void)
+{
+	unsigned long checked = 0;
+	uint64_t t, state = 1;
+	unsigned int z, i;
+
+	host_init();
+
+	for (z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+		ref_tz(zones[z]);
+		CHECK(tz_set(zones[z]));
+
+		for (t = SWEEP_FROM; t < SWEEP_TO; t += SWEEP_STEP) {
+			check(zones[z], t);
+			checked++;
+		}
+
+		for (i = 0; i < 1000000; i++) {
+			state = state * 6364136223846793005ULL +
+				1442695040888963407ULL;
+			t = SWEEP_FROM + (state >> 11) % (SWEEP_TO - SWEEP_FROM);
+			check(zones[z], t);
+			checked++;
+		}
+	}
+
+	printf("%lu times checked, %u wrong\n", checked, failures);
+
+	return failures != 0;
+}
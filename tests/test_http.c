@@ -0,0 +1,296 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Feeds recorded responses to http_parse() whole, split in two at every
+ * point, in three at every pair of points and a byte at a time, and checks
+ * the callbacks see the same thing every time.
+ */
+#include <osapi.h>
+
+#include "http.h"
+#include "host.h"
+
+/* Some of the data has NULs in, so can't be measured with strlen */
+#define BYTES(s)	s, sizeof(s) - 1
+
+struct response {
+	const char *name;
+	bool head;
+	const char *data;
+	unsigned int len;
+	int result;		/* What the last http_parse() returns */
+	uint16_t status;
+	bool keep_alive;
+	/* Headers as "name=value;", "|" for the end of them, then the body */
+	const char *want;
+	unsigned int want_len;
+};
+
+static const struct response responses[] = {
+	{
+		"nginx HEAD of version.txt", true,
+		BYTES("HTTP/1.1 200 OK\r\n"
+		"Server: nginx/1.14.2\r\n"
+		"Date: Sat, 01 Jun 2019 10:00:00 GMT\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 4\r\n"
+		"Last-Modified: Fri, 31 May 2019 21:12:03 GMT\r\n"
+		"Connection: keep-alive\r\n"
+		"ETag: \"5cf19953-4\"\r\n"
+		"ESP8266-Upgrade-Version: 0.2\r\n"
+		"ESP8266-Upgrade-ROM0-MD5: 0123456789abcdef0123456789abcdef\r\n"
+		"\r\n"),
+		HTTP_DONE, 200, true,
+		BYTES("Server=nginx/1.14.2;Date=Sat, 01 Jun 2019 10:00:00 GMT;"
+		"Content-Type=text/plain;Content-Length=4;"
+		"Last-Modified=Fri, 31 May 2019 21:12:03 GMT;"
+		"Connection=keep-alive;ETag=\"5cf19953-4\";"
+		"ESP8266-Upgrade-Version=0.2;"
+		"ESP8266-Upgrade-ROM0-MD5=0123456789abcdef0123456789abcdef;|"),
+	},
+	{
+		"nginx 304", true,
+		BYTES("HTTP/1.1 304 Not Modified\r\n"
+		"Server: nginx/1.14.2\r\n"
+		"ETag: \"5cf19953-4\"\r\n"
+		"\r\n"),
+		HTTP_DONE, 304, true,
+		BYTES("Server=nginx/1.14.2;ETag=\"5cf19953-4\";|"),
+	},
+	{
+		"Apache image with a length, then the next response", false,
+		BYTES("HTTP/1.1 200 OK\r\n"
+		"Server: Apache/2.4.38 (Debian)\r\n"
+		"Content-Length: 12\r\n"
+		"Keep-Alive: timeout=5, max=100\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"\r\n"
+		"\xe9\x04\x02\x00\xff\x00\r\n\x00\x01\x02\x03"
+		"HTTP/1.1 200 OK\r\n"),
+		HTTP_DONE, 200, true,
+		BYTES("Server=Apache/2.4.38 (Debian);Content-Length=12;"
+		"Keep-Alive=timeout=5, max=100;"
+		"Content-Type=application/octet-stream;|"
+		"\xe9\x04\x02\x00\xff\x00\r\n\x00\x01\x02\x03"),
+	},
+	{
+		"chunked, with an extension and a trailer", false,
+		BYTES("HTTP/1.1 200 OK\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"Content-Encoding: heatshrink\r\n"
+		"X-Padded:   spaces   \r\n"
+		"\r\n"
+		"5;name=value\r\n"
+		"hello\r\n"
+		"1A\r\n"
+		"abcdefghijklmnopqrstuvwxyz\r\n"
+		"0\r\n"
+		"X-Trailer: ignored\r\n"
+		"\r\n"),
+		HTTP_DONE, 200, true,
+		BYTES("Transfer-Encoding=chunked;Content-Encoding=heatshrink;"
+		"X-Padded=spaces;|helloabcdefghijklmnopqrstuvwxyz"),
+	},
+	{
+		"100 Continue before the real response", false,
+		BYTES("HTTP/1.1 100 Continue\r\n"
+		"\r\n"
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Length: 3\r\n"
+		"\r\n"
+		"abc"),
+		HTTP_DONE, 200, true,
+		BYTES("Content-Length=3;|abc"),
+	},
+	{
+		"103 Early Hints, whose headers aren't the response's", true,
+		BYTES("HTTP/1.1 103 Early Hints\r\n"
+		"Link: </style.css>; rel=preload\r\n"
+		"Content-Length: 99\r\n"
+		"\r\n"
+		"HTTP/1.1 102 Processing\r\n"
+		"\r\n"
+		"HTTP/1.1 200 OK\r\n"
+		"ESP8266-Upgrade-Version: 1.0\r\n"
+		"\r\n"),
+		HTTP_DONE, 200, true,
+		BYTES("ESP8266-Upgrade-Version=1.0;|"),
+	},
+	{
+		"101 we never asked for", false,
+		BYTES("HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"\r\n"),
+		HTTP_ERROR, 101, true,
+		BYTES(""),
+	},
+	{
+		"206 partial content, Connection: close", false,
+		BYTES("HTTP/1.1 206 Partial Content\r\n"
+		"Content-Range: bytes 4096-4099/8192\r\n"
+		"Content-Length: 4\r\n"
+		"Connection: close\r\n"
+		"\r\n"
+		"WXYZ"),
+		HTTP_DONE, 206, false,
+		BYTES("Content-Range=bytes 4096-4099/8192;Content-Length=4;"
+		"Connection=close;|WXYZ"),
+	},
+	{
+		"Python's http.server, HTTP/1.0 with no length", false,
+		BYTES("HTTP/1.0 200 OK\r\n"
+		"Server: SimpleHTTP/0.6 Python/3.7.3\r\n"
+		"\r\n"
+		"runs until the server hangs up"),
+		HTTP_MORE, 200, false,
+		BYTES("Server=SimpleHTTP/0.6 Python/3.7.3;|"
+		"runs until the server hangs up"),
+	},
+	{
+		"404 with no body, bare LFs", false,
+		BYTES("HTTP/1.0 404 Not Found\n"
+		"Content-Length: 0\n"
+		"\n"),
+		HTTP_DONE, 404, false,
+		BYTES("Content-Length=0;|"),
+	},
+	{
+		"an overlong header gets cut short", true,
+		BYTES("HTTP/1.1 200 OK\r\n"
+		"X-Long: 0123456789012345678901234567890123456789"
+		"0123456789012345678901234567890123456789"
+		"0123456789012345678901234567890123456789\r\n"
+		"\r\n"),
+		HTTP_DONE, 200, true,
+		BYTES("X-Long=0123456789012345678901234567890123456789"
+		"0123456789012345678901234567890123456789"
+		"012345678901234567890123456789012345678;|"),
+	},
+	{
+		"not HTTP", false,
+		BYTES("SSH-2.0-OpenSSH_7.9p1\r\n"),
+		HTTP_ERROR, 0, false,
+		BYTES(""),
+	},
+	{
+		"bad chunk size", false,
+		BYTES("HTTP/1.1 200 OK\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"\r\n"
+		"zz\r\n"),
+		HTTP_ERROR, 200, true,
+		BYTES("Transfer-Encoding=chunked;|"),
+	},
+	{
+		"gzip, which we can't undo", false,
+		BYTES("HTTP/1.1 200 OK\r\n"
+		"Transfer-Encoding: gzip, chunked\r\n"
+		"\r\n"),
+		HTTP_ERROR, 200, true,
+		BYTES(""),
+	},
+};
+
+static char got[1024];
+static unsigned int got_len;
+
+static void record(const void *data, unsigned int len)
+{
+	CHECK(got_len + len <= sizeof(got));
+	os_memcpy(got + got_len, data, len);
+	got_len += len;
+}
+
+static bool header(void *arg, const char *name, const char *value)
+{
+	if (name == NULL) {
+		record("|", 1);
+		return true;
+	}
+	record(name, os_strlen(name));
+	record("=", 1);
+	record(value, os_strlen(value));
+	record(";", 1);
+	return true;
+}
+
+static bool body(void *arg, const uint8_t *data, uint32_t len)
+{
+	record(data, len);
+	return true;
+}
+
+/* Feeds r in pieces ending at each of cuts, then the rest */
+static bool feed(const struct response *r, const char *how,
+	const unsigned int *cuts, int ncuts)
+{
+	unsigned int from = 0, to;
+	struct http_parser p;
+	int i, ret = HTTP_MORE;
+
+	got_len = 0;
+	http_init(&p, r->head, header, body, NULL);
+	for (i = 0; i <= ncuts && ret == HTTP_MORE; i++) {
+		to = i < ncuts ? cuts[i] : r->len;
+		ret = http_parse(&p, r->data + from, to - from);
+		from = to;
+	}
+
+	if (ret == r->result && p.status == r->status &&
+			(ret == HTTP_ERROR || p.keep_alive == r->keep_alive) &&
+			got_len == r->want_len &&
+			os_memcmp(got, r->want, got_len) == 0)
+		return true;
+
+	printf("%s, %s: got %d, status %u, keep alive %d, \"%.*s\"\n",
+		r->name, how, ret, p.status, p.keep_alive, got_len, got);
+	return false;
+}
+
+int main(void)
+{
+	unsigned int cuts[1024];
+	unsigned int i, a, b, fed = 0, failures = 0;
+	const struct response *r;
+
+	host_init();
+
+	for (i = 0; i < sizeof(responses) / sizeof(responses[0]); i++) {
+		r = &responses[i];
+		failures += !feed(r, "whole", NULL, 0);
+
+		for (a = 0; a <= r->len && !failures; a++) {
+			cuts[0] = a;
+			failures += !feed(r, "in two", cuts, 1);
+			for (b = a; b <= r->len && !failures; b++) {
+				cuts[1] = b;
+				failures += !feed(r, "in three", cuts, 2);
+				fed++;
+			}
+		}
+
+		for (a = 0; a < r->len; a++)
+			cuts[a] = a + 1;
+		failures += !feed(r, "a byte at a time", cuts, r->len);
+
+		if (failures)
+			break;
+	}
+
+	printf("%u splits of %u responses, %u wrong\n", fed, i, failures);
+
+	return failures != 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ntp_listen() gets called on every GOT_IP; the NTP multicast group should
+ * be joined once per address, and left when the address changes.
+ */
+#include <osapi.h>
+
+#include "clock.h"
+#include "host.h"
+
+int main(void)
+{
+	host_init();
+	host_map_local(123, 12323);
+
+	ntp_listen();
+	CHECK(host_stats.igmp_joins == 1);
+
+	/* Reconnecting and getting the same lease back */
+	ntp_listen();
+	ntp_listen();
+	CHECK(host_stats.igmp_joins == 1);
+	CHECK(host_stats.igmp_leaves == 0);
+
+	/* A new address */
+	IP4_ADDR(&host_ip_info.ip, 127, 0, 0, 2);
+	ntp_listen();
+	CHECK(host_stats.igmp_joins == 2);
+	CHECK(host_stats.igmp_leaves == 1);
+
+	ntp_listen();
+	CHECK(host_stats.igmp_joins == 2);
+
+	printf("%u joins, %u leaves\n", host_stats.igmp_joins,
+		host_stats.igmp_leaves);
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Jonathan McDowell <noodles@earth.li>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Runs ./ntpserver against a stand-in upstream server, then queries it the
+# way an SNTP client does and checks the answers:
+#
+#   test_ntpserver.py [./ntpserver]
+
+import calendar
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+NTP_UNIX_OFFSET = 2208988800
+NTP_FORMAT = '!BBbbIII8s8s8s8s'
+
+# What the stand-in upstream claims about itself
+UP_STRATUM = 2
+UP_ROOT_DELAY = 0x00000800	# 1/32 s, as 16.16
+UP_ROOT_DISP = 0x00000400
+UP_REF_ID = b'GPS\0'
+# Half an hour before a (made up) leap second at the end of June 2030
+LEAP_EVE = calendar.timegm((2030, 7, 1, 0, 0, 0)) - 1800
+
+
+def to_ntp(t):
+    secs = int(t)
+    return struct.pack('!II', secs + NTP_UNIX_OFFSET,
+                       int((t - secs) * (1 << 32)))
+
+
+def from_ntp(stamp):
+    secs, frac = struct.unpack('!II', stamp)
+    return secs - NTP_UNIX_OFFSET + frac / (1 << 32)
+
+
+def upstream(sock, stratum=UP_STRATUM, leap=0, shift=0):
+    """Answers with the time shift seconds on, warning of leap if set"""
+    while True:
+        try:
+            data, addr = sock.recvfrom(512)
+        except OSError:
+            return
+        recv = time.time() + shift
+        if len(data) < 48 or data[0] & 7 != 3:
+            continue
+        reply = struct.pack(NTP_FORMAT, leap << 6 | (data[0] & 0x38) | 4,
+                            stratum, 6, -20, UP_ROOT_DELAY, UP_ROOT_DISP,
+                            struct.unpack('!I', UP_REF_ID)[0],
+                            to_ntp(recv - 10), data[40:48], to_ntp(recv),
+                            to_ntp(time.time() + shift))
+        sock.sendto(reply, addr)
+
+
+def start_upstream(**kwargs):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('127.0.0.1', 0))
+    threading.Thread(target=upstream, args=(sock,), kwargs=kwargs,
+                     daemon=True).start()
+    return sock
+
+
+def query(port, version=4, timeout=1.0):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(timeout)
+    sent = time.time()
+    stamp = to_ntp(sent)
+    req = struct.pack(NTP_FORMAT, (version << 3) | 3, 0, 4, 0, 0, 0, 0,
+                      bytes(8), bytes(8), bytes(8), stamp)
+    sock.sendto(req, ('127.0.0.1', port))
+    try:
+        data, _ = sock.recvfrom(512)
+    except socket.timeout:
+        return None
+    finally:
+        sock.close()
+    got = time.time()
+    fields = struct.unpack(NTP_FORMAT, data[:48])
+    return {
+        'leap': fields[0] >> 6,
+        'version': (fields[0] >> 3) & 7,
+        'mode': fields[0] & 7,
+        'stratum': fields[1],
+        'poll': fields[2],
+        'precision': fields[3],
+        'root_delay': fields[4],
+        'root_disp': fields[5],
+        'ref_id': fields[6],
+        'ref': from_ntp(fields[7]),
+        'orig': fields[8],
+        'recv': from_ntp(fields[9]),
+        'trans': from_ntp(fields[10]),
+        'sent': stamp,
+        'offset': ((from_ntp(fields[9]) - sent) +
+                   (from_ntp(fields[10]) - got)) / 2,
+    }
+
+
+def free_port():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('127.0.0.1', 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def start(server, up_port):
+    port = free_port()
+    proc = subprocess.Popen([server, '-p', str(port), '-u',
+                             '127.0.0.1:%d' % up_port, '-t', '20'],
+                            stdout=subprocess.PIPE, universal_newlines=True)
+    return proc, port, proc.stdout.readline().strip()
+
+
+def check(what, cond):
+    if not cond:
+        print('FAILED: %s' % what)
+        sys.exit(1)
+
+
+def main():
+    if len(sys.argv) > 2:
+        print('Usage: test_ntpserver.py [ntpserver binary]')
+        sys.exit(2)
+    server = sys.argv[1] if len(sys.argv) == 2 else './ntpserver'
+
+    up = start_upstream()
+
+    # Nobody upstream; an unsynced server must stay quiet
+    proc, port, state = start(server, free_port())
+    try:
+        check('no sync without upstream', state == 'not synced')
+        check('no answer while unsynced', query(port, timeout=0.5) is None)
+    finally:
+        proc.kill()
+        proc.wait()
+
+    proc, port, state = start(server, up.getsockname()[1])
+    try:
+        check('synced from upstream', state == 'synced')
+
+        for version in (3, 4):
+            r = query(port, version)
+            check('v%d answered' % version, r is not None)
+            check('v%d mode' % version, r['mode'] == 4)
+            check('v%d version echoed' % version, r['version'] == version)
+            check('stratum one below upstream',
+                  r['stratum'] == UP_STRATUM + 1)
+            check('no leap warning', r['leap'] == 0)
+            check('origin is our transmit time', r['orig'] == r['sent'])
+            check('ref id is the upstream address',
+                  r['ref_id'] == struct.unpack('!I',
+                                               socket.inet_aton('127.0.0.1'))[0])
+            check('root delay includes upstream\'s',
+                  r['root_delay'] > UP_ROOT_DELAY)
+            check('root dispersion includes upstream\'s',
+                  r['root_disp'] >= UP_ROOT_DISP)
+            check('receive before transmit', r['recv'] <= r['trans'])
+            check('synced recently', abs(r['ref'] - time.time()) < 5)
+            check('offset under 20ms', abs(r['offset']) < 0.02)
+            print('v%d: stratum %d, offset %.3f ms' %
+                  (version, r['stratum'], r['offset'] * 1000))
+
+        check('v0 ignored', query(port, 0, timeout=0.5) is None)
+    finally:
+        proc.kill()
+        proc.wait()
+        up.close()
+
+    # Upstream is as far down as it goes, so we'd be stratum 16: unsynced
+    up = start_upstream(stratum=15)
+    proc, port, state = start(server, up.getsockname()[1])
+    try:
+        check('synced from stratum 15', state == 'synced')
+        check('no answer at stratum 16', query(port, timeout=0.5) is None)
+    finally:
+        proc.kill()
+        proc.wait()
+        up.close()
+
+    # Half way through smearing in a leap second: half a second slow, and
+    # no warning, or clients would go on to add the second themselves
+    shift = LEAP_EVE - time.time()
+    up = start_upstream(leap=1, shift=shift)
+    proc, port, state = start(server, up.getsockname()[1])
+    try:
+        check('synced before the leap', state == 'synced')
+        r = query(port)
+        check('leap: answered', r is not None)
+        check('leap: no warning passed on', r['leap'] == 0)
+        smear = shift - r['offset']
+        check('leap: serving the smeared time', abs(smear - 0.5) < 0.02)
+        print('leap: %.3f s smeared, no warning' % smear)
+    finally:
+        proc.kill()
+        proc.wait()
+        up.close()
+
+
+if __name__ == '__main__':
+    main()
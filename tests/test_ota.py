@@ -0,0 +1,406 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Jonathan McDowell <noodles@earth.li>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Runs ./otaclient against a stand-in upgrade server, serving version.txt,
+# rom1.bin and deltas the way README.md describes, and checks what ends up
+# in the slot and how many connections it took:
+#
+#   test_ota.py [./otaclient]
+
+import hashlib
+import http.server
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import threading
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'tools'))
+from mkdelta import make_delta
+
+# otaclient is a 0.1 build running from slot 0
+NEW_VERSION = '0.2'
+OLD_VERSION = '0.1'
+SLOT_SIZE = 0x6B000
+# What host.c charges for erasing a sector
+ERASE_US = 45000
+
+
+class Upgrade:
+    """What the server has on offer, and what it was asked for"""
+
+    def __init__(self, image, version=NEW_VERSION, md5=True,
+                 keep_alive=True, delta=None, compress=False, config=(),
+                 assets=None, cut=None):
+        self.image = image
+        self.version = version
+        self.md5 = md5
+        self.keep_alive = keep_alive
+        self.delta = delta
+        self.compress = compress
+        self.config = config
+        self.assets = assets
+        # Hang up after this much of each rom1.bin
+        self.cut = cut
+        self.connections = 0
+        self.requests = []
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        super().setup()
+        self.server.upgrade.connections += 1
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def reply(self, status, headers, body=b'', cut=None):
+        up = self.server.upgrade
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header('Content-Length', str(len(body)))
+        if not up.keep_alive:
+            self.send_header('Connection', 'close')
+            self.close_connection = True
+        self.end_headers()
+        if cut is not None:
+            body = body[:cut]
+            self.close_connection = True
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def do_HEAD(self):
+        up = self.server.upgrade
+        up.requests.append('HEAD ' + os.path.basename(self.path))
+        if not self.path.endswith('/version.txt'):
+            self.reply(404, [])
+            return
+        headers = [('ESP8266-Upgrade-Version', up.version)]
+        if up.md5:
+            headers.append(('ESP8266-Upgrade-ROM1-MD5',
+                            hashlib.md5(up.image).hexdigest()))
+        headers += [('ESP8266-Config', c) for c in up.config]
+        if up.assets is not None:
+            headers += [('ESP8266-Upgrade-Assets-Version', '1'),
+                        ('ESP8266-Upgrade-Assets-MD5',
+                         hashlib.md5(up.assets).hexdigest())]
+        self.reply(200, headers, up.version.encode())
+
+    def do_GET(self):
+        up = self.server.upgrade
+        request = 'GET ' + os.path.basename(self.path)
+        if 'Range' in self.headers:
+            request += ' ' + self.headers['Range']
+        up.requests.append(request)
+        cut = None
+        if self.path.endswith('/rom1-from-%s.delta' % OLD_VERSION) and \
+                up.delta is not None:
+            body = up.delta
+        elif self.path.endswith('/rom1.bin'):
+            body = up.image
+            cut = up.cut
+        elif self.path.endswith('/assets.bin') and up.assets is not None:
+            body = up.assets
+        else:
+            self.reply(404, [])
+            return
+        status = 200
+        headers = []
+        m = re.match(r'bytes=(\d+)-$', self.headers.get('Range', ''))
+        if m and int(m.group(1)) < len(body):
+            start = int(m.group(1))
+            headers.append(('Content-Range', 'bytes %d-%d/%d' %
+                            (start, len(body) - 1, len(body))))
+            body = body[start:]
+            status = 206
+        elif up.compress and 'heatshrink' in \
+                self.headers.get('Accept-Encoding', ''):
+            headers.append(('Content-Encoding', 'heatshrink'))
+            body = heatshrink(body)
+        self.reply(status, headers, body, cut)
+
+
+def heatshrink(data):
+    """Greedy, but what heatshrink -e -w 8 -l 4 would make of it"""
+    out = bytearray()
+    acc = bits = 0
+
+    def put(count, value):
+        nonlocal acc, bits
+        acc = acc << count | value
+        bits += count
+        while bits >= 8:
+            bits -= 8
+            out.append(acc >> bits & 0xFF)
+        acc &= (1 << bits) - 1
+
+    i = 0
+    while i < len(data):
+        best = back = 0
+        # Look back through the 256 byte window for the longest match
+        start = max(0, i - 256)
+        end = i + 1
+        for _ in range(32):
+            j = data.rfind(data[i:i + 2], start, end)
+            if j < 0:
+                break
+            n = 0
+            while n < 16 and i + n < len(data) and data[j + n] == data[i + n]:
+                n += 1
+            if n > best:
+                best, back = n, i - j
+            end = j + 1
+        if best >= 2:
+            put(1, 0)
+            put(8, back - 1)
+            put(4, best - 1)
+            i += best
+        else:
+            put(1, 1)
+            put(8, data[i])
+            i += 1
+    if bits:
+        put(8 - bits, 0)
+    return bytes(out)
+
+
+def image(size, seed):
+    """Something with the repetition of real code, so it compresses"""
+    rng = random.Random(seed)
+    out = bytearray()
+    while len(out) < size:
+        if out and rng.random() < 0.6:
+            start = rng.randrange(len(out))
+            out.extend(out[start:start + rng.randrange(4, 64)])
+        else:
+            out.extend(rng.randrange(256) for _ in range(rng.randrange(1, 16)))
+    return bytes(out[:size])
+
+
+def next_version(old, seed):
+    """A few addresses changed and a function added, near the start"""
+    rng = random.Random(seed)
+    new = bytearray(old)
+    for _ in range(8):
+        pos = rng.randrange(2048)
+        new[pos] = (new[pos] + 4) & 0xFF
+    new[4096:4096] = image(300, seed)
+    return bytes(new)
+
+
+def run(client, up, args=(), running=None, target=None, rtc=None):
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+    server.daemon_threads = True
+    # The client hanging up mid-response is something we test for
+    server.handle_error = lambda request, address: None
+    server.upgrade = up
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, 'slot1.bin')
+        args = list(args)
+        if running is not None:
+            args += ['-r', os.path.join(tmp, 'slot0.bin')]
+            with open(args[-1], 'wb') as f:
+                f.write(running)
+        if target is not None:
+            args += ['-t', os.path.join(tmp, 'target.bin')]
+            with open(args[-1], 'wb') as f:
+                f.write(target)
+        if rtc is not None:
+            args += ['-m', rtc]
+        try:
+            proc = subprocess.run([client, '-p',
+                                   str(server.server_address[1]),
+                                   '-o', out] + args,
+                                  stdout=subprocess.PIPE, timeout=60,
+                                  universal_newlines=True)
+        finally:
+            server.shutdown()
+            server.server_close()
+        lines = proc.stdout.strip().split('\n')
+        check('client finished', proc.returncode == 0)
+        stats = dict((k, int(v)) for k, v in
+                     (f.split('=') for f in lines[-1].split()))
+        # "config key=value" or "config key unset", for each -c key
+        stats['config'] = dict(l[7:].partition('=')[::2] for l in lines
+                               if l.startswith('config ') and '=' in l)
+        with open(out, 'rb') as f:
+            stats['slot'] = f.read()
+    return stats
+
+
+def check(what, cond):
+    if not cond:
+        print('FAILED: %s' % what)
+        sys.exit(1)
+
+
+def upgraded(what, stats, want):
+    check(what + ': rebooted', stats['reboots'] == 1)
+    check(what + ': slot holds the image', stats['slot'][:len(want)] == want)
+    # Receive callbacks only queue the data; the flash work comes later
+    check(what + ': no flash work while receiving',
+          stats['recv_flash_us'] == 0)
+    # ...and it's a step at a time, so no tick takes more than an erase
+    check(what + ': one flash step per tick',
+          stats['timer_flash_us'] <= ERASE_US)
+
+
+def main():
+    if len(sys.argv) > 2:
+        print('Usage: test_ota.py [otaclient binary]')
+        sys.exit(2)
+    client = sys.argv[1] if len(sys.argv) == 2 else './otaclient'
+
+    new = image(9 * 4096 + 123, 1)
+
+    # Nothing newer; just the one HEAD
+    up = Upgrade(new, version=OLD_VERSION)
+    stats = run(client, up)
+    check('up to date: no reboot', stats['reboots'] == 0)
+    check('up to date: nothing written', stats['writes'] == 0)
+    check('up to date: only the check', up.requests == ['HEAD version.txt'])
+
+    # Settings from the server; one set then cleared, one too long to trust
+    up = Upgrade(new, version=OLD_VERSION,
+                 config=['ota.path=/clocks/', 'tz=GMT0', 'tz=',
+                         'wifi.password=' + 'x' * 100])
+    stats = run(client, up, ['-c', 'ota.path', '-c', 'tz',
+                             '-c', 'wifi.password'])
+    check('config: set', stats['config'] == {'ota.path': '/clocks/'})
+
+    # Nothing to check the image against, so it isn't worth fetching
+    up = Upgrade(new, md5=False)
+    stats = run(client, up)
+    check('no MD5: no reboot', stats['reboots'] == 0)
+    check('no MD5: nothing written', stats['writes'] == 0)
+    check('no MD5: only the check', up.requests == ['HEAD version.txt'])
+
+    # Check, no delta, then the image, all on one connection
+    up = Upgrade(new)
+    stats = run(client, up)
+    upgraded('keep-alive', stats, new)
+    check('keep-alive: one connection', up.connections == 1 and
+          stats['connects'] == 1)
+    check('keep-alive: check then delta then image', up.requests ==
+          ['HEAD version.txt', 'GET rom1-from-%s.delta' % OLD_VERSION,
+           'GET rom1.bin'])
+    print('keep-alive: %d requests on %d connection' %
+          (len(up.requests), up.connections))
+
+    # New assets first, then the image, still on the one connection
+    up = Upgrade(new, assets=image(5000, 6))
+    stats = run(client, up)
+    upgraded('assets', stats, new)
+    check('assets: one connection', up.connections == 1 and
+          stats['connects'] == 1)
+    check('assets: then the image', up.requests ==
+          ['HEAD version.txt', 'GET assets.bin',
+           'GET rom1-from-%s.delta' % OLD_VERSION, 'GET rom1.bin'])
+
+    # The same, in dribs and drabs
+    up = Upgrade(new)
+    stats = run(client, up, ['-s', '200'])
+    upgraded('small segments', stats, new)
+    check('small segments: one connection', up.connections == 1)
+
+    # A server that hangs up after each response gets reconnected to
+    up = Upgrade(new, keep_alive=False)
+    stats = run(client, up)
+    upgraded('no keep-alive', stats, new)
+    check('no keep-alive: a connection per request',
+          up.connections == len(up.requests) == 3)
+    print('no keep-alive: %d requests on %d connections' %
+          (len(up.requests), up.connections))
+
+    # Slot 1 already has it, from an earlier go; nothing needs writing
+    up = Upgrade(new)
+    stats = run(client, up, target=new)
+    upgraded('already there', stats, new)
+    check('already there: nothing erased or written',
+          stats['erases'] == 0 and stats['writes'] == 0)
+
+    # More in one go than the window allows; dropped, not caught up on
+    up = Upgrade(new)
+    stats = run(client, up, ['-b', '16384'])
+    check('oversized: no reboot', stats['reboots'] == 0)
+    check('oversized: no flash work while receiving',
+          stats['recv_flash_us'] == 0)
+    check('oversized: reconnected until it gave up', up.connections == 6)
+
+    # Cut off mid-image each time; it gets further on each go, then gives up
+    with tempfile.TemporaryDirectory() as tmp:
+        rtc = os.path.join(tmp, 'rtc.bin')
+        up = Upgrade(new, cut=5000)
+        stats = run(client, up, rtc=rtc)
+        check('cut off: no reboot', stats['reboots'] == 0)
+        ranges = [int(r[len('GET rom1.bin bytes='):-1])
+                  for r in up.requests if r.startswith('GET rom1.bin ')]
+        check('cut off: resumed further each time', len(ranges) > 1 and
+              ranges == sorted(set(ranges)) and ranges[0] > 0)
+
+        # After a reset, only what's missing is asked for
+        up = Upgrade(new)
+        stats = run(client, up, target=stats['slot'], rtc=rtc)
+        upgraded('resumed', stats, new)
+        check('resumed: only the rest', up.requests[:-1] ==
+              ['HEAD version.txt'] and up.requests[-1].startswith(
+                  'GET rom1.bin bytes=') and up.requests[-1].endswith('-'))
+        start = int(up.requests[-1][len('GET rom1.bin bytes='):-1])
+        # Where the last go got to, a sector at a time
+        check('resumed: after the last go', start > ranges[-1] and
+              start % 4096 == 0)
+        print('resumed: at %d of %d bytes' % (start, len(new)))
+
+    # Over something else, so every sector needs erasing, a tick apiece
+    up = Upgrade(new)
+    stats = run(client, up, target=image(len(new), 5))
+    upgraded('over another image', stats, new)
+    check('over another image: sectors erased', stats['erases'] == 10)
+
+    up = Upgrade(new, compress=True)
+    stats = run(client, up, ['-s', '500'])
+    upgraded('compressed', stats, new)
+
+    # A delta, mostly one long copy from the running image
+    old = image(9 * 4096 + 123, 2)
+    new = next_version(old, 3)
+    delta = make_delta(old, new)
+    up = Upgrade(new, delta=delta, compress=True)
+    stats = run(client, up, running=old)
+    upgraded('delta', stats, new)
+    check('delta: no full image', up.requests ==
+          ['HEAD version.txt', 'GET rom1-from-%s.delta' % OLD_VERSION])
+    print('delta: %d bytes compressed for a %d byte image' %
+          (len(heatshrink(delta)), len(new)))
+
+    # Patching the wrong image gets the full one instead
+    up = Upgrade(new, delta=delta)
+    stats = run(client, up, running=image(len(old), 4))
+    upgraded('bad delta', stats, new)
+    check('bad delta: then the full image', up.requests[-1] ==
+          'GET rom1.bin')
+
+
+if __name__ == '__main__':
+    main()
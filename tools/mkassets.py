@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Jonathan McDowell <noodles@earth.li>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Builds the blob for the asset partition, in the format assets.c reads.
+#
+#   mkassets.py 2 assets.bin font:text=font-atari.h font:digits=font-clock.h \
+#       anim:spinner=spinner.txt
+#
+# Fonts are taken from the same C headers the firmware builds in, in order,
+# starting at the character in the first /* NN comment (or space). The
+# firmware looks for "text" and "digits".
+#
+# Animations are text: frames of 8 rows, '#' for a lit pixel and anything
+# else for an unlit one, separated by blank lines. A "delay N" line sets how
+# many milliseconds the frames after it stay up (100 to start with) and
+# lines starting ';' are ignored. Frames are padded out to a multiple of 8
+# pixels wide, and stored as the rows that change from one to the next (see
+# anim.c).
+
+import hashlib
+import re
+import struct
+import sys
+
+MAGIC = b'ESPA'
+ASSET_SIZE = 0x8000
+ASSET_MAX = 16
+NAME_LEN = 12
+HEADER = '<4sHHI16s'
+ENTRY = '<12sBBHHHI'
+
+ASSET_FONT = 1
+ASSET_ANIM = 2
+
+GLYPH_STRIDE = 12
+
+
+def pad4(data):
+    return data + b'\0' * (-len(data) % 4)
+
+
+def read_font(filename):
+    with open(filename) as f:
+        text = f.read()
+
+    first = re.search(r'/\*\s*(\d+)\s', text)
+    first = int(first.group(1)) if first else 32
+
+    glyphs = b''
+    for width, bitmap in re.findall(
+            r'\.width\s*=\s*(\d+)\s*,\s*\.bitmap\s*=\s*\{([^}]*)\}', text):
+        rows = [int(v, 0) for v in bitmap.replace(',', ' ').split()]
+        if len(rows) != 8:
+            sys.exit('%s: glyph %d does not have 8 rows' %
+                     (filename, first + len(glyphs) // GLYPH_STRIDE))
+        glyph = bytes([int(width)] + rows)
+        glyphs += glyph + b'\0' * (GLYPH_STRIDE - len(glyph))
+
+    if not glyphs:
+        sys.exit('%s: no glyphs found' % filename)
+
+    return (ASSET_FONT, 0, len(glyphs) // GLYPH_STRIDE, first, GLYPH_STRIDE,
+            glyphs)
+
+
+def read_anim(filename):
+    delay = 100
+    frames = []
+    rows = []
+    with open(filename) as f:
+        for line in f.read().splitlines() + ['']:
+            if line.startswith(';'):
+                continue
+            if line.startswith('delay '):
+                delay = int(line.split()[1])
+                continue
+            if line.strip():
+                rows.append(line.rstrip())
+                continue
+            if rows:
+                if len(rows) != 8:
+                    sys.exit('%s: frame %d has %d rows, not 8' %
+                             (filename, len(frames), len(rows)))
+                frames.append((delay, rows))
+                rows = []
+
+    if not frames:
+        sys.exit('%s: no frames found' % filename)
+
+    width = max(len(row) for _, frame in frames for row in frame)
+    width = (width + 7) & ~7
+    if width > 32:
+        sys.exit('%s: frames are wider than the display' % filename)
+
+    # A byte per 8 pixels across, bit 0 leftmost, like the display
+    data = b''
+    previous = [b'\0' * (width // 8)] * 8
+    for delay, frame in frames:
+        current = []
+        for row in frame:
+            packed = b''
+            for block in range(width // 8):
+                byte = 0
+                for bit in range(8):
+                    x = block * 8 + bit
+                    if x < len(row) and row[x] == '#':
+                        byte |= 1 << bit
+                packed += bytes([byte])
+            current.append(packed)
+
+        changed = [y for y in range(8) if current[y] != previous[y]]
+        data += struct.pack('<HB', delay, sum(1 << y for y in changed))
+        for y in changed:
+            data += current[y]
+        previous = current
+
+    data = pad4(data)
+    if len(data) > 0xFFFF:
+        sys.exit('%s: animation is too long' % filename)
+
+    return (ASSET_ANIM, width, len(frames), 0, len(data), data)
+
+
+def main():
+    if len(sys.argv) < 4:
+        sys.exit('Usage: mkassets.py <version> <output> '
+                 '<font|anim>:<name>=<file>...')
+
+    version = int(sys.argv[1])
+    assets = []
+    for arg in sys.argv[3:]:
+        match = re.match(r'(font|anim):([^=]+)=(.+)$', arg)
+        if not match:
+            sys.exit('Bad asset "%s"' % arg)
+        kind, name, filename = match.groups()
+        if len(name) > NAME_LEN:
+            sys.exit('Name "%s" is too long' % name)
+        if kind == 'font':
+            assets.append((name, read_font(filename)))
+        else:
+            assets.append((name, read_anim(filename)))
+
+    if len(assets) > ASSET_MAX:
+        sys.exit('Too many assets (%d at most)' % ASSET_MAX)
+
+    offset = struct.calcsize(HEADER) + len(assets) * struct.calcsize(ENTRY)
+    directory = b''
+    data = b''
+    for name, (kind, width, count, first, stride, blob) in assets:
+        directory += struct.pack(ENTRY, name.encode(), kind, width, count,
+                                 first, stride, offset + len(data))
+        data += pad4(blob)
+
+    body = directory + data
+    length = struct.calcsize(HEADER) + len(body)
+    if length > ASSET_SIZE:
+        sys.exit('Assets are %d bytes; only %d fit' % (length, ASSET_SIZE))
+
+    header = struct.pack(HEADER, MAGIC, version, len(assets), length,
+                         hashlib.md5(body).digest())
+
+    with open(sys.argv[2], 'wb') as f:
+        f.write(header + body)
+    print('%s: version %d, %d assets, %d bytes (%s)' %
+          (sys.argv[2], version, len(assets), length,
+           hashlib.md5(header + body).hexdigest()))
+
+
+if __name__ == '__main__':
+    main()
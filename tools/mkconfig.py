@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Jonathan McDowell <noodles@earth.li>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Builds an image of the config store, in the format config.c reads, so a
+# site's settings can be flashed alongside a generic firmware build.
+#
+#   mkconfig.py config.bin wifi.ssid="My Wifi" wifi.password=secret \
+#       tz=CET-1CEST,M3.5.0,M10.5.0/3
+#
+# The image covers the whole store (the first sector holds the settings, the
+# rest are left erased), so writing it replaces anything set before.
+
+import struct
+import sys
+
+MAGIC = 0x43505345
+SECTOR_SIZE = 0x1000
+SECTORS = 4
+KEY_LEN = 31
+VALUE_LEN = 255
+MAX_KEYS = 32
+# What the firmware has room for; a longer value is ignored for the default
+LIMITS = {
+    b'wifi.ssid': 32,
+    b'wifi.password': 64,
+    b'tz': 63,
+    b'ntp.server': 63,
+    b'ota.host': 63,
+    b'ota.path': 63,
+}
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xFFFF
+    return crc
+
+
+def record(key, value):
+    body = bytes([len(key), len(value)]) + key + value
+    rec = struct.pack('<H', crc16(body)) + body
+    return rec + b'\xff' * (-len(rec) % 4)
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('Usage: mkconfig.py <output> <key>=<value>...')
+
+    settings = {}
+    for arg in sys.argv[2:]:
+        if '=' not in arg:
+            sys.exit('Bad setting "%s"' % arg)
+        key, value = arg.split('=', 1)
+        key, value = key.encode(), value.encode()
+        if not 0 < len(key) <= KEY_LEN:
+            sys.exit('Key "%s" must be 1 to %d bytes' % (key.decode(),
+                                                       KEY_LEN))
+        limit = LIMITS.get(key, VALUE_LEN)
+        if len(value) > limit:
+            sys.exit('Value for "%s" is over %d bytes' % (key.decode(),
+                                                        limit))
+        settings[key] = value
+
+    if len(settings) > MAX_KEYS:
+        sys.exit('Too many settings (%d at most)' % MAX_KEYS)
+
+    data = struct.pack('<II', MAGIC, 1)
+    for key, value in settings.items():
+        data += record(key, value)
+    # config.c keeps live records to half a sector so compaction always fits
+    if len(data) > SECTOR_SIZE // 2:
+        sys.exit('Settings take %d bytes; only %d fit' %
+                 (len(data), SECTOR_SIZE // 2))
+
+    with open(sys.argv[1], 'wb') as f:
+        f.write(data + b'\xff' * (SECTOR_SIZE * SECTORS - len(data)))
+    print('%s: %d settings, %d bytes used' %
+          (sys.argv[1], len(settings), len(data)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Jonathan McDowell <noodles@earth.li>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Builds a delta from the image a device is running to the one it should
+# be upgraded to, in the format delta.c understands. For a device running
+# 0.1 from slot 0 and going to 0.2:
+#
+#   mkdelta.py old/rom0.bin rom1.bin rom1-from-0.1.delta
+#
+# Matches are found a block at a time and then stretched out for as long
+# as most of the bytes still agree, bsdiff style, so that code which has
+# only moved or had an address or two change becomes an 'A' record of
+# mostly zeroes.
+
+import struct
+import sys
+
+BLOCK = 8		# Bytes that must match exactly to start a match
+MAX_CANDIDATES = 16	# Places in the old image we try for each block
+SLACK = 16		# Give up extending when this many bytes in a row...
+SLACK_MATCH = 8		# ...have fewer than this many matches
+
+
+def index_blocks(old):
+    index = {}
+    for i in range(len(old) - BLOCK + 1):
+        entries = index.setdefault(old[i:i + BLOCK], [])
+        if len(entries) < MAX_CANDIDATES:
+            entries.append(i)
+    return index
+
+
+def extend(old, new, src, dst):
+    """How far a match at old[src], new[dst] goes, allowing some noise"""
+    length = 0
+    last_good = 0
+    recent = []
+    while src + length < len(old) and dst + length < len(new):
+        same = old[src + length] == new[dst + length]
+        recent.append(same)
+        if len(recent) > SLACK:
+            recent.pop(0)
+        length += 1
+        if same:
+            last_good = length
+        if len(recent) == SLACK and sum(recent) < SLACK_MATCH:
+            break
+    return last_good
+
+
+def exact(old, new, src, dst, length):
+    return old[src:src + length] == new[dst:dst + length]
+
+
+def make_delta(old, new):
+    index = index_blocks(old)
+    out = bytearray(b'ESPD' + struct.pack('<I', len(new)))
+    literal = bytearray()
+
+    def flush_literal():
+        if literal:
+            out.extend(b'I' + struct.pack('<I', len(literal)) + literal)
+            literal.clear()
+
+    dst = 0
+    last_src = 0
+    while dst < len(new):
+        best_len = 0
+        best_src = 0
+        # Try just after the last match first; it's usually right
+        candidates = [last_src] + index.get(new[dst:dst + BLOCK], [])
+        for src in candidates:
+            if not exact(old, new, src, dst, BLOCK):
+                continue
+            length = extend(old, new, src, dst)
+            if length > best_len:
+                best_len = length
+                best_src = src
+
+        if best_len < BLOCK:
+            literal.append(new[dst])
+            dst += 1
+            continue
+
+        flush_literal()
+        if exact(old, new, best_src, dst, best_len):
+            out.extend(b'C' + struct.pack('<II', best_src, best_len))
+        else:
+            diff = bytes((new[dst + i] - old[best_src + i]) & 0xFF
+                         for i in range(best_len))
+            out.extend(b'A' + struct.pack('<II', best_src, best_len) + diff)
+        dst += best_len
+        last_src = best_src + best_len
+
+    flush_literal()
+    return bytes(out)
+
+
+def apply_delta(old, delta):
+    """What the device does; used to check our work"""
+    (length,) = struct.unpack_from('<I', delta, 4)
+    pos = 8
+    new = bytearray()
+    while pos < len(delta):
+        op = delta[pos:pos + 1]
+        if op == b'I':
+            (count,) = struct.unpack_from('<I', delta, pos + 1)
+            pos += 5
+            new.extend(delta[pos:pos + count])
+            pos += count
+        else:
+            src, count = struct.unpack_from('<II', delta, pos + 1)
+            pos += 9
+            if op == b'C':
+                new.extend(old[src:src + count])
+            else:
+                new.extend((old[src + i] + delta[pos + i]) & 0xFF
+                           for i in range(count))
+                pos += count
+    assert len(new) == length
+    return bytes(new)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit('Usage: mkdelta.py <running image> <new image> <delta>')
+
+    with open(sys.argv[1], 'rb') as f:
+        old = f.read()
+    with open(sys.argv[2], 'rb') as f:
+        new = f.read()
+
+    delta = make_delta(old, new)
+    if apply_delta(old, delta) != new:
+        sys.exit('Delta does not reproduce the new image')
+
+    with open(sys.argv[3], 'wb') as f:
+        f.write(delta)
+    print('%s: %d bytes (%d%% of %d)' % (sys.argv[3], len(delta),
+          len(delta) * 100 // len(new), len(new)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Timezone handling, driven by a POSIX TZ string such as
+ * "GMT0BST,M3.5.0/1,M10.5.0" or "EST5EDT,M3.2.0,M11.1.0". The string is
+ * parsed once; the UTC instants DST starts and ends are then worked out
+ * for a whole year at a time, so converting a time is a compare and an
+ * add.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <osapi.h>
+
+#include "tz.h"
+
+enum tz_rule_type {
+	TZ_JULIAN,	/* Jn: 1-365, Feb 29th never counted */
+	TZ_ZERO,	/* n: 0-365, Feb 29th counted */
+	TZ_MONTH,	/* Mm.w.d: day d of week w of month m */
+};
+
+struct tz_rule {
+	enum tz_rule_type type;
+	uint16_t day;
+	uint8_t mon, week, wday;
+	int32_t time;		/* Local seconds after midnight */
+};
+
+static struct {
+	int32_t std_offset;	/* Seconds to add to UTC to get local time */
+	int32_t dst_offset;
+	bool has_dst;
+	struct tz_rule start, end;
+
+	/* The year (in UTC) we've worked the transitions out for */
+	uint64_t year_start, year_end;
+	uint64_t dst_start, dst_end;
+
+	/* Bumped on every tz_set() so callers can drop anything cached */
+	uint32_t serial;
+} tz;
+
+static bool ICACHE_FLASH_ATTR is_leap_year(uint32_t year)
+{
+	return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+}
+
+/* From http://howardhinnant.github.io/date_algorithms.html; mon is 1-12 */
+static uint32_t ICACHE_FLASH_ATTR days_from_civil(uint32_t year,
+	uint32_t mon, uint32_t mday)
+{
+	uint32_t era, yoe, doy, doe;
+
+	year -= mon <= 2;
+	era = year / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/* Days since 1970 of the day a rule falls on in the given year */
+static uint32_t ICACHE_FLASH_ATTR tz_rule_day(const struct tz_rule *rule,
+	uint32_t year)
+{
+	static const uint8_t mdays[] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+	};
+	uint32_t days, first, mday, len;
+
+	switch (rule->type) {
+	case TZ_JULIAN:
+		days = days_from_civil(year, 1, 1) + rule->day - 1;
+		if (is_leap_year(year) && rule->day >= 60)
+			days++;
+		return days;
+	case TZ_ZERO:
+		return days_from_civil(year, 1, 1) + rule->day;
+	case TZ_MONTH:
+	default:
+		first = days_from_civil(year, rule->mon, 1);
+		/* 1970-01-01 was a Thursday */
+		mday = 1 + (rule->wday + 7 - (first + 4) % 7) % 7 +
+			(rule->week - 1) * 7;
+		len = mdays[rule->mon - 1] +
+			(rule->mon == 2 && is_leap_year(year));
+		/* Week 5 means the last one, which might be the 4th */
+		while (mday > len)
+			mday -= 7;
+		return first + mday - 1;
+	}
+}
+
+static void ICACHE_FLASH_ATTR tz_cache_year(uint64_t utc)
+{
+	uint32_t days = utc / 86400;
+	uint32_t year;
+
+	/* Guess high, then walk back */
+	year = 1970 + days / 365;
+	while (days_from_civil(year, 1, 1) > days)
+		year--;
+
+	tz.year_start = days_from_civil(year, 1, 1) * 86400ULL;
+	tz.year_end = days_from_civil(year + 1, 1, 1) * 86400ULL;
+
+	/* The start rule is in standard time, the end rule in DST */
+	tz.dst_start = tz_rule_day(&tz.start, year) * 86400ULL +
+		tz.start.time - tz.std_offset;
+	tz.dst_end = tz_rule_day(&tz.end, year) * 86400ULL +
+		tz.end.time - tz.dst_offset;
+}
+
+/*
+ * Returns the number of seconds to add to the supplied UTC time to get
+ * local time, and whether DST is in effect.
+ */
+int32_t ICACHE_FLASH_ATTR tz_offset(uint64_t utc, bool *isdst)
+{
+	bool dst;
+
+	if (!tz.has_dst) {
+		*isdst = false;
+		return tz.std_offset;
+	}
+
+	if (utc < tz.year_start || utc >= tz.year_end)
+		tz_cache_year(utc);
+
+	if (tz.dst_start < tz.dst_end) {
+		dst = utc >= tz.dst_start && utc < tz.dst_end;
+	} else {
+		/* Southern hemisphere; DST spans the new year */
+		dst = utc >= tz.dst_start || utc < tz.dst_end;
+	}
+
+	*isdst = dst;
+	return dst ? tz.dst_offset : tz.std_offset;
+}
+
+/*
+ * Returns the UTC time at which the offset in effect at utc next changes,
+ * so callers can cache tz_offset()'s answer until then. The end of the
+ * year counts as a change; it's when we recalculate.
+ */
+uint64_t ICACHE_FLASH_ATTR tz_valid_until(uint64_t utc)
+{
+	uint64_t until;
+
+	if (!tz.has_dst)
+		return UINT64_MAX;
+
+	if (utc < tz.year_start || utc >= tz.year_end)
+		tz_cache_year(utc);
+
+	until = tz.year_end;
+	if (tz.dst_start > utc && tz.dst_start < until)
+		until = tz.dst_start;
+	if (tz.dst_end > utc && tz.dst_end < until)
+		until = tz.dst_end;
+
+	return until;
+}
+
+uint32_t ICACHE_FLASH_ATTR tz_serial(void)
+{
+	return tz.serial;
+}
+
+static const char ICACHE_FLASH_ATTR *tz_parse_num(const char *p, int min,
+	int max, int *val)
+{
+	int num = 0;
+
+	if (*p < '0' || *p > '9')
+		return NULL;
+	while (*p >= '0' && *p <= '9')
+		num = num * 10 + (*p++ - '0');
+	if (num < min || num > max)
+		return NULL;
+
+	*val = num;
+	return p;
+}
+
+static const char ICACHE_FLASH_ATTR *tz_parse_name(const char *p)
+{
+	const char *start;
+
+	if (*p == '<') {
+		while (*p && *p != '>')
+			p++;
+		return *p ? p + 1 : NULL;
+	}
+
+	start = p;
+	while ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))
+		p++;
+
+	return (p - start) >= 3 ? p : NULL;
+}
+
+/* [+-]hh[:mm[:ss]] */
+static const char ICACHE_FLASH_ATTR *tz_parse_time(const char *p,
+	int32_t *secs)
+{
+	int hh, mm = 0, ss = 0;
+	bool neg = false;
+
+	if (*p == '+' || *p == '-')
+		neg = (*p++ == '-');
+
+	if (!(p = tz_parse_num(p, 0, 167, &hh)))
+		return NULL;
+	if (*p == ':' && !(p = tz_parse_num(p + 1, 0, 59, &mm)))
+		return NULL;
+	if (*p == ':' && !(p = tz_parse_num(p + 1, 0, 59, &ss)))
+		return NULL;
+
+	*secs = hh * 3600 + mm * 60 + ss;
+	if (neg)
+		*secs = -*secs;
+
+	return p;
+}
+
+/* Jn, n or Mm.w.d, optionally followed by /time */
+static const char ICACHE_FLASH_ATTR *tz_parse_rule(const char *p,
+	struct tz_rule *rule)
+{
+	int mon, week, wday, day;
+
+	if (*p == 'M') {
+		if (!(p = tz_parse_num(p + 1, 1, 12, &mon)) || *p != '.' ||
+			!(p = tz_parse_num(p + 1, 1, 5, &week)) || *p != '.' ||
+			!(p = tz_parse_num(p + 1, 0, 6, &wday)))
+			return NULL;
+		rule->type = TZ_MONTH;
+		rule->mon = mon;
+		rule->week = week;
+		rule->wday = wday;
+	} else if (*p == 'J') {
+		if (!(p = tz_parse_num(p + 1, 1, 365, &day)))
+			return NULL;
+		rule->type = TZ_JULIAN;
+		rule->day = day;
+	} else {
+		if (!(p = tz_parse_num(p, 0, 365, &day)))
+			return NULL;
+		rule->type = TZ_ZERO;
+		rule->day = day;
+	}
+
+	rule->time = 2 * 3600;
+	if (*p == '/' && !(p = tz_parse_time(p + 1, &rule->time)))
+		return NULL;
+
+	return p;
+}
+
+static bool ICACHE_FLASH_ATTR tz_parse(const char *p)
+{
+	int32_t offset;
+
+	os_memset(&tz, 0, sizeof(tz));
+
+	/* POSIX offsets are the other way round: west of UTC is positive */
+	if (!(p = tz_parse_name(p)) || !(p = tz_parse_time(p, &offset)))
+		return false;
+	tz.std_offset = -offset;
+
+	if (*p == '\0')
+		return true;
+
+	if (!(p = tz_parse_name(p)))
+		return false;
+	tz.dst_offset = tz.std_offset + 3600;
+	if (*p != ',' && *p != '\0') {
+		if (!(p = tz_parse_time(p, &offset)))
+			return false;
+		tz.dst_offset = -offset;
+	}
+
+	if (*p == '\0') {
+		/* No rules given; use the US ones like glibc does */
+		tz.start.type = tz.end.type = TZ_MONTH;
+		tz.start.mon = 3;
+		tz.start.week = 2;
+		tz.end.mon = 11;
+		tz.end.week = 1;
+		tz.start.time = tz.end.time = 2 * 3600;
+	} else if (*p != ',' || !(p = tz_parse_rule(p + 1, &tz.start)) ||
+			*p != ',' || !(p = tz_parse_rule(p + 1, &tz.end)) ||
+			*p != '\0') {
+		return false;
+	}
+
+	tz.has_dst = true;
+	return true;
+}
+
+/*
+ * Set the timezone from a POSIX TZ string. If it can't be parsed we fall
+ * back to UTC.
+ */
+bool ICACHE_FLASH_ATTR tz_set(const char *str)
+{
+	uint32_t serial = tz.serial + 1;
+	bool ok;
+
+	ok = tz_parse(str);
+	if (!ok) {
+		os_printf("Couldn't parse timezone '%s', using UTC.\n", str);
+		os_memset(&tz, 0, sizeof(tz));
+	}
+	tz.serial = serial;
+
+	return ok;
+}
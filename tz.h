@@ -0,0 +1,25 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TZ_H_
+#define _TZ_H_
+
+bool ICACHE_FLASH_ATTR tz_set(const char *tz);
+int32_t ICACHE_FLASH_ATTR tz_offset(uint64_t utc, bool *isdst);
+uint64_t ICACHE_FLASH_ATTR tz_valid_until(uint64_t utc);
+uint32_t ICACHE_FLASH_ATTR tz_serial(void);
+
+#endif /* _TZ_H_ */
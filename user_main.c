@@ -18,47 +18,80 @@
 #include <osapi.h>
 #include <os_type.h>
 #include <user_interface.h>
+#include <upgrade.h>
 
 #include "project_config.h"
 
+#include "anim.h"
+#include "assets.h"
 #include "clock.h"
+#include "config.h"
+#include "heapstat.h"
 #include "max7219.h"
 #include "ota.h"
 #include "spi.h"
+#include "tz.h"
+#include "wificache.h"
+
+/* The big digits for the time */
+#include "font-clock.h"
+
+#ifndef CFG_TZ
+/* UK time; see tzset(3) for the format */
+#define CFG_TZ "GMT0BST,M3.5.0/1,M10.5.0"
+#endif
+
+/* Give up timing the boot if we haven't synced after this long */
+#define BOOT_CHECK_MS		100
+#define BOOT_CHECK_MAX_MS	60000
 
 struct station_config wificfg;
 static os_timer_t update_timer;
 static os_timer_t ntp_timer;
 
-static const struct fontchar clocknums[] = {
-	{ .width = 5,
-	  .bitmap = { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e } },
-	{ .width = 3,
-	  .bitmap = { 0x02, 0x03, 0x02, 0x02, 0x02, 0x02, 0x02, 0x07 } },
-	{ .width = 5,
-	  .bitmap = { 0x0e, 0x11, 0x10, 0x10, 0x08, 0x04, 0x02, 0x1f } },
-	{ .width = 5,
-	  .bitmap = { 0x0e, 0x11, 0x10, 0x0c, 0x10, 0x10, 0x11, 0x0e } },
-	{ .width = 6,
-	  .bitmap = { 0x10, 0x18, 0x14, 0x12, 0x11, 0x3f, 0x10, 0x10 } },
-	{ .width = 5,
-	  .bitmap = { 0x1f, 0x01, 0x01, 0x0f, 0x10, 0x10, 0x11, 0x0e } },
-	{ .width = 5,
-	  .bitmap = { 0x0e, 0x11, 0x01, 0x0f, 0x11, 0x11, 0x11, 0x0e } },
-	{ .width = 5,
-	  .bitmap = { 0x1f, 0x10, 0x10, 0x08, 0x04, 0x02, 0x02, 0x02 } },
-	{ .width = 5,
-	  .bitmap = { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x11, 0x0e } },
-	{ .width = 5,
-	  .bitmap = { 0x0e, 0x11, 0x11, 0x11, 0x1e, 0x10, 0x11, 0x0e } }
-};
+/* How long it took to get the right time up after boot, in ms */
+static struct {
+	uint64_t sync;		/* clock_last_sync() as we booted */
+	uint32_t connected;
+	uint32_t got_ip;
+	os_timer_t timer;
+} boot;
+
+#ifndef CFG_LOW_POWER
+static void ICACHE_FLASH_ATTR anim_done(void);
+#endif
 
 void ICACHE_FLASH_ATTR update_func(void *arg)
 {
 	static bool ind = false;
+#ifndef CFG_LOW_POWER
+	static uint8_t chimed = 0xFF;
+#endif
+	const struct asset_entry *asset;
 	uint8_t hour, mins;
 	uint8_t digits[4], position[4];
+	struct fontchar glyph[4];
 	struct tm curtime;
+	int i;
+
+	if (anim_playing()) {
+		/* anim_done() will bring us back */
+		return;
+	}
+
+	breakdown_time(get_time(), &curtime);
+	mins = curtime.tm_min;
+	hour = curtime.tm_hour;
+
+#ifndef CFG_LOW_POWER
+	/* Chime on the hour, if there's an animation for it */
+	if (clock_is_set() && mins == 0 && hour != chimed) {
+		chimed = hour;
+		if (anim_play("hourly", anim_done)) {
+			return;
+		}
+	}
+#endif
 
 	max7219_clear();
 	ind = !ind;
@@ -75,52 +108,105 @@ void ICACHE_FLASH_ATTR update_func(void *arg)
 		max7219_set_pixel(16, 6, true);
 	}
 
-	breakdown_time(get_time(), &curtime);
-	mins = curtime.tm_min;
-	hour = curtime.tm_hour;
-
 	digits[0] = hour / 10;
 	digits[1] = hour % 10;
 	digits[2] = mins / 10;
 	digits[3] = mins % 10;
 
+	asset = asset_find("digits", ASSET_FONT);
+	for (i = 0; i < 4; i++) {
+		if (asset == NULL ||
+				!asset_glyph(asset, '0' + digits[i], &glyph[i])) {
+			glyph[i] = clocknums[digits[i]];
+		}
+	}
+
 	/*
 	 * We want our numbers to use as much of the LED matrix as possible,
 	 * and the displayed time to be centred on the display, so we do our
 	 * own positioning and blitting instead of using max7219_print.
 	 */
-	position[1] = 14 - clocknums[digits[1]].width;
-	position[0] = position[1] - clocknums[digits[0]].width - 1;
+	position[1] = 14 - glyph[1].width;
+	position[0] = position[1] - glyph[0].width - 1;
 	position[2] = 18;
-	position[3] = position[2] + clocknums[digits[2]].width + 1;
+	position[3] = position[2] + glyph[2].width + 1;
 
-	max7219_blit(position[0], 0, clocknums[digits[0]].bitmap,
-		clocknums[digits[0]].width, 8);
-	max7219_blit(position[1], 0, clocknums[digits[1]].bitmap,
-		clocknums[digits[1]].width, 8);
-	max7219_blit(position[2], 0, clocknums[digits[2]].bitmap,
-		clocknums[digits[2]].width, 8);
-	max7219_blit(position[3], 0, clocknums[digits[3]].bitmap,
-		clocknums[digits[3]].width, 8);
+	for (i = 0; i < 4; i++) {
+		max7219_blit(position[i], 0, glyph[i].bitmap, glyph[i].width,
+			8);
+	}
 
 	max7219_show();
+
+	heapstat_sample();
 }
 
+#ifndef CFG_LOW_POWER
+/* Put the time (or that we're still starting) back after an animation */
+static void ICACHE_FLASH_ATTR anim_done(void)
+{
+	if (clock_is_set()) {
+		update_func(NULL);
+	} else {
+		max7219_clear();
+		max7219_print("Booting");
+		max7219_show();
+	}
+}
+#endif
+
 void ICACHE_FLASH_ATTR ntp_func(void *arg)
 {
+	heapstat_print();
+	clock_print_stats();
 	ntp_get_time();
 }
 
+/* Show the time as soon as we've synced, and report how long it took */
+static void ICACHE_FLASH_ATTR boot_check(void *arg)
+{
+	uint32_t now = system_get_time() / 1000;
+
+	if (clock_last_sync() == boot.sync) {
+		if (now > BOOT_CHECK_MAX_MS) {
+			os_timer_disarm(&boot.timer);
+		}
+		return;
+	}
+
+	os_timer_disarm(&boot.timer);
+	update_func(NULL);
+	os_printf("Boot: associated at %u ms, address at %u ms (%s), "
+		"synced at %u ms.\n",
+		boot.connected, boot.got_ip, wificache_how(), now);
+}
+
 void ICACHE_FLASH_ATTR wifi_callback(System_Event_t *evt)
 {
+	wificache_event(evt);
+
 	switch (evt->event) {
 	case EVENT_STAMODE_CONNECTED:
+		if (boot.connected == 0) {
+			boot.connected = system_get_time() / 1000;
+		}
+		/* Fall through */
 	case EVENT_STAMODE_DISCONNECTED:
 		os_timer_disarm(&ntp_timer);
+		ota_unschedule();
 		break;
 	case EVENT_STAMODE_GOT_IP:
+		if (boot.got_ip == 0) {
+			boot.got_ip = system_get_time() / 1000;
+		}
+		ntp_listen();
 		ntp_get_time();
+#ifdef CFG_LOW_POWER
+		/* We're not awake long enough to wait for the schedule */
 		ota_check();
+#else
+		ota_schedule();
+#endif
 		os_timer_disarm(&ntp_timer);
 		os_timer_setfn(&ntp_timer, ntp_func, NULL);
 		os_timer_arm(&ntp_timer, 3600 * 1000 /* Hourly */, 1);
@@ -129,22 +215,80 @@ void ICACHE_FLASH_ATTR wifi_callback(System_Event_t *evt)
 	}
 }
 
+#ifdef CFG_LOW_POWER
+/*
+ * Battery builds wake once a minute to redraw the display and go straight
+ * back to sleep, only bringing up wifi when the last sync is getting old.
+ * GPIO16 must be wired to RST for the wake up to happen.
+ */
+#define LOW_POWER_SYNC_INTERVAL	(6 * 3600)
+#define LOW_POWER_AWAKE_MS	30000
+#define LOW_POWER_UPGRADE_MS	(5 * 60 * 1000)
+#define LOW_POWER_POLL_MS	500
+
+static os_timer_t sleep_timer;
+
+static bool ICACHE_FLASH_ATTR lowpower_need_sync(uint64_t when)
+{
+	return !clock_is_set() ||
+		when - clock_last_sync() >= LOW_POWER_SYNC_INTERVAL;
+}
+
+static void ICACHE_FLASH_ATTR lowpower_sleep(void)
+{
+	uint64_t now = get_time();
+	uint32_t secs = 60 - now % 60;
+
+	/* Only power up the radio when we wake if we're going to use it */
+	system_deep_sleep_set_option(lowpower_need_sync(now + secs) ? 1 : 4);
+	clock_save();
+	system_deep_sleep((uint64_t) secs * 1000000);
+}
+
+static void ICACHE_FLASH_ATTR lowpower_check(void *arg)
+{
+	static uint32_t awake;
+
+	awake += LOW_POWER_POLL_MS;
+
+	/* Stay up until we've synced or given up, and let upgrades finish */
+	if (system_upgrade_flag_check() == UPGRADE_FLAG_START &&
+			awake < LOW_POWER_UPGRADE_MS) {
+		return;
+	}
+	if (clock_last_sync() == boot.sync && awake < LOW_POWER_AWAKE_MS) {
+		return;
+	}
+
+	os_timer_disarm(&sleep_timer);
+	update_func(NULL);
+	lowpower_sleep();
+}
+#endif
+
 void ICACHE_FLASH_ATTR wifi_init(void)
 {
-	wificfg.bssid_set = 0;
-	os_memcpy(&wificfg.ssid, CFG_WIFI_SSID,
-		os_strlen(CFG_WIFI_SSID));
-	os_memcpy(&wificfg.password, CFG_WIFI_PASSWORD,
-		os_strlen(CFG_WIFI_PASSWORD));
+	/* Room for the NUL, which the station config doesn't need */
+	char ssid[sizeof(wificfg.ssid) + 1];
+	char password[sizeof(wificfg.password) + 1];
+
+	config_get_default("wifi.ssid", ssid, sizeof(ssid), CFG_WIFI_SSID);
+	config_get_default("wifi.password", password, sizeof(password),
+		CFG_WIFI_PASSWORD);
+
+	os_memcpy(&wificfg.ssid, ssid, os_strlen(ssid));
+	os_memcpy(&wificfg.password, password, os_strlen(password));
 
 	wifi_station_set_hostname("esp8266-clock");
 	wifi_set_opmode(STATION_MODE);
-	wifi_station_set_config(&wificfg);
-
 	wifi_set_event_handler_cb(wifi_callback);
+	/* Straight to the AP from last time if we can */
+	wificache_connect(&wificfg);
 }
 
 #define SYSTEM_PARTITION_CUSTOMER_PRIV_PARAM SYSTEM_PARTITION_CUSTOMER_BEGIN
+#define SYSTEM_PARTITION_ASSETS (SYSTEM_PARTITION_CUSTOMER_BEGIN + 1)
+#define SYSTEM_PARTITION_CONFIG (SYSTEM_PARTITION_CUSTOMER_BEGIN + 2)
 
 void user_pre_init(void)
 {
@@ -155,17 +299,26 @@ void user_pre_init(void)
 		{ SYSTEM_PARTITION_RF_CAL,		0xFB000, 0x01000 },
 		{ SYSTEM_PARTITION_PHY_DATA,		0xFC000, 0x01000 },
 		{ SYSTEM_PARTITION_SYSTEM_PARAMETER,	0xFD000, 0x03000 },
+		{ SYSTEM_PARTITION_ASSETS,		ASSET_BASE, ASSET_SIZE },
+		{ SYSTEM_PARTITION_CONFIG,		CONFIG_BASE,
+			CONFIG_SECTORS * SPI_FLASH_SEC_SIZE },
 	};
 	uint32_t map = system_get_flash_size_map();
+	int i;
 
 	switch (map) {
 	case FLASH_SIZE_8M_MAP_512_512: /* 1MB /  8Mb */
 		break;
 	case FLASH_SIZE_32M_MAP_512_512: /* 4MB / 32Mb */
 		/* Fix up system partition table bits */
-		p_table[5].addr += 0x300000;
-		p_table[6].addr += 0x300000;
-		p_table[7].addr += 0x300000;
+		for (i = 0; i < sizeof(p_table)/sizeof(p_table[0]); i++) {
+			if (p_table[i].type == SYSTEM_PARTITION_RF_CAL ||
+				p_table[i].type == SYSTEM_PARTITION_PHY_DATA ||
+				p_table[i].type ==
+					SYSTEM_PARTITION_SYSTEM_PARAMETER) {
+				p_table[i].addr += 0x300000;
+			}
+		}
 		break;
 	default:
 		os_printf("Unknown flash map %u\n", map);
@@ -182,20 +335,48 @@ void user_pre_init(void)
 
 void user_init(void)
 {
+	char tz[64];
+
 	/* Fix up UART0 baud rate */
 	uart_div_modify(0, UART_CLK_FREQ / 115200);
 	os_printf("Starting up.");
 
+	config_init();
+	config_get_default("tz", tz, sizeof(tz), CFG_TZ);
+	tz_set(tz);
 	rtc_init();
+	boot.sync = clock_last_sync();
 	gpio_init();
+	asset_init();
 
 	spi_init();
 	max7219_init(BIT12);		/* GPIO12 is CS */
-	max7219_print("Booting");
-	max7219_show();
+	if (clock_is_set()) {
+		/* We know the time from before a reset; show it right away */
+		update_func(NULL);
+	} else {
+		max7219_print("Booting");
+		max7219_show();
+	}
+#ifndef CFG_LOW_POWER
+	/* Not every minute when we're waking from deep sleep */
+	anim_play("boot", anim_done);
+#endif
+
+#ifdef CFG_LOW_POWER
+	if (!lowpower_need_sync(get_time())) {
+		lowpower_sleep();
+		return;
+	}
+
+	os_timer_setfn(&sleep_timer, lowpower_check, NULL);
+	os_timer_arm(&sleep_timer, LOW_POWER_POLL_MS, 1);
+#endif
 
 	wifi_init();
 
+	os_timer_setfn(&boot.timer, boot_check, NULL);
+	os_timer_arm(&boot.timer, BOOT_CHECK_MS, 1);
 	os_timer_setfn(&update_timer, update_func, NULL);
 	os_timer_arm(&update_timer, 10000 /* 10s */, 1);
 }
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Most of the time between boot and a synced clock goes on scanning every
+ * channel for the AP and then a DHCP exchange. Neither changes much from
+ * one boot to the next, so we remember the AP and channel we last joined,
+ * and the lease we were given, in RTC memory. The next boot asks for that
+ * AP directly on that channel and, if the lease should still be good,
+ * configures the address itself instead of asking DHCP for it again.
+ *
+ * If that doesn't get us an address quickly we forget the cache and fall
+ * back to a full scan and DHCP. Once connected on a cached address, DHCP is
+ * started again when the lease runs out, or at the first disconnect.
+ */
+#include <stdint.h>
+
+#include <user_interface.h>
+#include <espconn.h>
+#include <osapi.h>
+
+#include "clock.h"
+#include "project_config.h"
+#include "rtcmem.h"
+#include "wificache.h"
+
+#ifndef CFG_WIFI_LEASE
+/*
+ * Seconds after DHCP hands out an address that we'll carry on using it
+ * without asking again. Keep it within the DHCP server's lease time; the
+ * default is no longer than the shortest leases routers commonly hand
+ * out. 0 always uses DHCP.
+ */
+#define CFG_WIFI_LEASE		(1 * 3600)
+#endif
+
+/* How long the cached details get before we scan instead */
+#define WIFICACHE_TIMEOUT_MS	5000
+/* How often to check whether a cached address is still good */
+#define WIFICACHE_LEASE_MS	(60 * 1000)
+
+struct wificache_rec {
+	uint32_t id;		/* Of the SSID and password it's for */
+	uint8_t bssid[6];
+	uint8_t channel;
+	uint8_t pad;
+	uint32_t ip, mask, gw, dns;
+	uint32_t leased;	/* UTC seconds; 0 if we don't know */
+};
+
+static struct {
+	struct wificache_rec rec;
+	struct station_config *cfg;
+	bool trying;		/* Connecting with the cached details */
+	bool static_ip;		/* ...including the address */
+	bool failed;		/* They didn't work */
+	bool used;		/* They did */
+	bool dropped;		/* Disconnected since we last had an address */
+	uint8_t bssid[6];	/* Of the AP we're connected to */
+	uint8_t channel;
+	uint32_t got_ip;	/* Uptime DHCP last answered at */
+	os_timer_t timer;
+	os_timer_t lease_timer;
+} wc;
+
+/* FNV-1a */
+static uint32_t ICACHE_FLASH_ATTR wificache_id(const struct station_config *cfg)
+{
+	uint32_t hash = 2166136261;
+	int i;
+
+	for (i = 0; i < sizeof(cfg->ssid); i++) {
+		hash ^= cfg->ssid[i];
+		hash *= 16777619;
+	}
+	for (i = 0; i < sizeof(cfg->password); i++) {
+		hash ^= cfg->password[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static void ICACHE_FLASH_ATTR wificache_fallback(void *arg)
+{
+	os_timer_disarm(&wc.timer);
+	if (!wc.trying) {
+		return;
+	}
+
+	os_printf("Cached AP didn't work, scanning.\n");
+	wc.trying = false;
+	wc.failed = true;
+
+	/* Don't waste time on it again next boot */
+	wc.rec.id = 0;
+	rtcmem_save(RTCMEM_WIFI, &wc.rec, sizeof(wc.rec));
+
+	wifi_station_disconnect();
+	if (wc.static_ip) {
+		wc.static_ip = false;
+		wifi_station_dhcpc_start();
+	}
+	wc.cfg->bssid_set = 0;
+	wifi_station_set_config(wc.cfg);
+	wifi_station_connect();
+}
+
+/*
+ * Stop using the cached address and ask DHCP for one, when the lease is up
+ * or we've been dropped (and so may not get the same address back). Also
+ * dates a lease DHCP gave us before the clock was set, once it is.
+ */
+static void ICACHE_FLASH_ATTR wificache_lease_func(void *arg)
+{
+	if (wc.static_ip && (wc.dropped || (clock_is_set() &&
+			get_time() - wc.rec.leased >= CFG_WIFI_LEASE))) {
+		os_printf(wc.dropped ? "Dropped; asking DHCP for an address.\n" :
+			"Cached address expired; asking DHCP.\n");
+		wc.static_ip = false;
+		wifi_station_dhcpc_start();
+	}
+
+	if (!wc.static_ip && wc.rec.leased == 0 && clock_is_set()) {
+		wc.rec.leased = get_time() - (get_uptime() - wc.got_ip);
+		rtcmem_save(RTCMEM_WIFI, &wc.rec, sizeof(wc.rec));
+	}
+
+	/* Nothing left to keep an eye on */
+	if (!wc.static_ip && wc.rec.leased != 0) {
+		os_timer_disarm(&wc.lease_timer);
+	}
+}
+
+void ICACHE_FLASH_ATTR wificache_connect(struct station_config *cfg)
+{
+	struct ip_info info;
+	ip_addr_t dns;
+	uint64_t now = get_time();
+
+	wc.cfg = cfg;
+	os_timer_setfn(&wc.timer, wificache_fallback, NULL);
+	os_timer_setfn(&wc.lease_timer, wificache_lease_func, NULL);
+
+	if (!rtcmem_load(RTCMEM_WIFI, &wc.rec, sizeof(wc.rec)) ||
+			wc.rec.id != wificache_id(cfg) ||
+			wc.rec.channel < 1 || wc.rec.channel > 14) {
+		cfg->bssid_set = 0;
+		wifi_station_set_config(cfg);
+		return;
+	}
+
+	os_printf("Trying cached AP %02x:%02x:%02x:%02x:%02x:%02x on "
+		"channel %d.\n",
+		wc.rec.bssid[0], wc.rec.bssid[1], wc.rec.bssid[2],
+		wc.rec.bssid[3], wc.rec.bssid[4], wc.rec.bssid[5],
+		wc.rec.channel);
+
+	if (wc.rec.leased != 0 && clock_is_set() &&
+			now - wc.rec.leased < CFG_WIFI_LEASE) {
+		info.ip.addr = wc.rec.ip;
+		info.netmask.addr = wc.rec.mask;
+		info.gw.addr = wc.rec.gw;
+		dns.addr = wc.rec.dns;
+		wifi_station_dhcpc_stop();
+		wifi_set_ip_info(STATION_IF, &info);
+		espconn_dns_setserver(0, &dns);
+		wc.static_ip = true;
+	}
+
+	/* Only for this boot; the copy in flash keeps scanning for any AP */
+	cfg->bssid_set = 1;
+	os_memcpy(cfg->bssid, wc.rec.bssid, sizeof(cfg->bssid));
+	wifi_station_set_config_current(cfg);
+	wifi_set_channel(wc.rec.channel);
+
+	wc.trying = true;
+	os_timer_arm(&wc.timer, WIFICACHE_TIMEOUT_MS, 0);
+}
+
+void ICACHE_FLASH_ATTR wificache_event(System_Event_t *evt)
+{
+	switch (evt->event) {
+	case EVENT_STAMODE_CONNECTED:
+		os_memcpy(wc.bssid, evt->event_info.connected.bssid,
+			sizeof(wc.bssid));
+		wc.channel = evt->event_info.connected.channel;
+		break;
+	case EVENT_STAMODE_DISCONNECTED:
+		/* Not from inside the SDK's callback */
+		if (wc.trying) {
+			os_timer_disarm(&wc.timer);
+			os_timer_arm(&wc.timer, 0, 0);
+		} else if (wc.static_ip && !wc.dropped) {
+			wc.dropped = true;
+			os_timer_disarm(&wc.lease_timer);
+			os_timer_arm(&wc.lease_timer, 0, 0);
+		}
+		break;
+	case EVENT_STAMODE_GOT_IP:
+		if (wc.trying) {
+			os_timer_disarm(&wc.timer);
+			wc.trying = false;
+			wc.used = true;
+		}
+
+		wc.rec.id = wificache_id(wc.cfg);
+		os_memcpy(wc.rec.bssid, wc.bssid, sizeof(wc.rec.bssid));
+		wc.rec.channel = wc.channel;
+		/* Otherwise it's the lease we had before, and as old */
+		if (!wc.static_ip) {
+			wc.rec.ip = evt->event_info.got_ip.ip.addr;
+			wc.rec.mask = evt->event_info.got_ip.mask.addr;
+			wc.rec.gw = evt->event_info.got_ip.gw.addr;
+			wc.rec.dns = espconn_dns_getserver(0).addr;
+			/* If the clock isn't set yet, the lease timer dates it */
+			wc.rec.leased = clock_is_set() ? get_time() : 0;
+			wc.got_ip = get_uptime();
+		}
+		wc.dropped = false;
+		rtcmem_save(RTCMEM_WIFI, &wc.rec, sizeof(wc.rec));
+
+		os_timer_disarm(&wc.lease_timer);
+		if (wc.static_ip || wc.rec.leased == 0) {
+			os_timer_arm(&wc.lease_timer, WIFICACHE_LEASE_MS, 1);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* How we came to be connected, for the boot timings */
+const char ICACHE_FLASH_ATTR *wificache_how(void)
+{
+	if (wc.used) {
+		return wc.static_ip ? "cached AP and address" : "cached AP";
+	}
+
+	return wc.failed ? "scan, cached AP failed" : "scan";
+}
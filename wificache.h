@@ -0,0 +1,26 @@
+/*
+ * Copyright 2019 Jonathan McDowell <noodles@earth.li>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _WIFICACHE_H_
+#define _WIFICACHE_H_
+
+#include <user_interface.h>
+
+void ICACHE_FLASH_ATTR wificache_connect(struct station_config *cfg);
+void ICACHE_FLASH_ATTR wificache_event(System_Event_t *evt);
+const char ICACHE_FLASH_ATTR *wificache_how(void);
+
+#endif /* _WIFICACHE_H_ */